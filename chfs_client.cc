@@ -9,14 +9,63 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include "slock.h"
+
+// number of entries fetched per readdir round trip
+#define READDIR_PAGE 128
+
+// page cache and readahead tuning
+#define RA_PAGE         4096    // cache page size in bytes
+#define RA_MIN_PAGES    4       // initial sequential window (16 KB)
+#define RA_MAX_PAGES    64      // largest window (256 KB)
+#define RA_THREADS      4       // concurrent readahead fetches
+#define CACHE_MAX_PAGES 1024    // cache capacity (4 MB)
+
+#define MIN(a, b) ((a)<(b) ? (a) : (b))
+
+chfs_client::rastate::rastate()
+    : next(0), window(0), ra_next(0), eof_page(ULLONG_MAX), gen(0)
+{
+}
+
+void chfs_client::init_cache()
+{
+    VERIFY(pthread_mutex_init(&cache_m_, 0) == 0);
+    VERIFY(pthread_cond_init(&cache_c_, 0) == 0);
+    cache_gen_ = 0;
+    ra_pool_ = new ThrPool(RA_THREADS, false);
+}
+
+chfs_client::chfs_client()
+{
+    init_cache();
+    ec = new extent_client();
+    if (ec->put(1, "") != extent_protocol::OK)
+        printf("error init root dir\n"); // XYB: init root dir
+}
 
 chfs_client::chfs_client(std::string extent_dst)
 {
+    init_cache();
     ec = new extent_client(extent_dst);
     if (ec->put(1, "") != extent_protocol::OK)
         printf("error init root dir\n"); // XYB: init root dir
 }
 
+// Deleting the pool waits for the readahead jobs still queued or running,
+// which use ec and the cache, before either goes.
+chfs_client::~chfs_client()
+{
+    delete ra_pool_;
+    delete ec;
+    pages_.clear();
+    lru_.clear();
+    ra_.clear();
+    VERIFY(pthread_cond_destroy(&cache_c_) == 0);
+    VERIFY(pthread_mutex_destroy(&cache_m_) == 0);
+}
+
 chfs_client::inum chfs_client::n2i(std::string n) {
     std::istringstream ist(n);
     unsigned long long finum;
@@ -132,6 +181,7 @@ int chfs_client::setattr(inum ino, size_t size) {
     if (ec->put(ino, buf) != OK) {
         return IOERR;
     }
+    invalidate(ino);
     return r;
 }
 
@@ -199,24 +249,26 @@ int chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_ou
      * note: lookup file from parent dir according to name;
      * you should design the format of directory content.
      */
-    extent_protocol::attr a;
-    ec->getattr(parent, a);
-    if (a.type != extent_protocol::T_DIR) {
-        return IOERR;
-    }
+    found = false;
+    ino_out = 0;
 
+    // scan the directory page by page and stop at the first match
     std::list <dirent> dirents;
-    readdir(parent, dirents);
     std::list<dirent>::iterator iter;
-    found = false;
-    ino_out = 0;
-    for (iter = dirents.begin(); iter != dirents.end(); iter++) {
-        if (std::string(name) == iter->name) {
-            found = true;
-            ino_out = iter->inum;
-            break;
+    unsigned long long cookie = 0;
+    do {
+        if (readdir(parent, cookie, READDIR_PAGE, dirents) != OK) {
+            return IOERR;
         }
-    }
+        for (iter = dirents.begin(); iter != dirents.end(); iter++) {
+            if (std::string(name) == iter->name) {
+                found = true;
+                ino_out = iter->inum;
+                return r;
+            }
+            cookie = iter->cookie;
+        }
+    } while (dirents.size() == READDIR_PAGE);
     return r;
 }
 
@@ -228,28 +280,41 @@ int chfs_client::readdir(inum dir, std::list <dirent> &list) {
      * note: you should parse the dirctory content using your defined format,
      * and push the dirents to the list.
      */
-    extent_protocol::attr a;
-    ec->getattr(dir, a);
-    if (a.type != extent_protocol::T_DIR) {
+    std::list <dirent> page;
+    unsigned long long cookie = 0;
+    size_t n;
+    list.clear();
+    do {
+        if ((r = readdir(dir, cookie, READDIR_PAGE, page)) != OK) {
+            return r;
+        }
+        n = page.size();
+        if (n > 0) {
+            cookie = page.back().cookie;
+        }
+        list.splice(list.end(), page);
+    } while (n == READDIR_PAGE);
+    return r;
+}
+
+// Return up to n entries of dir following the entry whose cookie is
+// @cookie (0 starts from the beginning). Fewer than n entries means the
+// listing is complete.
+int chfs_client::readdir(inum dir, unsigned long long cookie, unsigned int n,
+                         std::list <dirent> &list) {
+    std::vector <extent_protocol::dirent> ents;
+    list.clear();
+    if (ec->readdir(dir, cookie, n, ents) != extent_protocol::OK) {
         return IOERR;
     }
-
-    std::string buf;
-    ec->get(dir, buf);
-    int len = buf.length();
-    int now = 0;
     dirent now_dirent;
-    list.clear();
-    while (now < len) {
-        size_t end = buf.find('^', now);
-        size_t div = buf.find('`', now);
-        if (end == std::string::npos || div == std::string::npos) break;
-        now_dirent.name = buf.substr(now, div - now);  //now ~ div-1
-        now_dirent.inum = n2i(buf.substr(div + 1, end - div - 1));  // div+1 ~ end-1
+    for (size_t i = 0; i < ents.size(); i++) {
+        now_dirent.name = ents[i].name;
+        now_dirent.inum = ents[i].inum;
+        now_dirent.cookie = ents[i].cookie;
         list.push_back(now_dirent);
-        now = end + 1;
     }
-    return r;
+    return OK;
 }
 
 int chfs_client::read(inum ino, size_t size, off_t off, std::string &data) {
@@ -259,20 +324,196 @@ int chfs_client::read(inum ino, size_t size, off_t off, std::string &data) {
      * your code goes here.
      * note: read using ec->get().
      */
-    std::string buf;
-    extent_protocol::status ret = ec->get(ino, buf);
-    if (ret != extent_protocol::OK) {
-        return IOERR;
+    data.clear();
+    if (size == 0) {
+        return r;
+    }
+    unsigned long long first = off / RA_PAGE;
+    unsigned long long last = (off + size - 1) / RA_PAGE;
+
+    // a read starting where the previous one ended grows the window,
+    // anything else halves it and drops readahead once it gets small.
+    rajob *job = NULL;
+    {
+        ScopedLock cl(&cache_m_);
+        rastate &st = ra(ino);
+        if ((unsigned long long) off == st.next) {
+            st.window = st.window ? MIN(st.window * 2, RA_MAX_PAGES) : RA_MIN_PAGES;
+        } else {
+            st.window /= 2;
+            if (st.window < RA_MIN_PAGES)
+                st.window = 0;
+            st.ra_next = 0;
+        }
+        st.next = off + size;
+        if (st.window > 0) {
+            if (st.ra_next <= last)
+                st.ra_next = last + 1;
+            unsigned long long target = MIN(last + 1 + st.window, st.eof_page);
+            // top up once less than half a window is prefetched ahead
+            if (st.ra_next < target && target - st.ra_next > st.window / 2) {
+                job = new rajob();
+                job->ino = ino;
+                job->first = st.ra_next;
+                job->n = target - st.ra_next;
+                st.ra_next = target;
+            }
+        }
+    }
+    if (job && !ra_pool_->addObjJob(this, &chfs_client::readahead, job)) {
+        delete job;
     }
-    if ((uint32_t) off >= buf.size()) {
-        //     std::cout << "chfs_client::read: @off is greater than the size of file, read zero bytes." << std::endl;
+
+    // one round trip for whatever the readahead has not already covered
+    if ((r = fetch_pages(ino, first, last - first + 1)) != OK) {
         return r;
     }
-    data = buf.substr(off, size);
+    for (unsigned long long p = first; p <= last; p++) {
+        std::string page;
+        if ((r = get_page(ino, p, page)) != OK) {
+            return r;
+        }
+        size_t from = p == first ? off % RA_PAGE : 0;
+        if (page.size() > from) {
+            data.append(page, from, MIN(page.size() - from, size - data.size()));
+        }
+        if (page.size() < RA_PAGE) {
+            break;  // end of file
+        }
+    }
     //std::cout << "chfs_client::read:" << ino << " " << size << " " << off << " " << data << std::endl;
     return r;
 }
 
+// Claim the pages of [first, first + n) that are neither cached nor in
+// flight and fetch them with a single range read.
+int chfs_client::fetch_pages(inum ino, unsigned long long first, unsigned n) {
+    std::vector<bool> mine(n, false);
+    unsigned long long lo = ULLONG_MAX, hi = 0;
+    unsigned gen;
+    {
+        ScopedLock cl(&cache_m_);
+        gen = ra(ino).gen;
+        for (unsigned i = 0; i < n; i++) {
+            pagekey key(ino, first + i);
+            if (pages_.find(key) != pages_.end())
+                continue;
+            cpage &cp = pages_[key];
+            cp.ready = false;
+            cp.gen = gen;
+            mine[i] = true;
+            lo = MIN(lo, first + i);
+            hi = first + i;
+        }
+    }
+    if (lo > hi) {
+        return OK;
+    }
+
+    std::string buf;
+    extent_protocol::status ret = ec->read(ino, lo * RA_PAGE, (hi - lo + 1) * RA_PAGE, buf);
+
+    ScopedLock cl(&cache_m_);
+    for (unsigned long long p = lo; p <= hi; p++) {
+        if (!mine[p - first])
+            continue;
+        std::map<pagekey, cpage>::iterator it = pages_.find(pagekey(ino, p));
+        // skip pages dropped or re-claimed after an invalidate
+        if (it == pages_.end() || it->second.ready || it->second.gen != gen)
+            continue;
+        if (ret != extent_protocol::OK) {
+            pages_.erase(it);
+            continue;
+        }
+        size_t from = (p - lo) * RA_PAGE;
+        if (from < buf.size())
+            it->second.data = buf.substr(from, RA_PAGE);
+        it->second.ready = true;
+        it->second.lru = lru_.insert(lru_.end(), it->first);
+        if (it->second.data.size() < RA_PAGE) {
+            rastate &st = ra(ino);
+            if (st.gen == gen && p + 1 < st.eof_page)
+                st.eof_page = p + 1;
+        }
+    }
+    evict();
+    VERIFY(pthread_cond_broadcast(&cache_c_) == 0);
+    return ret == extent_protocol::OK ? OK : IOERR;
+}
+
+// Copy out cached page p of ino, waiting for an in-flight fetch and
+// refetching it if that fetch was dropped.
+int chfs_client::get_page(inum ino, unsigned long long p, std::string &page) {
+    int r;
+    VERIFY(pthread_mutex_lock(&cache_m_) == 0);
+    while (1) {
+        std::map<pagekey, cpage>::iterator it = pages_.find(pagekey(ino, p));
+        if (it == pages_.end()) {
+            VERIFY(pthread_mutex_unlock(&cache_m_) == 0);
+            if ((r = fetch_pages(ino, p, 1)) != OK)
+                return r;
+            VERIFY(pthread_mutex_lock(&cache_m_) == 0);
+        } else if (!it->second.ready) {
+            VERIFY(pthread_cond_wait(&cache_c_, &cache_m_) == 0);
+        } else {
+            page = it->second.data;
+            lru_.splice(lru_.end(), lru_, it->second.lru);
+            break;
+        }
+    }
+    VERIFY(pthread_mutex_unlock(&cache_m_) == 0);
+    return OK;
+}
+
+void chfs_client::readahead(rajob *job) {
+    fetch_pages(job->ino, job->first, job->n);
+    delete job;
+}
+
+// assumes cache_m_ is held
+void chfs_client::evict() {
+    while (lru_.size() > CACHE_MAX_PAGES) {
+        pages_.erase(lru_.front());
+        lru_.pop_front();
+    }
+}
+
+// The access state of ino, made afresh under the current cache_gen_ if
+// ino has none. Assumes cache_m_ is held.
+chfs_client::rastate &chfs_client::ra(inum ino) {
+    std::map<inum, rastate>::iterator it = ra_.find(ino);
+    if (it == ra_.end()) {
+        it = ra_.insert(std::make_pair(ino, rastate())).first;
+        it->second.gen = cache_gen_;
+    }
+    return it->second;
+}
+
+// Drop every cached page of ino and its access state. A later read
+// starts a new rastate under a newer generation, so fetches already in
+// flight cannot fill its pages.
+void chfs_client::invalidate(inum ino) {
+    ScopedLock cl(&cache_m_);
+    ra_.erase(ino);
+    cache_gen_++;
+
+    std::map<pagekey, cpage>::iterator it = pages_.lower_bound(pagekey(ino, 0));
+    while (it != pages_.end() && it->first.first == ino) {
+        if (it->second.ready)
+            lru_.erase(it->second.lru);
+        pages_.erase(it++);
+    }
+    VERIFY(pthread_cond_broadcast(&cache_c_) == 0);
+}
+
+// Cached pages are only trusted between an open and the next write
+// through this client (close-to-open consistency), so other clients'
+// writes become visible on the next open.
+int chfs_client::open(inum ino) {
+    invalidate(ino);
+    return OK;
+}
+
 int chfs_client::write(inum ino, size_t size, off_t off, const char *data,
                        size_t &bytes_written) {
     int r = OK;
@@ -297,6 +538,7 @@ int chfs_client::write(inum ino, size_t size, off_t off, const char *data,
     bytes_written = size;
 
     ret = ec->put(ino, buf);
+    invalidate(ino);
     if (ret != extent_protocol::OK) {
         return IOERR;
     }
@@ -320,21 +562,34 @@ int chfs_client::unlink(inum parent, const char *name) {
         return r;
     }
     ec->remove(node);
+    invalidate(node);
 
     std::string buf;
     if (ec->get(parent, buf) != OK) {
         return IOERR;
     }
-    int len = buf.length();
-    size_t from = buf.find(name);
-    if (from == std::string::npos) {
-        return r;
+    // find the entry itself, not a name that merely contains it
+    std::string key = std::string(name) + "`";
+    size_t from = 0;
+    while (buf.compare(from, key.size(), key) != 0) {
+        from = buf.find('^', from);
+        if (from == std::string::npos) {
+            return r;
+        }
+        from++;
     }
     size_t to = buf.find('^', from);
     if (to == std::string::npos) {
-        buf.erase(from, len - from + 1);
-    } else {
-        buf.erase(from, to - from + 1);
+        to = buf.size();
+    }
+    // blank the entry instead of cutting it out: readdir cookies are byte
+    // offsets, and a listing in progress still holds some past this one.
+    // the empty name marks it for readdir to skip.
+    buf.replace(from, to - from, to - from, ' ');
+    buf[from] = '`';
+    if (buf.find_first_not_of("` ^") == std::string::npos) {
+        // nothing but tombstones left
+        buf.clear();
     }
     ec->put(parent, buf);
     return r;
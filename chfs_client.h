@@ -5,6 +5,10 @@
 //#include "chfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <list>
+#include <map>
+#include <pthread.h>
+#include "thr_pool.h"
 
 
 class chfs_client {
@@ -31,6 +35,7 @@ public:
     struct dirent {
         std::string name;
         chfs_client::inum inum;
+        unsigned long long cookie;  // resume readdir after this entry
     };
 
 private:
@@ -38,12 +43,53 @@ private:
 
     static inum n2i(std::string);
 
+    // client-side page cache, filled by reads and by sequential readahead
+    typedef std::pair<inum, unsigned long long> pagekey;
+    struct cpage {
+        std::string data;   // shorter than a page at end of file
+        bool ready;         // false while a fetch is in flight
+        unsigned gen;       // file generation the fetch was issued under
+        std::list<pagekey>::iterator lru;
+    };
+    // per-file sequential access detection
+    struct rastate {
+        rastate();
+        unsigned long long next;     // offset just past the previous read
+        unsigned window;             // readahead window in pages, 0 = off
+        unsigned long long ra_next;  // first page not yet prefetched
+        unsigned long long eof_page; // pages from here on are past EOF
+        unsigned gen;                // bumped whenever cached pages go stale
+    };
+    struct rajob {
+        inum ino;
+        unsigned long long first;
+        unsigned n;
+    };
+
+    std::map<pagekey, cpage> pages_;
+    std::list<pagekey> lru_;
+    std::map<inum, rastate> ra_;  // only files read since their last invalidate
+    unsigned cache_gen_;        // bumped by every invalidate, seeds a new rastate
+    pthread_mutex_t cache_m_;   // protects pages_, lru_, ra_ and cache_gen_
+    pthread_cond_t cache_c_;    // a page fetch completed or was dropped
+    ThrPool *ra_pool_;
+
+    void init_cache();
+    rastate &ra(inum);
+    void invalidate(inum);
+    int fetch_pages(inum, unsigned long long, unsigned);
+    int get_page(inum, unsigned long long, std::string &);
+    void readahead(rajob *);
+    void evict();
+
  public:
   chfs_client(std::string);
     chfs_client();
 
     chfs_client(std::string, std::string);
 
+    ~chfs_client();
+
     bool isfile(inum);
 
     bool isdir(inum);
@@ -60,10 +106,14 @@ private:
 
     int readdir(inum, std::list <dirent> &);
 
+    int readdir(inum, unsigned long long, unsigned int, std::list <dirent> &);
+
     int write(inum, size_t, off_t, const char *, size_t &);
 
     int read(inum, size_t, off_t, std::string &);
 
+    int open(inum);
+
     int unlink(inum, const char *);
 
     int mkdir(inum, const char *, mode_t, inum &);
@@ -0,0 +1,399 @@
+// fio-style data path benchmark for chfs.
+//
+// Runs sequential and random write/read phases against one file per
+// thread at one of three layers:
+//
+//   im    inode_manager called directly (writes are whole-file write_file)
+//   ec    extent_client over rpc (writes are get + patch + put)
+//   chfs  chfs_client (write/read at an offset)
+//
+// and reports MB/s, IOPS and latency percentiles per phase, as a table or
+// as JSON (-j) for diffing between builds.
+//
+//   chfs_iobench [-l im|ec|chfs] [-p pattern,...] [-b bs] [-s filesize]
+//                [-t threads] [-n passes] [-j] [-v] [port,...]
+//
+// patterns are seqwrite, seqread, randwrite and randread. For ec and chfs,
+// without a port an extent server is started in this process (ec still
+// goes through rpcc/rpcs over loopback; chfs calls it directly).
+
+#include "chfs_client.h"
+#include "extent_client.h"
+#include "extent_server.h"
+#include "inode_manager.h"
+#include "rpcstat.h"
+#include "slock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+// how a benchmark reaches one file at the layer under test
+class iolayer {
+	public:
+		virtual ~iolayer() {}
+		virtual unsigned long long create() = 0;
+		virtual bool write(unsigned long long f, size_t off, const std::string &buf) = 0;
+		virtual bool read(unsigned long long f, size_t off, size_t n, std::string &buf) = 0;
+};
+
+// inode_manager is not thread safe, so calls are serialised the same way
+// extent_server does it.
+class im_layer : public iolayer {
+	public:
+		im_layer() {
+			VERIFY(pthread_mutex_init(&m_, 0) == 0);
+			im_ = new inode_manager();
+		}
+		unsigned long long create() {
+			ScopedLock ml(&m_);
+			return im_->alloc_inode(extent_protocol::T_FILE);
+		}
+		bool write(unsigned long long f, size_t off, const std::string &buf) {
+			ScopedLock ml(&m_);
+			char *cbuf = NULL;
+			int size = 0;
+			im_->read_file(f, &cbuf, &size);
+			std::string data;
+			if (size > 0) {
+				data.assign(cbuf, size);
+				free(cbuf);
+			}
+			if (data.size() < off + buf.size())
+				data.resize(off + buf.size());
+			data.replace(off, buf.size(), buf);
+			im_->write_file(f, data.data(), data.size());
+			return true;
+		}
+		bool read(unsigned long long f, size_t off, size_t n, std::string &buf) {
+			ScopedLock ml(&m_);
+			char *cbuf = NULL;
+			int size = 0;
+			im_->read_file_range(f, off, n, &cbuf, &size);
+			buf.clear();
+			if (size > 0) {
+				buf.assign(cbuf, size);
+				free(cbuf);
+			}
+			return true;
+		}
+	private:
+		pthread_mutex_t m_;
+		inode_manager *im_;
+};
+
+class ec_layer : public iolayer {
+	public:
+		ec_layer(std::string dst) { ec_ = new extent_client(dst); }
+		unsigned long long create() {
+			extent_protocol::extentid_t id = 0;
+			ec_->create(extent_protocol::T_FILE, id);
+			return id;
+		}
+		// the extent protocol only stores whole files
+		bool write(unsigned long long f, size_t off, const std::string &buf) {
+			std::string data;
+			if (ec_->get(f, data) != extent_protocol::OK)
+				return false;
+			if (data.size() < off + buf.size())
+				data.resize(off + buf.size());
+			data.replace(off, buf.size(), buf);
+			return ec_->put(f, data) == extent_protocol::OK;
+		}
+		bool read(unsigned long long f, size_t off, size_t n, std::string &buf) {
+			return ec_->read(f, off, n, buf) == extent_protocol::OK;
+		}
+	private:
+		extent_client *ec_;
+};
+
+class chfs_layer : public iolayer {
+	public:
+		chfs_layer(chfs_client *c) : chfs_(c) {}
+		unsigned long long create() {
+			char name[64];
+			chfs_client::inum ino = 0;
+			sprintf(name, "iobench.%d.%d", getpid(), n_++);
+			chfs_->create(1, name, 0644, ino);
+			chfs_->open(ino);
+			return ino;
+		}
+		bool write(unsigned long long f, size_t off, const std::string &buf) {
+			size_t written = 0;
+			return chfs_->write(f, buf.size(), off, buf.data(), written) == chfs_client::OK
+				&& written == buf.size();
+		}
+		bool read(unsigned long long f, size_t off, size_t n, std::string &buf) {
+			return chfs_->read(f, n, off, buf) == chfs_client::OK;
+		}
+	private:
+		chfs_client *chfs_;
+		int n_ = 0;
+};
+
+enum pattern { SEQWRITE, SEQREAD, RANDWRITE, RANDREAD, NPATTERNS };
+static const char *patnames[NPATTERNS] = { "seqwrite", "seqread", "randwrite", "randread" };
+
+static iolayer *layer;
+static std::vector<int> patterns;
+static size_t bs = 4096;
+static size_t filesize = 64 * 1024;
+static int nthreads = 1;
+static int passes = 4;
+
+struct worker {
+	pthread_t th;
+	unsigned long long file;
+	unsigned int seed;
+	std::vector<rpc_hist> h;
+	std::vector<int> errors;
+	std::vector<uint64_t> start, end;  // per phase, ns
+};
+
+static pthread_barrier_t phase_b;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t
+ops_per_phase()
+{
+	return passes * ((filesize + bs - 1) / bs);
+}
+
+static void *
+run_worker(void *arg)
+{
+	worker *w = (worker *) arg;
+	size_t nblocks = (filesize + bs - 1) / bs;
+	std::string wbuf(bs, 'x');
+	std::string rbuf;
+
+	for (size_t p = 0; p < patterns.size(); p++) {
+		pthread_barrier_wait(&phase_b);
+		int pat = patterns[p];
+		w->start[p] = now_ns();
+		for (size_t i = 0; i < ops_per_phase(); i++) {
+			size_t blk = (pat == SEQWRITE || pat == SEQREAD) ?
+				i % nblocks : rand_r(&w->seed) % nblocks;
+			size_t off = blk * bs;
+			size_t n = std::min(bs, filesize - off);
+			bool ok;
+			uint64_t t0 = now_ns();
+			if (pat == SEQWRITE || pat == RANDWRITE) {
+				wbuf[0] = 'a' + i % 26;
+				ok = layer->write(w->file, off, n == bs ? wbuf : wbuf.substr(0, n));
+			} else {
+				ok = layer->read(w->file, off, n, rbuf) && rbuf.size() == n;
+			}
+			w->h[p].add(now_ns() - t0);
+			if (!ok)
+				w->errors[p]++;
+		}
+		w->end[p] = now_ns();
+		pthread_barrier_wait(&phase_b);
+	}
+	return 0;
+}
+
+static void
+report(FILE *out, const char *lname, std::vector<worker> &ws,
+		std::vector<uint64_t> &wall, bool json)
+{
+	if (json) {
+		fprintf(out, "{\"layer\": \"%s\", \"threads\": %d, \"bs\": %zu, "
+				"\"filesize\": %zu, \"passes\": %d, \"results\": [",
+				lname, nthreads, bs, filesize, passes);
+	} else {
+		fprintf(out, "layer %s, %d threads, bs %zu, file %zu, %d passes\n",
+				lname, nthreads, bs, filesize, passes);
+		fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s\n", "pattern",
+				"MB/s", "IOPS", "mean(us)", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+	}
+	for (size_t p = 0; p < patterns.size(); p++) {
+		rpc_hist all;
+		int errors = 0;
+		for (size_t i = 0; i < ws.size(); i++) {
+			all.merge(ws[i].h[p]);
+			errors += ws[i].errors[p];
+		}
+		double secs = wall[p] / 1e9;
+		double iops = secs > 0 ? all.n / secs : 0;
+		double mbps = iops * bs / (1024 * 1024);
+		if (json) {
+			fprintf(out, "%s\n  {\"pattern\": \"%s\", \"ops\": %llu, \"errors\": %d, "
+					"\"secs\": %.6f, \"mbps\": %.3f, \"iops\": %.1f, "
+					"\"lat_us\": {\"mean\": %.2f, \"min\": %.2f, \"p50\": %.2f, "
+					"\"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}}",
+					p ? "," : "", patnames[patterns[p]],
+					(unsigned long long) all.n, errors, secs, mbps, iops,
+					all.mean() / 1e3, all.min / 1e3, all.pct(0.50) / 1e3,
+					all.pct(0.90) / 1e3, all.pct(0.99) / 1e3,
+					all.pct(0.999) / 1e3, all.max / 1e3);
+		} else {
+			fprintf(out, "%-10s %10.2f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+					patnames[patterns[p]], mbps, iops, all.mean() / 1e3,
+					all.pct(0.50) / 1e3, all.pct(0.99) / 1e3,
+					all.pct(0.999) / 1e3, all.max / 1e3);
+			if (errors)
+				fprintf(out, "%-10s %d operations failed\n", "", errors);
+		}
+	}
+	if (json)
+		fprintf(out, "\n]}\n");
+	fflush(out);
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "Usage: chfs_iobench [-l im|ec|chfs] [-p pattern,...] [-b bs] "
+			"[-s filesize] [-t threads] [-n passes] [-j] [-v] "
+			"[port-extent-server[,port...]]\n");
+	exit(1);
+}
+
+// serve the extent protocol on port from this process, as extent_smain does
+static void
+start_server(int port)
+{
+	rpcs *server = new rpcs(port);
+	extent_server *es = new extent_server();
+	server->reg(extent_protocol::get, es, &extent_server::get);
+	server->reg(extent_protocol::getattr, es, &extent_server::getattr);
+	server->reg(extent_protocol::put, es, &extent_server::put);
+	server->reg(extent_protocol::remove, es, &extent_server::remove);
+	server->reg(extent_protocol::create, es, &extent_server::create);
+	server->reg(extent_protocol::readdir, es, &extent_server::readdir);
+	server->reg(extent_protocol::read, es, &extent_server::read);
+}
+
+int
+main(int argc, char *argv[])
+{
+	std::string lname = "chfs";
+	bool json = false;
+	bool verbose = false;
+	int ch;
+	while ((ch = getopt(argc, argv, "l:p:b:s:t:n:jv")) != -1) {
+		switch (ch) {
+		case 'l':
+			lname = optarg;
+			break;
+		case 'p': {
+			std::istringstream ist(optarg);
+			std::string s;
+			while (std::getline(ist, s, ',')) {
+				int p;
+				for (p = 0; p < NPATTERNS; p++)
+					if (s == patnames[p])
+						break;
+				if (p == NPATTERNS)
+					usage();
+				patterns.push_back(p);
+			}
+			break;
+		}
+		case 'b':
+			bs = atoi(optarg);
+			break;
+		case 's':
+			filesize = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			passes = atoi(optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1 || nthreads < 1 || passes < 1 || bs < 1
+			|| filesize < 1 || filesize > MAXFILE * BLOCK_SIZE)
+		usage();
+	if (patterns.empty())
+		for (int p = 0; p < NPATTERNS; p++)
+			patterns.push_back(p);
+
+	// chfs_client and extent_server trace every call on stdout
+	FILE *out = fdopen(dup(1), "w");
+	if (!verbose)
+		VERIFY(freopen("/dev/null", "w", stdout) != NULL);
+
+	srandom(getpid());
+	std::string dst = optind < argc ? argv[optind] : "";
+	if (lname == "im") {
+		if (dst != "")
+			usage();
+		layer = new im_layer();
+	} else if (lname == "ec") {
+		if (dst == "") {
+			int port = 20000 + (getpid() % 10000);
+			start_server(port);
+			std::ostringstream ost;
+			ost << port;
+			dst = ost.str();
+		}
+		layer = new ec_layer(dst);
+	} else if (lname == "chfs") {
+		layer = new chfs_layer(dst == "" ? new chfs_client() : new chfs_client(dst));
+	} else {
+		usage();
+	}
+
+	std::vector<worker> ws(nthreads);
+	for (int i = 0; i < nthreads; i++) {
+		ws[i].file = layer->create();
+		// fill the file so read-only pattern lists see full blocks
+		VERIFY(layer->write(ws[i].file, 0, std::string(filesize, 'p')));
+		ws[i].seed = random();
+		ws[i].h.resize(patterns.size());
+		ws[i].errors.resize(patterns.size());
+		ws[i].start.resize(patterns.size());
+		ws[i].end.resize(patterns.size());
+	}
+
+	VERIFY(pthread_barrier_init(&phase_b, 0, nthreads + 1) == 0);
+	for (int i = 0; i < nthreads; i++)
+		VERIFY(pthread_create(&ws[i].th, 0, run_worker, &ws[i]) == 0);
+	for (size_t p = 0; p < patterns.size(); p++) {
+		pthread_barrier_wait(&phase_b);
+		pthread_barrier_wait(&phase_b);
+	}
+	for (int i = 0; i < nthreads; i++)
+		pthread_join(ws[i].th, 0);
+
+	// a phase runs from its first worker's start to its last one's end;
+	// the barriers here release and notice them late
+	std::vector<uint64_t> wall(patterns.size());
+	for (size_t p = 0; p < patterns.size(); p++) {
+		uint64_t first = UINT64_MAX, last = 0;
+		for (int i = 0; i < nthreads; i++) {
+			first = std::min(first, ws[i].start[p]);
+			last = std::max(last, ws[i].end[p]);
+		}
+		wall[p] = last - first;
+	}
+
+	fflush(stdout);
+	report(out, lname.c_str(), ws, wall, json);
+	return 0;
+}
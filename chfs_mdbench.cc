@@ -0,0 +1,241 @@
+// mdtest-style metadata benchmark for chfs.
+//
+// Drives chfs_client directly (no FUSE mount) from N threads, each working
+// in a private directory, and reports create/stat/lookup/readdir/unlink
+// rates with latency percentiles for every directory size in a sweep.
+//
+//   chfs_mdbench [-t threads] [-n files,files,...] [-r rounds] [-v] [port,...]
+//
+// Without a port the extent server runs in-process; a comma-separated list
+// of ports shards extents across remote extent servers like chfs_client.
+
+#include "chfs_client.h"
+#include "rpcstat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+enum mdop { OP_CREATE, OP_STAT, OP_LOOKUP, OP_READDIR, OP_UNLINK, NOPS };
+static const char *opnames[NOPS] = { "create", "stat", "lookup", "readdir", "unlink" };
+
+static chfs_client *chfs;
+static int nthreads = 4;
+static std::vector<int> sizes;
+static int rounds = 1;
+
+struct worker {
+	pthread_t th;
+	int id;
+	int files;
+	chfs_client::inum dir;
+	rpc_hist h[NOPS];
+	int errors;
+	uint64_t start[NOPS], end[NOPS];  // ns
+};
+
+// all workers start each phase together so the wall time of a phase,
+// from the first worker's start to the last one's end, is the time for
+// every thread to finish its share.
+static pthread_barrier_t phase_b;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+fname(char *buf, int i)
+{
+	// fixed width so no name is a prefix of another
+	sprintf(buf, "f%07d", i);
+}
+
+static void *
+run_worker(void *arg)
+{
+	worker *w = (worker *) arg;
+	char name[32];
+	std::vector<chfs_client::inum> inums(w->files);
+
+	for (int op = 0; op < NOPS; op++) {
+		pthread_barrier_wait(&phase_b);
+		int n = op == OP_READDIR ? 1 : w->files;
+		w->start[op] = now_ns();
+		for (int i = 0; i < n; i++) {
+			fname(name, i);
+			uint64_t t0 = now_ns();
+			int r = chfs_client::OK;
+			switch (op) {
+			case OP_CREATE:
+				r = chfs->create(w->dir, name, 0644, inums[i]);
+				break;
+			case OP_STAT: {
+				chfs_client::fileinfo fin;
+				r = chfs->getfile(inums[i], fin);
+				break;
+			}
+			case OP_LOOKUP: {
+				bool found = false;
+				chfs_client::inum ino;
+				r = chfs->lookup(w->dir, name, found, ino);
+				if (r == chfs_client::OK && (!found || ino != inums[i]))
+					r = chfs_client::NOENT;
+				break;
+			}
+			case OP_READDIR: {
+				std::list<chfs_client::dirent> ents;
+				r = chfs->readdir(w->dir, ents);
+				if (r == chfs_client::OK && (int) ents.size() != w->files)
+					r = chfs_client::IOERR;
+				break;
+			}
+			case OP_UNLINK:
+				r = chfs->unlink(w->dir, name);
+				break;
+			}
+			w->h[op].add(now_ns() - t0);
+			if (r != chfs_client::OK)
+				w->errors++;
+		}
+		w->end[op] = now_ns();
+		pthread_barrier_wait(&phase_b);
+	}
+	return 0;
+}
+
+static void
+report(FILE *out, int files, std::vector<worker> &ws, uint64_t *wall)
+{
+	fprintf(out, "%d threads x %d files/dir\n", nthreads, files);
+	fprintf(out, "%-8s %12s %10s %10s %10s %10s\n",
+			"op", "ops/s", "mean(us)", "p50(us)", "p99(us)", "p999(us)");
+	int errors = 0;
+	for (int op = 0; op < NOPS; op++) {
+		rpc_hist all;
+		for (size_t i = 0; i < ws.size(); i++)
+			all.merge(ws[i].h[op]);
+		double secs = wall[op] / 1e9;
+		fprintf(out, "%-8s %12.1f %10.1f %10.1f %10.1f %10.1f\n", opnames[op],
+				secs > 0 ? all.n / secs : 0, all.mean() / 1e3,
+				all.pct(0.50) / 1e3, all.pct(0.99) / 1e3,
+				all.pct(0.999) / 1e3);
+	}
+	for (size_t i = 0; i < ws.size(); i++)
+		errors += ws[i].errors;
+	if (errors)
+		fprintf(out, "%d operations failed\n", errors);
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "Usage: chfs_mdbench [-t threads] [-n files,files,...] "
+			"[-r rounds] [-v] [port-extent-server[,port...]]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	bool verbose = false;
+	int ch;
+	while ((ch = getopt(argc, argv, "t:n:r:v")) != -1) {
+		switch (ch) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n': {
+			std::istringstream ist(optarg);
+			std::string s;
+			while (std::getline(ist, s, ','))
+				sizes.push_back(atoi(s.c_str()));
+			break;
+		}
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (argc - optind > 1 || nthreads < 1 || rounds < 1)
+		usage();
+	if (sizes.empty()) {
+		// stays under one extent server's INODE_NUM at the default 4 threads
+		sizes.push_back(16);
+		sizes.push_back(64);
+		sizes.push_back(200);
+	}
+
+	// chfs_client and extent_server trace every call on stdout
+	FILE *out = fdopen(dup(1), "w");
+	if (!verbose)
+		VERIFY(freopen("/dev/null", "w", stdout) != NULL);
+
+	srandom(getpid());
+	if (optind < argc)
+		chfs = new chfs_client(argv[optind]);
+	else
+		chfs = new chfs_client();
+
+	VERIFY(pthread_barrier_init(&phase_b, 0, nthreads + 1) == 0);
+
+	int run = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (size_t s = 0; s < sizes.size(); s++) {
+			std::vector<worker> ws(nthreads);
+			for (int i = 0; i < nthreads; i++) {
+				char dname[64];
+				sprintf(dname, "mdbench.%d.%d.%d", getpid(), run, i);
+				ws[i].id = i;
+				ws[i].files = sizes[s];
+				ws[i].errors = 0;
+				VERIFY(chfs->mkdir(1, dname, 0755, ws[i].dir) == chfs_client::OK);
+			}
+			for (int i = 0; i < nthreads; i++)
+				VERIFY(pthread_create(&ws[i].th, 0, run_worker, &ws[i]) == 0);
+
+			for (int op = 0; op < NOPS; op++) {
+				pthread_barrier_wait(&phase_b);
+				pthread_barrier_wait(&phase_b);
+			}
+			for (int i = 0; i < nthreads; i++)
+				pthread_join(ws[i].th, 0);
+
+			uint64_t wall[NOPS];
+			for (int op = 0; op < NOPS; op++) {
+				uint64_t first = UINT64_MAX, last = 0;
+				for (int i = 0; i < nthreads; i++) {
+					first = std::min(first, ws[i].start[op]);
+					last = std::max(last, ws[i].end[op]);
+				}
+				wall[op] = last - first;
+			}
+
+			for (int i = 0; i < nthreads; i++) {
+				char dname[64];
+				sprintf(dname, "mdbench.%d.%d.%d", getpid(), run, i);
+				chfs->unlink(1, dname);
+			}
+			run++;
+
+			fflush(stdout);
+			report(out, sizes[s], ws, wall);
+		}
+	}
+	return 0;
+}
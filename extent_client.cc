@@ -7,26 +7,76 @@
 #include <unistd.h>
 #include <time.h>
 
-extent_client::extent_client(std::string dst) {
-    sockaddr_in dstsock;
-    make_sockaddr(dst.c_str(), &dstsock);
-    cl = new rpcc(dstsock);
-    if (cl->bind() != 0) {
-        printf("extent_client: bind failed\n");
+extent_client::extent_client() : next_shard(0) {
+    es = new extent_server();
+}
+
+extent_client::extent_client(std::string dst) : es(NULL) {
+    std::istringstream ist(dst);
+    std::string port;
+    while (std::getline(ist, port, ',')) {
+        rpcaddr dstaddr;
+        make_rpcaddr(port.c_str(), &dstaddr);
+        rpcc *cl = new rpcc(dstaddr);
+        if (cl->bind() != 0) {
+            printf("extent_client: bind %s failed\n", port.c_str());
+        }
+        cls.push_back(cl);
     }
+    // start clients at different shards so concurrent creators spread out
+    next_shard = cls.empty() ? 0 : random() % cls.size();
+}
+
+rpcc *extent_client::shard(extent_protocol::extentid_t eid) {
+    unsigned int s = extent_protocol::shard_of(eid);
+    if (s >= cls.size())
+        return NULL;
+    return cls[s];
 }
 
+// Place new extents round-robin across the shards. A shard that fails
+// the create is skipped, so one full or unreachable server does not
+// stop the file system from allocating.
 extent_protocol::status extent_client::create(uint32_t type, extent_protocol::extentid_t &id) {
     extent_protocol::status ret = extent_protocol::OK;
-    // Your lab2 part1 code goes here
-    ret = cl->call(extent_protocol::create, type, id);
+    if (es)
+        return es->create(type, id);
+    if (cls.empty())
+        return extent_protocol::RPCERR;
+    for (size_t tries = 0; tries < cls.size(); tries++) {
+        unsigned int s = next_shard++ % cls.size();
+        extent_protocol::extentid_t local;
+        ret = cls[s]->call(extent_protocol::create, type, local);
+        if (ret == extent_protocol::OK) {
+            id = extent_protocol::make_id(s, local);
+            break;
+        }
+    }
     return ret;
 }
 
 extent_protocol::status extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab2 part1 code goes here
-    ret = cl->call(extent_protocol::get, eid, buf);
+    if (es)
+        ret = es->get(eid, buf);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::get, extent_protocol::local_of(eid), buf);
+    else
+        ret = extent_protocol::NOENT;
+    return ret;
+}
+
+extent_protocol::status extent_client::read(extent_protocol::extentid_t eid,
+                                            unsigned long long off, unsigned int n,
+                                            std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    if (es)
+        ret = es->read(eid, off, n, buf);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::read, extent_protocol::local_of(eid), off, n, buf);
+    else
+        ret = extent_protocol::NOENT;
     return ret;
 }
 
@@ -34,7 +84,12 @@ extent_protocol::status extent_client::getattr(extent_protocol::extentid_t eid,
                                                extent_protocol::attr &attr) {
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab2 part1 code goes here
-    ret = cl->call(extent_protocol::getattr, eid, attr);
+    if (es)
+        ret = es->getattr(eid, attr);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::getattr, extent_protocol::local_of(eid), attr);
+    else
+        ret = extent_protocol::NOENT;
     return ret;
 }
 
@@ -42,7 +97,12 @@ extent_protocol::status extent_client::put(extent_protocol::extentid_t eid, std:
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab2 part1 code goes here
     int tmp;
-    ret = cl->call(extent_protocol::put, eid, buf, tmp);
+    if (es)
+        ret = es->put(eid, rpc_bytes(buf), tmp);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::put, extent_protocol::local_of(eid), buf, tmp);
+    else
+        ret = extent_protocol::NOENT;
     return ret;
 }
 
@@ -50,6 +110,25 @@ extent_protocol::status extent_client::remove(extent_protocol::extentid_t eid) {
     extent_protocol::status ret = extent_protocol::OK;
     // Your lab2 part1 code goes here
     int tmp;
-    ret = cl->call(extent_protocol::remove, eid, tmp);
+    if (es)
+        ret = es->remove(eid, tmp);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::remove, extent_protocol::local_of(eid), tmp);
+    else
+        ret = extent_protocol::NOENT;
     return ret;
-}
\ No newline at end of file
+}
+
+extent_protocol::status extent_client::readdir(extent_protocol::extentid_t eid,
+                                               unsigned long long cookie, unsigned int n,
+                                               std::vector<extent_protocol::dirent> &ents) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ents.clear();
+    if (es)
+        ret = es->readdir(eid, cookie, n, ents);
+    else if (rpcc *cl = shard(eid))
+        ret = cl->call(extent_protocol::readdir, extent_protocol::local_of(eid), cookie, n, ents);
+    else
+        ret = extent_protocol::NOENT;
+    return ret;
+}
@@ -4,23 +4,39 @@
 #define extent_client_h
 
 #include <string>
+#include <vector>
+#include <atomic>
 #include "extent_protocol.h"
 #include "extent_server.h"
 
 class extent_client {
  private:
-  rpcc *cl;
+  std::vector<rpcc *> cls;  // one per shard, indexed by extent_protocol::shard_of
+  extent_server *es;  // non-NULL when the server lives in this process
+  std::atomic<unsigned int> next_shard;
+
+  rpcc *shard(extent_protocol::extentid_t eid);
 
  public:
+  // in-process transport: calls go straight to a private extent_server
+  extent_client();
+  // dst is a comma-separated list of extent server ports, one per shard.
+  // every client of a file system must list the servers in the same order.
   extent_client(std::string dst);
 
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
+  extent_protocol::status read(extent_protocol::extentid_t eid,
+                               unsigned long long off, unsigned int n,
+                               std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
   extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status readdir(extent_protocol::extentid_t eid,
+                                  unsigned long long cookie, unsigned int n,
+                                  std::vector<extent_protocol::dirent> &ents);
 };
 
 #endif
\ No newline at end of file
@@ -15,7 +15,9 @@ class extent_protocol {
     get,
     getattr,
     remove,
-    create
+    create,
+    readdir,
+    read
   };
 
   enum types {
@@ -24,35 +26,34 @@ class extent_protocol {
     T_SYMLINK      //symlink仿照create的方法
   };
 
+  // an extentid encodes its placement: the shard (an index into the
+  // client's extent server list) in the upper 32 bits and the inum on
+  // that shard's inode_manager in the lower 32. shard 0 ids are plain inums.
+  static unsigned int shard_of(extentid_t id) { return id >> 32; }
+  static extentid_t local_of(extentid_t id) { return id & 0xffffffffULL; }
+  static extentid_t make_id(unsigned int shard, extentid_t local) {
+    return ((extentid_t) shard << 32) | local;
+  }
+
   struct attr {
     uint32_t type;
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    RPC_FIELDS(type, atime, mtime, ctime, size)
   };
-};
 
-inline unmarshall &
-operator>>(unmarshall &u, extent_protocol::attr &a)
-{
-  u >> a.type;
-  u >> a.atime;
-  u >> a.mtime;
-  u >> a.ctime;
-  u >> a.size;
-  return u;
-}
-
-inline marshall &
-operator<<(marshall &m, extent_protocol::attr a)
-{
-  m << a.type;
-  m << a.atime;
-  m << a.mtime;
-  m << a.ctime;
-  m << a.size;
-  return m;
-}
+  // one entry of a paged directory listing. cookie is the byte offset
+  // just past this entry in the directory extent; passing it back to
+  // readdir resumes the listing after this entry. unlink leaves the
+  // bytes of an entry in place, so the offsets of the others hold.
+  struct dirent {
+    std::string name;
+    extentid_t inum;
+    unsigned long long cookie;
+    RPC_FIELDS(name, inum, cookie)
+  };
+};
 
 #endif 
@@ -8,12 +8,16 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "slock.h"
+#include "jsl_log.h"
 
 extent_server::extent_server() {
+    VERIFY(pthread_mutex_init(&im_m_, 0) == 0);
     im = new inode_manager();
 }
 
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id) {
+    ScopedLock ml(&im_m_);
     // alloc a new inode and return inum
 //  std::cout<<"extent_server: create inode start type"<<type<<std::endl;
     id = im->alloc_inode(type);
@@ -22,17 +26,18 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id) {
     return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &) {
+int extent_server::put(extent_protocol::extentid_t id, const rpc_bytes buf, int &) {
+    ScopedLock ml(&im_m_);
     id &= 0x7fffffff;
 
-    const char *cbuf = buf.c_str();
-    int size = buf.size();
-    im->write_file(id, cbuf, size);
+    // buf points into the request pdu; write_file copies it to the disk
+    im->write_file(id, buf.data(), buf.size());
 
     return extent_protocol::OK;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
+    ScopedLock ml(&im_m_);
     printf("extent_server: get %lld\n", id);
 
     id &= 0x7fffffff;
@@ -51,7 +56,30 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf) {
     return extent_protocol::OK;
 }
 
+int extent_server::read(extent_protocol::extentid_t id, unsigned long long off,
+                        unsigned int n, std::string &buf) {
+    ScopedLock ml(&im_m_);
+    jsl_log(JSL_DBG_2, "extent_server: read %lld %u@%llu\n", id, n, off);
+
+    id &= 0x7fffffff;
+
+    int size = 0;
+    char *cbuf = NULL;
+
+    buf = "";
+    if (off < DISK_SIZE) {
+        im->read_file_range(id, off, n, &cbuf, &size);
+    }
+    if (size > 0) {
+        buf.assign(cbuf, size);
+        free(cbuf);
+    }
+
+    return extent_protocol::OK;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
+    ScopedLock ml(&im_m_);
     printf("extent_server: getattr %lld\n", id);
 
     id &= 0x7fffffff;
@@ -65,6 +93,7 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 }
 
 int extent_server::remove(extent_protocol::extentid_t id, int &) {
+    ScopedLock ml(&im_m_);
     printf("extent_server: write %lld\n", id);
 
     id &= 0x7fffffff;
@@ -73,3 +102,73 @@ int extent_server::remove(extent_protocol::extentid_t id, int &) {
     return extent_protocol::OK;
 }
 
+
+// directory bytes are fetched from the inode layer this many at a time,
+// so a readdir call never holds more than one chunk of unparsed entries.
+#define READDIR_CHUNK (8 * BLOCK_SIZE)
+
+// Return up to n entries of directory id, starting at byte offset cookie.
+// Directory content is the chfs_client encoding "name`inum^name`inum^...";
+// an entry with an empty name is what unlink leaves behind and is skipped.
+// A cookie that does not fall just past a '^' resumes at the next entry.
+// Fewer than n entries means the end of the directory was reached.
+int extent_server::readdir(extent_protocol::extentid_t id, unsigned long long cookie,
+                           unsigned int n, std::vector<extent_protocol::dirent> &ents) {
+    ScopedLock ml(&im_m_);
+    jsl_log(JSL_DBG_2, "extent_server: readdir %lld from %llu\n", id, cookie);
+
+    id &= 0x7fffffff;
+
+    extent_protocol::attr attr;
+    memset(&attr, 0, sizeof(attr));
+    im->getattr(id, attr);
+    if (attr.type != extent_protocol::T_DIR) {
+        return extent_protocol::IOERR;
+    }
+
+    ents.clear();
+    std::string win;    // unparsed bytes, win[0] is at offset cookie
+    size_t pos = 0;
+    // start at the byte before the cookie, which must end an entry
+    bool align = cookie > 0;
+    if (align) cookie--;
+    bool eof = cookie >= attr.size;
+    while (ents.size() < n) {
+        size_t end = win.find('^', pos);
+        if (end == std::string::npos) {
+            if (eof) break;
+            // keep the partial entry, fetch the next chunk after it
+            win.erase(0, pos);
+            cookie += pos;
+            pos = 0;
+            char *cbuf = NULL;
+            int size = 0;
+            im->read_file_range(id, cookie + win.size(), READDIR_CHUNK, &cbuf, &size);
+            if (size > 0) {
+                win.append(cbuf, size);
+                free(cbuf);
+            }
+            eof = size < READDIR_CHUNK;
+            continue;
+        }
+        if (align) {
+            align = false;
+            pos = end + 1;
+            continue;
+        }
+        size_t div = win.find('`', pos);
+        if (div == std::string::npos || div > end) break;
+        if (div == pos) {
+            pos = end + 1;
+            continue;
+        }
+        extent_protocol::dirent d;
+        d.name = win.substr(pos, div - pos);
+        d.inum = strtoull(win.c_str() + div + 1, NULL, 10);
+        d.cookie = cookie + end + 1;
+        ents.push_back(d);
+        pos = end + 1;
+    }
+
+    return extent_protocol::OK;
+}
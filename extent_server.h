@@ -5,6 +5,8 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <pthread.h>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
@@ -18,15 +20,22 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // inode_manager is not thread safe; handlers may run concurrently on
+  // rpcs worker threads or on in-process callers' threads.
+  pthread_mutex_t im_m_;
 
  public:
   extent_server();
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int put(extent_protocol::extentid_t id, const rpc_bytes, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read(extent_protocol::extentid_t id, unsigned long long off,
+           unsigned int n, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int readdir(extent_protocol::extentid_t id, unsigned long long cookie,
+              unsigned int n, std::vector<extent_protocol::dirent> &);
 };
 
 #endif 
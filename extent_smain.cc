@@ -13,7 +13,7 @@ main(int argc, char *argv[])
   int count = 0;
 
   if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+    fprintf(stderr, "Usage: %s port|unix:path|shm:path\n", argv[0]);
     exit(1);
   }
 
@@ -24,7 +24,9 @@ main(int argc, char *argv[])
     count = atoi(count_env);
   }
 
-  rpcs server(atoi(argv[1]), count);
+  rpcaddr addr;
+  make_rpcaddr(argv[1], &addr);
+  rpcs server(addr, count);
   extent_server ls;
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
@@ -32,6 +34,8 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::readdir, &ls, &extent_server::readdir);
+  server.reg(extent_protocol::read, &ls, &extent_server::read);
 
   while(1)
     sleep(1000);
@@ -311,34 +311,27 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino) {
+// @off is the cookie the kernel passes back to resume after this entry.
+void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino, off_t off) {
     struct stat stbuf;
     size_t oldsize = b->size;
     b->size += fuse_dirent_size(strlen(name));
     b->p = (char *) realloc(b->p, b->size);
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
-    fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
+    fuse_add_dirent(b->p + oldsize, name, &stbuf, off);
 }
 
-#define min(x, y) ((x) < (y) ? (x) : (y))
+// entries fetched from chfs per round trip while filling a reply
+#define READDIR_BATCH 64
 
-int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
-                      off_t off, size_t maxsize) {
-    if ((size_t) off < bufsize)
-        return fuse_reply_buf(req, buf + off, min(bufsize - off, maxsize));
-    else
-        return fuse_reply_buf(req, NULL, 0);
-}
-
-//
-// Retrieve all the file names / i-numbers pairs
-// in directory @ino. Send the reply using reply_buf_limited.
 //
-// You can ignore @size and @off (except that you must pass
-// them to reply_buf_limited).
+// Retrieve the file names / i-numbers pairs in directory @ino that
+// follow offset @off, filling at most @size bytes of reply.
 //
-// Call dirbuf_add(&b, name, inum) for each entry in the directory.
+// @off is 0 on the first call and otherwise a cookie previously handed
+// to the kernel with an entry, so every chunk of a long listing costs
+// only the entries it returns instead of re-reading the whole directory.
 //
 void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                         off_t off, struct fuse_file_info *fi) {
@@ -355,18 +348,38 @@ void fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     memset(&b, 0, sizeof(b));
 
     std::list <chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
-    for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
-        dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
+    unsigned long long cookie = off;
+    bool full = false;
+    while (!full) {
+        if (chfs->readdir(inum, cookie, READDIR_BATCH, entries) != chfs_client::OK) {
+            free(b.p);
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
+            if (b.size + fuse_dirent_size(it->name.size()) > size) {
+                full = true;
+                break;
+            }
+            dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum, (off_t) it->cookie);
+            cookie = it->cookie;
+        }
+        if (entries.size() < READDIR_BATCH)
+            break;
     }
 
-    reply_buf_limited(req, b.p, b.size, off, size);
+    fuse_reply_buf(req, b.p, b.size);
     free(b.p);
 }
 
 
+//
+// Open starts a new read session on @ino: pages chfs_client cached
+// for it earlier are dropped so writes from other clients show up.
+//
 void fuseserver_open(fuse_req_t req, fuse_ino_t ino,
                      struct fuse_file_info *fi) {
+    chfs->open(ino);
     fuse_reply_open(req, fi);
 }
 
@@ -485,25 +498,23 @@ int main(int argc, char *argv[]) {
 
     setvbuf(stdout, NULL, _IONBF, 0);
 
-#if 1
-    if(argc != 3){
-        fprintf(stderr, "Usage: chfs_client <mountpoint> <port-extent-server>\n");
-        exit(1);
-    }
-#else
-    if(argc != 2){
-        fprintf(stderr, "Usage: chfs_client <mountpoint>\n");
+    // without a port the extent server runs inside this process and
+    // extent_client calls it directly, skipping the rpc layer. a
+    // comma-separated port list shards extents across several servers.
+    if(argc != 2 && argc != 3){
+        fprintf(stderr, "Usage: chfs_client <mountpoint> [port-extent-server[,port...]]\n");
         exit(1);
     }
-#endif
     mountpoint = argv[1];
 
     srandom(getpid());
 
     myid = random();
 
-    chfs = new chfs_client(argv[2]);
-    // chfs = new chfs_client();
+    if (argc == 3)
+        chfs = new chfs_client(argv[2]);
+    else
+        chfs = new chfs_client();
 
     fuseserver_oper.getattr = fuseserver_getattr;
     fuseserver_oper.statfs = fuseserver_statfs;
@@ -257,6 +257,49 @@ void inode_manager::read_file(uint32_t inum, char **buf_out, int *size) {
     return;
 }
 
+/* Get the bytes [off, off + len) of a file by inum, clipped to its size.
+ * Only the blocks covering the range are read.
+ * Return allocated data (NULL if nothing was read), should be freed by caller. */
+void inode_manager::read_file_range(uint32_t inum, uint32_t off, uint32_t len, char **buf_out, int *size) {
+    *buf_out = NULL;
+    *size = 0;
+    inode *node = get_inode(inum);
+    if (node == nullptr) return;
+    node->atime = time(0);
+
+    if (off < node->size && len > 0) {
+        uint32_t end = node->size - off < len ? node->size : off + len;
+        *size = end - off;
+        *buf_out = (char *) malloc(*size);
+
+        char block[BLOCK_SIZE];
+        char indirect[BLOCK_SIZE];
+        bool indirect_read = false;
+        for (uint32_t pos = off; pos < end;) {
+            uint32_t i = pos / BLOCK_SIZE;
+            uint32_t in_block = pos % BLOCK_SIZE;
+            uint32_t n = MIN(BLOCK_SIZE - in_block, end - pos);
+            blockid_t id;
+            if (i < NDIRECT) {
+                id = node->blocks[i];
+            } else {
+                //indirect表只读一次
+                if (!indirect_read) {
+                    bm->read_block(node->blocks[NDIRECT], indirect);
+                    indirect_read = true;
+                }
+                id = read_bytes(&indirect[4 * (i - NDIRECT)]);
+            }
+            bm->read_block(id, block);
+            memcpy(*buf_out + (pos - off), block + in_block, n);
+            pos += n;
+        }
+    }
+    put_inode(inum, node);
+    free(node);
+    node = nullptr;
+}
+
 void inode_manager::write_file(uint32_t inum, const char *buf, int size) {
     /*
      * your code goes here.
@@ -89,6 +89,7 @@ public:
     uint32_t alloc_inode(uint32_t type);
     void free_inode(uint32_t inum);
     void read_file(uint32_t inum, char **buf, int *size);
+    void read_file_range(uint32_t inum, uint32_t off, uint32_t len, char **buf, int *size);
     void write_file(uint32_t inum, const char *buf, int size);
     void remove_file(uint32_t inum);
     void getattr(uint32_t inum, extent_protocol::attr &a);
@@ -180,7 +180,9 @@ int main(int argc, char *argv[]) {
         ++p;
     }
 
-    rpcs server(atoi(port_listen), count);
+    rpcaddr addr;
+    make_rpcaddr(port_listen, &addr);
+    rpcs server(addr, count);
 
     Coordinator c(files, REDUCER_COUNT);
 
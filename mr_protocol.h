@@ -33,26 +33,9 @@ public:
         int taskType;
         int index;
         int tot;
+        RPC_FIELDS(filename, taskType, index, tot)
     };
 
-    friend unmarshall &
-    operator>>(unmarshall &u, AskTaskResponse &a) {
-        u >> a.filename;
-        u >> a.taskType;
-        u >> a.index;
-        u >> a.tot;
-        return u;
-    }
-
-    friend marshall &
-    operator<<(marshall &m, AskTaskResponse a) {
-        m << a.filename;
-        m << a.taskType;
-        m << a.index;
-        m << a.tot;
-        return m;
-    }
-
     struct AskTaskRequest {
         // Lab2: Your definition here.
     };
@@ -120,9 +120,9 @@ Worker::Worker(const string &dst, const string &dir, MAPF mf, REDUCEF rf) {
 
 //    cout<<"worker called id="<<id<<endl;
 
-    sockaddr_in dstsock;
-    make_sockaddr(dst.c_str(), &dstsock);
-    this->cl = new rpcc(dstsock);
+    rpcaddr dstaddr;
+    make_rpcaddr(dst.c_str(), &dstaddr);
+    this->cl = new rpcc(dstaddr);
     if (this->cl->bind() < 0) {
         printf("mr worker: call bind error\n");
     }
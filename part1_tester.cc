@@ -33,11 +33,15 @@
  */
 
 #include "extent_client.h"
+#include "chfs_client.h"
 #include <stdio.h>
+#include <set>
 
 #define FILE_NUM 50
 #define LARGE_FILE_SIZE_MIN 512*10
 #define LARGE_FILE_SIZE_MAX 512*200
+#define DIR_FILE_NUM 300
+#define DIR_PAGE 64
 
 #define iprint(msg) \
     printf("[TEST_ERROR]: %s\n", msg);
@@ -232,6 +236,118 @@ int test_remove()
     return 0;
 }
 
+/*
+ * Read a page of a directory, unlink what it returned as rm -rf does,
+ * and resume from the last cookie: no entry may be skipped or mangled.
+ * Not scored.
+ */
+int test_readdir_resume()
+{
+    chfs_client *fs = new chfs_client();
+    chfs_client::inum dir, ino;
+    std::map<std::string, chfs_client::inum> files;
+    std::list<chfs_client::dirent> page;
+    std::list<chfs_client::dirent>::iterator it;
+    char name[32];
+    int i;
+
+    printf("begin test readdir resume\n");
+    if (fs->mkdir(1, "d", 0777, dir) != chfs_client::OK) {
+        iprint("error mkdir, return not OK");
+        return 1;
+    }
+    for (i = 0; i < DIR_FILE_NUM; i++) {
+        // names of several lengths, so entries shift by varying amounts
+        snprintf(name, sizeof(name), "f%0*d", 1 + i % 7, i);
+        if (fs->create(dir, name, 0666, ino) != chfs_client::OK) {
+            iprint("error create, return not OK");
+            return 2;
+        }
+        files[name] = ino;
+    }
+
+    if (fs->readdir(dir, 0, DIR_PAGE, page) != chfs_client::OK || page.size() != DIR_PAGE) {
+        iprint("error readdir first page");
+        return 3;
+    }
+    unsigned long long cookie = page.back().cookie;
+    for (it = page.begin(); it != page.end(); it++) {
+        if (fs->unlink(dir, it->name.c_str()) != chfs_client::OK) {
+            iprint("error unlink, return not OK");
+            return 4;
+        }
+        files.erase(it->name);
+    }
+
+    std::set<std::string> seen;
+    do {
+        if (fs->readdir(dir, cookie, DIR_PAGE, page) != chfs_client::OK) {
+            iprint("error readdir, return not OK");
+            return 5;
+        }
+        for (it = page.begin(); it != page.end(); it++) {
+            if (!files.count(it->name) || files[it->name] != it->inum) {
+                printf("[TEST_ERROR]: readdir returned %s -> %llu after unlink\n",
+                       it->name.c_str(), it->inum);
+                return 6;
+            }
+            seen.insert(it->name);
+            cookie = it->cookie;
+        }
+    } while (page.size() == DIR_PAGE);
+    if (seen.size() != files.size()) {
+        printf("[TEST_ERROR]: resumed readdir saw %zu of %zu entries\n",
+               seen.size(), files.size());
+        return 7;
+    }
+
+    // a cookie inside an entry resumes at the next one
+    fs->readdir(dir, 0, 1, page);
+    if (fs->readdir(dir, page.front().cookie + 1, DIR_FILE_NUM, page) != chfs_client::OK) {
+        iprint("error readdir, return not OK");
+        return 8;
+    }
+    for (it = page.begin(); it != page.end(); it++) {
+        if (!files.count(it->name) || files[it->name] != it->inum) {
+            printf("[TEST_ERROR]: readdir from a misaligned cookie returned %s -> %llu\n",
+                   it->name.c_str(), it->inum);
+            return 9;
+        }
+    }
+    delete fs;
+    printf("end test readdir resume\n");
+    return 0;
+}
+
+/*
+ * Tear a client down while sequential reads have readahead in flight.
+ * Not scored; a crash is the failure.
+ */
+int test_client_teardown()
+{
+    chfs_client *fs = new chfs_client();
+    chfs_client::inum ino;
+    std::string data(LARGE_FILE_SIZE_MAX, 'x'), out;
+    size_t n;
+
+    printf("begin test client teardown\n");
+    if (fs->create(1, "big", 0666, ino) != chfs_client::OK ||
+        fs->write(ino, data.size(), 0, data.c_str(), n) != chfs_client::OK ||
+        fs->open(ino) != chfs_client::OK) {
+        iprint("error writing file");
+        return 1;
+    }
+    for (off_t off = 0; off < 64 * 1024; off += 4096) {
+        if (fs->read(ino, 4096, off, out) != chfs_client::OK || out != data.substr(off, 4096)) {
+            iprint("error reading file");
+            return 2;
+        }
+    }
+    delete fs;
+    printf("end test client teardown\n");
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -239,6 +355,7 @@ int main(int argc, char *argv[])
         return 1;
     }
   
+    int ret = 0;
     ec = new extent_client();
 
     if (test_create_and_getattr() != 0)
@@ -249,9 +366,11 @@ int main(int argc, char *argv[])
         goto test_finish;
     if (test_indirect() != 0)
         goto test_finish;
+    if (test_readdir_resume() != 0 || test_client_teardown() != 0)
+        ret = 1;
 
 test_finish:
     printf("---------------------------------\n");
     printf("Part1 score is : %d/100\n", total_score);
-    return 0;
+    return ret;
 }
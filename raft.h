@@ -120,11 +120,11 @@ private:
 
 private:
     // RPC handlers
-    int request_vote(request_vote_args arg, request_vote_reply &reply);
+    int request_vote(const request_vote_args &arg, request_vote_reply &reply);
 
-    int append_entries(append_entries_args<command> arg, append_entries_reply &reply);
+    int append_entries(const append_entries_args<command> &arg, append_entries_reply &reply);
 
-    int install_snapshot(install_snapshot_args arg, install_snapshot_reply &reply);
+    int install_snapshot(const install_snapshot_args &arg, install_snapshot_reply &reply);
 
     // RPC helpers
     void send_request_vote(int target, request_vote_args arg);
@@ -313,7 +313,7 @@ RPC Related
 ******************************************************************/
 
 template<typename state_machine, typename command>
-int raft<state_machine, command>::request_vote(request_vote_args args, request_vote_reply &reply) {
+int raft<state_machine, command>::request_vote(const request_vote_args &args, request_vote_reply &reply) {
     // Your code here:
     std::unique_lock <std::mutex> lock(mtx);
     log_mtx.lock();
@@ -376,7 +376,7 @@ void raft<state_machine, command>::handle_request_vote_reply(int target, const r
 
 
 template<typename state_machine, typename command>
-int raft<state_machine, command>::append_entries(append_entries_args<command> arg, append_entries_reply &reply) {
+int raft<state_machine, command>::append_entries(const append_entries_args<command> &arg, append_entries_reply &reply) {
     // Your code here:
     std::unique_lock <std::mutex> lock(mtx);
 
@@ -527,7 +527,7 @@ void raft<state_machine, command>::handle_append_entries_reply(int target, const
 
 
 template<typename state_machine, typename command>
-int raft<state_machine, command>::install_snapshot(install_snapshot_args args, install_snapshot_reply &reply) {
+int raft<state_machine, command>::install_snapshot(const install_snapshot_args &args, install_snapshot_reply &reply) {
     // Your code here:
 //    std::unique_lock <std::mutex> lock(mtx);
     return 0;
@@ -33,25 +33,18 @@ public:
     int candidate_id;
     int last_log_index;
     int last_log_term;
-
+    RPC_FIELDS(term, candidate_id, last_log_index, last_log_term)
 };
 
-marshall &operator<<(marshall &m, const request_vote_args &args);
-
-unmarshall &operator>>(unmarshall &u, request_vote_args &args);
-
 
 class request_vote_reply {
 public:
     // Your code here
     int term;
     bool vote_granted;
+    RPC_FIELDS(term, vote_granted)
 };
 
-marshall &operator<<(marshall &m, const request_vote_reply &reply);
-
-unmarshall &operator>>(unmarshall &u, request_vote_reply &reply);
-
 template<typename command>
 class log_entry {
 public:
@@ -61,24 +54,10 @@ public:
 
     log_entry() { term = 0; }
 
-    log_entry(int term, command cmd) : term(term), cmd(cmd) {}
-};
-
-template<typename command>
-marshall &operator<<(marshall &m, const log_entry<command> &entry) {
-    // Your code here
-    m << entry.term;
-    m << entry.cmd;
-    return m;
-}
+    log_entry(int term, const command &cmd) : term(term), cmd(cmd) {}
 
-template<typename command>
-unmarshall &operator>>(unmarshall &u, log_entry<command> &entry) {
-    // Your code here
-    u >> entry.term;
-    u >> entry.cmd;
-    return u;
-}
+    RPC_FIELDS(term, cmd)
+};
 
 template<typename command>
 class append_entries_args {
@@ -91,34 +70,10 @@ public:
     std::vector <log_entry<command>> entries;
     int leader_commit;
     int action;
+    RPC_FIELDS(term, leader_id, prev_log_index, prev_log_term, entries,
+               leader_commit, action)
 };
 
-template<typename command>
-marshall &operator<<(marshall &m, const append_entries_args<command> &args) {
-    // Your code here
-    m << args.term;
-    m << args.leader_id;
-    m << args.prev_log_index;
-    m << args.prev_log_term;
-    m << args.entries;
-    m << args.leader_commit;
-    m << args.action;
-    return m;
-}
-
-template<typename command>
-unmarshall &operator>>(unmarshall &u, append_entries_args<command> &args) {
-    // Your code here
-    u >> args.term;
-    u >> args.leader_id;
-    u >> args.prev_log_index;
-    u >> args.prev_log_term;
-    u >> args.entries;
-    u >> args.leader_commit;
-    u >> args.action;
-    return u;
-}
-
 
 class append_entries_reply {
 public:
@@ -126,12 +81,9 @@ public:
     int index;
     bool success;
     int action;
+    RPC_FIELDS(index, success, action)
 };
 
-marshall &operator<<(marshall &m, const append_entries_reply &reply);
-
-unmarshall &operator>>(unmarshall &m, append_entries_reply &reply);
-
 
 class install_snapshot_args {
 public:
@@ -143,22 +95,17 @@ public:
     int offset;
     std::vector<int> data;
     bool done;
+    RPC_FIELDS(term, leader_id, last_included_index, last_included_term,
+               offset, data, done)
 };
 
-marshall &operator<<(marshall &m, const install_snapshot_args &args);
-
-unmarshall &operator>>(unmarshall &m, install_snapshot_args &args);
-
 
 class install_snapshot_reply {
 public:
     // Your code here
     int term;
+    RPC_FIELDS(term)
 };
 
-marshall &operator<<(marshall &m, const install_snapshot_reply &reply);
-
-unmarshall &operator>>(unmarshall &m, install_snapshot_reply &reply);
-
 
 #endif // raft_protocol_h
\ No newline at end of file
@@ -59,6 +59,10 @@ unmarshall &operator>>(unmarshall &u, kv_command &cmd) {
     return u;
 }
 
+int rpc_size(const kv_command &cmd, bool refs) {
+    return rpc_size((int) cmd.cmd_tp, refs) + rpc_size(cmd.key, refs) + rpc_size(cmd.value, refs);
+}
+
 kv_state_machine::~kv_state_machine() {
 
 }
@@ -77,6 +77,7 @@ public:
 
 marshall& operator<<(marshall &m, const kv_command& cmd);
 unmarshall& operator>>(unmarshall &u, kv_command& cmd);
+int rpc_size(const kv_command &cmd, bool refs);
 
 class kv_state_machine : public raft_state_machine {
 public:
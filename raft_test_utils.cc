@@ -99,16 +99,6 @@ bool unit_test_suite::run_all() {
 }
 
 
-marshall& operator<<(marshall &m, const list_command& cmd) {
-    m << cmd.value;
-    return m;
-}
-
-unmarshall& operator>>(unmarshall &u, list_command& cmd) {
-    u >> cmd.value;
-    return u;
-}
-
 list_state_machine::list_state_machine() {
     store.push_back(0); 
     num_append_logs = 0;
@@ -100,12 +100,9 @@ public:
     }
 
     int value;
+    RPC_FIELDS(value)
 };
 
-marshall& operator<<(marshall &m, const list_command& cmd);
-
-unmarshall& operator>>(unmarshall &u, list_command& cmd);
-
 class list_state_machine : public raft_state_machine {
 public:
     list_state_machine();
@@ -1,26 +1,70 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
 
 #include "method_thread.h"
 #include "connection.h"
+#include "marshall.h"
 #include "slock.h"
 #include "pollmgr.h"
 #include "jsl_log.h"
 #include "gettime.h"
+#include "shmring.h"
+#include "crc32c.h"
 #include "lang/verify.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define SEND_BATCH_IOV 256 //iovecs per writev when draining the send queue
+
+static std::atomic<uint64_t> bad_checksums(0);
+
+uint64_t
+connection_bad_checksums()
+{
+	return bad_checksums;
+}
+
+// sum the pdu where its pieces lie, without gathering them first. the
+// sum covers everything after the size word.
+static uint32_t
+pdu_checksum(const struct iovec *iov, int iovcnt)
+{
+	char *h = (char *) iov[0].iov_base;
+	uint32_t crc = crc32c(0, h + sizeof(rpc_sz_t), iov[0].iov_len - sizeof(rpc_sz_t));
+	for (int i = 1; i < iovcnt; i++)
+		crc = crc32c(crc, iov[i].iov_base, iov[i].iov_len);
+	return crc;
+}
 
 
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), shm_(NULL), fd_(f1), dead_(false), sq_head_(NULL), sq_tail_(NULL),
+	writing_(false), wpoll_(false), rsz_(0), rszlen_(0), refno_(1),lossy_(l1),
+	summed_(false), rsummed_(false)
 {
+	init();
+}
+
+connection::connection(chanmgr *m1, shmring *r, int l1)
+: mgr_(m1), shm_(r), fd_(r->fd()), dead_(false), sq_head_(NULL), sq_tail_(NULL),
+	writing_(false), wpoll_(false), rsz_(0), rszlen_(0), refno_(1),lossy_(l1),
+	summed_(false), rsummed_(false)
+{
+	init();
+}
 
+void
+connection::init()
+{
 	int flags = fcntl(fd_, F_GETFL, NULL);
 	flags |= O_NONBLOCK;
 	fcntl(fd_, F_SETFL, flags);
@@ -28,7 +72,6 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	signal(SIGPIPE, SIG_IGN);
 	VERIFY(pthread_mutex_init(&m_,0)==0);
 	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
-	VERIFY(pthread_cond_init(&send_wait_,0)==0);
 	VERIFY(pthread_cond_init(&send_complete_,0)==0);
  
         VERIFY(gettimeofday(&create_time_, NULL) == 0); 
@@ -41,12 +84,13 @@ connection::~connection()
 	VERIFY(dead_);
 	VERIFY(pthread_mutex_destroy(&m_)== 0);
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
-	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
 	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
-	if (rpdu_.buf)
-		free(rpdu_.buf);
-	VERIFY(!wpdu_.buf);
-	close(fd_);
+	rpcbuf_free(rpdu_.buf);
+	VERIFY(!sq_head_);
+	if (shm_)
+		delete shm_;
+	else
+		close(fd_);
 }
 
 void
@@ -60,9 +104,22 @@ bool
 connection::isdead()
 {
 	ScopedLock ml(&m_);
+	if (!dead_ && shm_ && shm_->peer_gone()) {
+		// nothing rings our bell if the peer's process dies: end the
+		// stream ourselves, and read_cb sees it end as a socket would
+		shm_->shutdown();
+	}
 	return dead_;
 }
 
+void
+connection::resume()
+{
+	ScopedLock ml(&m_);
+	if (!dead_)
+		PollMgr::Instance()->kick(fd_);
+}
+
 void
 connection::closeconn()
 {
@@ -70,7 +127,8 @@ connection::closeconn()
 		ScopedLock ml(&m_);
 		if (!dead_) {
 			dead_ = true;
-			shutdown(fd_,SHUT_RDWR);
+			shut();
+			pthread_cond_broadcast(&send_complete_);
 		}else{
 			return;
 		}
@@ -80,6 +138,16 @@ connection::closeconn()
 	PollMgr::Instance()->block_remove_fd(fd_);
 }
 
+// as shutdown(SHUT_RDWR), for either kind of stream
+void
+connection::shut()
+{
+	if (shm_)
+		shm_->shutdown();
+	else
+		shutdown(fd_, SHUT_RDWR);
+}
+
 void
 connection::decref()
 {
@@ -123,47 +191,87 @@ connection::compare(connection *another)
 bool
 connection::send(char *b, int sz)
 {
-	ScopedLock ml(&m_);
-	waiters_++;
-	while (!dead_ && wpdu_.buf) {
-		VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
+	struct iovec v;
+	v.iov_base = b;
+	v.iov_len = sz;
+	return send(&v, 1);
+}
+
+bool
+connection::send(const struct iovec *iov, int iovcnt)
+{
+	VERIFY(iovcnt > 0 && iov[0].iov_len >= sizeof(rpc_sz_t));
+	// a peer that negotiated it gets a CRC32C trailer after the pdu,
+	// flagged in the size word; others get the pdu as it was
+	std::vector<struct iovec> sv;
+	uint32_t ncrc;
+	bool summed = summed_;
+	if (summed) {
+		ncrc = htonl(pdu_checksum(iov, iovcnt));
+		sv.assign(iov, iov + iovcnt);
+		struct iovec t;
+		t.iov_base = &ncrc;
+		t.iov_len = sizeof(ncrc);
+		sv.push_back(t);
+		iov = &sv[0];
+		iovcnt = sv.size();
 	}
-	waiters_--;
+
+	sendreq r;
+	r.sz = 0;
+	for (int i = 0; i < iovcnt; i++)
+		r.sz += iov[i].iov_len;
+	rpc_sz_t sz = htonl(summed ? (r.sz | RPC_SZ_SUMMED) : r.sz);
+	bcopy(&sz, iov[0].iov_base, sizeof(sz));
+	r.iov = iov;
+	r.iovcnt = iovcnt;
+	r.solong = 0;
+	r.done = r.ok = false;
+	r.next = NULL;
+
+	ScopedLock ml(&m_);
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+	if (sq_tail_)
+		sq_tail_->next = &r;
+	else
+		sq_head_ = &r;
+	sq_tail_ = &r;
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
 			jsl_log(JSL_DBG_1, "connection::send LOSSY TEST shutdown fd_ %d\n", fd_);
-			shutdown(fd_,SHUT_RDWR);
+			shut();
 		}
 	}
 
-	if (!writepdu()) {
-		dead_ = true;
-		VERIFY(pthread_mutex_unlock(&m_) == 0);
-		PollMgr::Instance()->block_remove_fd(fd_);
-		VERIFY(pthread_mutex_lock(&m_) == 0);
-	}else{
-		if (wpdu_.solong == wpdu_.sz) {
-		}else{
-			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
-			}
+	while (!r.done) {
+		if (dead_ && !writing_) {
+			// nobody is writing, so nobody else looks at the queue
+			fail_queue();
+			break;
+		}
+		if (writing_ || wpoll_) {
+			VERIFY(pthread_cond_wait(&send_complete_, &m_) == 0);
+			continue;
+		}
+		// become the writer; our pdu goes out along with everything
+		// queued ahead of and behind it
+		if (!writepdu(&r)) {
+			dead_ = true;
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			PollMgr::Instance()->block_remove_fd(fd_);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+		} else if (!r.done) {
+			//should be rare to need to explicitly add write callback.
+			//a ring's reader rings our bell when it makes room instead.
+			wpoll_ = true;
+			if (!shm_)
+				PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
 		}
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	return r.ok;
 }
 
 //fd_ is ready to be written
@@ -171,102 +279,204 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	VERIFY(!dead_);
 	VERIFY(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+	if (dead_)
+		return;
+	if (!wpoll_) {
+		if (!shm_)
+			PollMgr::Instance()->del_callback(fd_, CB_WRONLY);
 		return;
 	}
-	if (!writepdu()) {
+	if (!writepdu(NULL)) {
 		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
 		dead_ = true;
-	}else{
-		VERIFY(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
+	} else if (sq_head_) {
+		return;
+	} else if (!shm_) {
+		PollMgr::Instance()->del_callback(fd_, CB_WRONLY);
+	}
+	wpoll_ = false;
+	pthread_cond_broadcast(&send_complete_);
 }
 
 //fd_ is ready to be read
 void
 connection::read_cb(int s)
 {
-	ScopedLock ml(&m_);
-	VERIFY(fd_ == s);
-	if (dead_)  {
-		return;
+	if (shm_) {
+		// reset the bell, which also rings when the peer has made room
+		// for a send that found the ring full
+		uint64_t cnt;
+		while (PollMgr::Instance()->recv(fd_, &cnt, sizeof(cnt)) > 0)
+			;
+		write_cb(s);
 	}
 
-	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
-		succ = readpdu();
-	}
+	// read until the socket is empty: an edge-triggered epoll reports
+	// data that is already waiting only once
+	while (1) {
+		{
+			ScopedLock ml(&m_);
+			VERIFY(fd_ == s);
+			if (dead_)  {
+				return;
+			}
 
-	if (!succ) {
-		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
-		dead_ = true;
-		pthread_cond_signal(&send_complete_);
-	}
+			bool succ = true, blocked = false;
+			if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
+				succ = readpdu(&blocked);
+			}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
+			if (!succ) {
+				PollMgr::Instance()->del_callback(fd_,CB_RDWR);
+				dead_ = true;
+				pthread_cond_broadcast(&send_complete_);
+				return;
+			}
+
+			if (!rpdu_.buf || rpdu_.sz != rpdu_.solong) {
+				if (blocked)
+					return;
+				continue;
+			}
 		}
+
+		// rpdu_ is only touched on this fd's reactor thread, so m_ need
+		// not be held across the upcall; that lets got_pdu (e.g. an
+		// async rpc callback) send on this same connection.
+		// if refused, the socket is left unread, so tcp flow control
+		// holds the peer back, until resume() brings us back here
+		if (!mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz))
+			return;
+		//chanmgr has successfully consumed the pdu
+		rpdu_.buf = NULL;
+		rpdu_.sz = rpdu_.solong = 0;
 	}
 }
 
+// write queued pdus with m_ held on entry and exit, but not across
+// writev, so that senders arriving meanwhile can queue behind us. stops
+// when the queue is empty, the socket is full, or (for a sending thread)
+// its own pdu is out, leaving the rest to the next waiter. returns false
+// on a write error, after failing every queued pdu.
 bool
-connection::writepdu()
+connection::writepdu(sendreq *mine)
 {
-	VERIFY(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
-		return true;
+	VERIFY(!writing_);
+	while (sq_head_ && !dead_ && !(mine && mine->done)) {
+		// gather whatever is still unwritten, skipping what went out
+		struct iovec v[SEND_BATCH_IOV];
+		int cnt = 0;
+		for (sendreq *r = sq_head_; r; r = r->next) {
+			if (r != sq_head_ && cnt + r->iovcnt > SEND_BATCH_IOV)
+				break;
+			int skip = r->solong;
+			for (int i = 0; i < r->iovcnt && cnt < SEND_BATCH_IOV; i++) {
+				if (skip >= (int)r->iov[i].iov_len) {
+					skip -= r->iov[i].iov_len;
+					continue;
+				}
+				v[cnt].iov_base = (char *)r->iov[i].iov_base + skip;
+				v[cnt].iov_len = r->iov[i].iov_len - skip;
+				skip = 0;
+				cnt++;
+			}
+		}
 
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
-	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+		writing_ = true;
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		int n = shm_ ? shm_->writev(v, cnt) : writev(fd_, v, cnt);
+		int err = errno;
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		writing_ = false;
+
+		if (n < 0) {
+			if (err == EAGAIN)
+				return true;
+			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, err);
+			fail_queue();
+			return false;
+		}
+
+		bool completed = false;
+		while (n > 0) {
+			sendreq *r = sq_head_;
+			int k = r->sz - r->solong < n ? r->sz - r->solong : n;
+			r->solong += k;
+			n -= k;
+			if (r->solong == r->sz) {
+				sq_head_ = r->next;
+				if (!sq_head_)
+					sq_tail_ = NULL;
+				// r may be gone as soon as its sender sees done
+				r->ok = r->done = true;
+				completed = true;
+			}
 		}
-		return (errno == EAGAIN);
+		if (completed)
+			pthread_cond_broadcast(&send_complete_);
 	}
-	wpdu_.solong += n;
+	if (dead_)
+		fail_queue();
 	return true;
 }
 
+// with m_ held and no writev in progress
+void
+connection::fail_queue()
+{
+	while (sq_head_) {
+		sendreq *r = sq_head_;
+		sq_head_ = r->next;
+		r->ok = false;
+		r->done = true;
+	}
+	sq_tail_ = NULL;
+	pthread_cond_broadcast(&send_complete_);
+}
+
+ssize_t
+connection::recv(void *buf, size_t n)
+{
+	if (shm_)
+		return shm_->read(buf, n);
+	return PollMgr::Instance()->recv(fd_, buf, n);
+}
+
+// reads some of the next pdu. sets *blocked once the socket has no more
+// data for now; returns false if the connection failed.
 bool
-connection::readpdu()
+connection::readpdu(bool *blocked)
 {
 	if (!rpdu_.sz) {
+		// the size may arrive in pieces
 		int sz, sz1;
-		int n = read(fd_, &sz1, sizeof(sz1));
+		int n = recv((char *)&rsz_ + rszlen_, sizeof(rsz_) - rszlen_);
 
 		if (n == 0) {
 			return false;
 		}
 
 		if (n < 0) {
-			VERIFY(errno!=EAGAIN);
+			if (errno == EAGAIN) {
+				*blocked = true;
+				return true;
+			}
 			return false;
 		}
 
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
+		rszlen_ += n;
+		if (rszlen_ < (int) sizeof(rsz_)) {
+			*blocked = !shm_;
+			return true;
 		}
-
+		rszlen_ = 0;
+		sz1 = rsz_;
 		sz = ntohl(sz1);
+		rsummed_ = (sz & RPC_SZ_SUMMED) != 0;
+		sz &= ~RPC_SZ_SUMMED;
 
-		if (sz > MAX_PDU) {
+		if (sz > MAX_PDU || sz < (int) (sizeof(rpc_sz_t) + (rsummed_ ? sizeof(uint32_t) : 0))) {
 			char *tmpb = (char *)&sz1;
 			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
 					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
@@ -275,50 +485,109 @@ connection::readpdu()
 
 		rpdu_.sz = sz;
 		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
-		VERIFY(rpdu_.buf);
+		rpdu_.buf = rpcbuf_alloc(sz+sizeof(sz));
+		sz1 = htonl(sz);
 		bcopy(&sz1,rpdu_.buf,sizeof(sz));
 		rpdu_.solong = sizeof(sz);
 	}
 
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
+	int want = rpdu_.sz - rpdu_.solong;
+	int n = recv(rpdu_.buf + rpdu_.solong, want);
 	if (n <= 0) {
-		if (errno == EAGAIN)
+		if (n < 0 && errno == EAGAIN) {
+			*blocked = true;
 			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
+		}
+		rpcbuf_free(rpdu_.buf);
 		rpdu_.buf = NULL;
 		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
+		return false;
 	}
+	// a short read emptied the socket; spare the read that says EAGAIN.
+	// a ring's reader must see it empty to be rung again, though.
+	if (n < want && !shm_)
+		*blocked = true;
 	rpdu_.solong += n;
+	if (rpdu_.solong == rpdu_.sz && rsummed_) {
+		int body = rpdu_.sz - sizeof(uint32_t);
+		uint32_t ncrc;
+		memcpy(&ncrc, rpdu_.buf + body, sizeof(ncrc));
+		if (ntohl(ncrc) != crc32c(0, rpdu_.buf + sizeof(rpc_sz_t), body - sizeof(rpc_sz_t))) {
+			// as if the pdu had been lost with the connection: the peer
+			// sees it die, and an rpcc sends its calls again on a new one
+			jsl_log(JSL_DBG_1, "connection::readpdu bad checksum, pdu of %d bytes on fd %d\n",
+					rpdu_.sz, fd_);
+			bad_checksums++;
+			rpcbuf_free(rpdu_.buf);
+			rpdu_.buf = NULL;
+			rpdu_.sz = rpdu_.solong = 0;
+			shut();
+			return false;
+		}
+		// strip the trailer, and sum what we send back: the peer
+		// evidently checks it
+		rpdu_.sz = rpdu_.solong = body;
+		rpc_sz_t nsz = htonl(body);
+		bcopy(&nsz, rpdu_.buf, sizeof(nsz));
+		summed_ = true;
+	}
+	return true;
+}
+
+// a sockaddr_un for path; false if it does not fit
+static bool
+make_sockaddr_un(const std::string &path, struct sockaddr_un *sun)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(sun->sun_path))
+		return false;
+	memcpy(sun->sun_path, path.c_str(), path.size());
 	return true;
 }
 
-tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
-: mgr_(m1), lossy_(lossytest)
+tcpsconn::tcpsconn(chanmgr *m1, const rpcaddr &a, int lossytest) 
+: addr_(a), mgr_(m1), lossy_(lossytest)
 {
 
 	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
 
-	struct sockaddr_in sin;
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
+	int yes = 1;
+	if (a.kind == rpcaddr::TCP) {
+		struct sockaddr_in sin;
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = a.in.sin_port;
+
+		tcp_ = socket(AF_INET, SOCK_STREAM, 0);
+		if(tcp_ < 0){
+			perror("tcpsconn::tcpsconn accept_loop socket:");
+			VERIFY(0);
+		}
 
-	tcp_ = socket(AF_INET, SOCK_STREAM, 0);
-	if(tcp_ < 0){
-		perror("tcpsconn::tcpsconn accept_loop socket:");
-		VERIFY(0);
-	}
+		setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+		setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 
-	int yes = 1;
-	setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
+			perror("accept_loop tcp bind:");
+			VERIFY(0);
+		}
+	} else {
+		struct sockaddr_un sun;
+		VERIFY(make_sockaddr_un(a.path, &sun));
 
-	if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
-		perror("accept_loop tcp bind:");
-		VERIFY(0);
+		tcp_ = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(tcp_ < 0){
+			perror("tcpsconn::tcpsconn accept_loop socket:");
+			VERIFY(0);
+		}
+
+		// as SO_REUSEADDR: take the place of a socket left behind
+		unlink(a.path.c_str());
+		if(bind(tcp_, (sockaddr *)&sun, sizeof(sun)) < 0){
+			perror("accept_loop unix bind:");
+			VERIFY(0);
+		}
 	}
 
 	if(listen(tcp_, 1000) < 0) {
@@ -326,8 +595,7 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 		VERIFY(0);
 	}
 
-	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port, 
-		sin.sin_port);
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %s\n", a.str().c_str());
 
 	if (pipe(pipe_) < 0) {
 		perror("accept_loop pipe:");
@@ -345,6 +613,8 @@ tcpsconn::~tcpsconn()
 {
 	VERIFY(close(pipe_[1]) == 0);
 	VERIFY(pthread_join(th_, NULL) == 0);
+	if (addr_.kind != rpcaddr::TCP)
+		unlink(addr_.path.c_str());
 
 	//close all the active connections
 	std::map<int, connection *>::iterator i;
@@ -357,17 +627,32 @@ tcpsconn::~tcpsconn()
 void
 tcpsconn::process_accept()
 {
-	sockaddr_in sin;
-	socklen_t slen = sizeof(sin);
-	int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
+	sockaddr_storage ss;
+	socklen_t slen = sizeof(ss);
+	int s1 = accept(tcp_, (sockaddr *)&ss, &slen); 
 	if (s1 < 0) {
 		perror("tcpsconn::accept_conn error");
 		pthread_exit(NULL);
 	}
 
-	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
-			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
+	connection *ch;
+	if (addr_.kind == rpcaddr::TCP) {
+		sockaddr_in *sin = (sockaddr_in *)&ss;
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
+				s1, inet_ntoa(sin->sin_addr), ntohs(sin->sin_port));
+		ch = new connection(mgr_, s1, lossy_);
+	} else if (addr_.kind == rpcaddr::UNIX) {
+		jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d on %s\n",
+				s1, addr_.path.c_str());
+		ch = new connection(mgr_, s1, lossy_);
+	} else {
+		shmring *r = shmring::accept(s1);
+		if (!r)
+			return;
+		jsl_log(JSL_DBG_2, "accept_loop got shm connection fd=%d on %s\n",
+				r->fd(), addr_.path.c_str());
+		ch = new connection(mgr_, r, lossy_);
+	}
 
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
@@ -425,20 +710,63 @@ tcpsconn::accept_conn()
 }
 
 connection *
-connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
+connect_to_dst(const rpcaddr &dst, chanmgr *mgr, int lossy)
 {
-	int s= socket(AF_INET, SOCK_STREAM, 0);
-	int yes = 1;
-	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
-		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n", 
-				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
-		close(s);
-		return NULL;
+	int s;
+	if (dst.kind == rpcaddr::TCP) {
+		s = socket(AF_INET, SOCK_STREAM, 0);
+		int yes = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+		if(connect(s, (sockaddr*)&dst.in, sizeof(dst.in)) < 0) {
+			jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n", 
+					dst.str().c_str());
+			close(s);
+			return NULL;
+		}
+	} else {
+		struct sockaddr_un sun;
+		if (!make_sockaddr_un(dst.path, &sun)) {
+			jsl_log(JSL_DBG_1, "rpcc::connect_to_dst bad path %s\n",
+					dst.path.c_str());
+			return NULL;
+		}
+		s = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(connect(s, (sockaddr*)&sun, sizeof(sun)) < 0) {
+			jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s\n", 
+					dst.str().c_str());
+			close(s);
+			return NULL;
+		}
+	}
+	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s\n",
+			s, dst.str().c_str());
+	if (dst.kind == rpcaddr::SHM) {
+		shmring *r = shmring::connect(s);
+		return r ? new connection(mgr, r, lossy) : NULL;
 	}
-	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
-			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
 	return new connection(mgr, s, lossy);
 }
 
+rpcaddr::rpcaddr() : kind(TCP)
+{
+	memset(&in, 0, sizeof(in));
+}
+
+rpcaddr::rpcaddr(const sockaddr_in &a) : kind(TCP), in(a)
+{
+}
+
+std::string
+rpcaddr::str() const
+{
+	if (kind == UNIX)
+		return "unix:" + path;
+	if (kind == SHM)
+		return "shm:" + path;
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s:%d", inet_ntoa(in.sin_addr),
+			(int) ntohs(in.sin_port));
+	return buf;
+}
+
 
@@ -6,15 +6,38 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <cstddef>
+#include <sys/uio.h>
 
+#include <atomic>
 #include <map>
+#include <string>
 
 #include "pollmgr.h"
 
 class connection;
+class shmring;
+
+// pdus dropped for a bad checksum, over all connections
+uint64_t connection_bad_checksums();
+
+// where an rpcc connects and an rpcs listens. besides a tcp address,
+// peers on one host can use a unix-domain socket, or a shared-memory
+// ring set up through one; see make_rpcaddr().
+struct rpcaddr {
+	enum kind_t { TCP, UNIX, SHM };
+	kind_t kind;
+	sockaddr_in in;     // TCP
+	std::string path;   // UNIX and SHM: the socket's path
+
+	rpcaddr();
+	rpcaddr(const sockaddr_in &a);
+	std::string str() const;  // as make_rpcaddr() takes it, for logs
+};
 
 class chanmgr {
 	public:
+		// false if the pdu cannot be taken now. the connection then
+		// keeps it and stops reading until resume() is called.
 		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
 		virtual ~chanmgr() {}
 };
@@ -30,13 +53,28 @@ class connection : public aio_callback {
 		};
 
 		connection(chanmgr *m1, int f1, int lossytest=0);
+		// a connection through a shared-memory ring, which it then owns
+		connection(chanmgr *m1, shmring *r, int lossytest=0);
 		~connection();
 
 		int channo() { return fd_; }
 		bool isdead();
 		void closeconn();
+		// offer a pdu got_pdu() refused again, and go on reading
+		void resume();
 
+		// send() returns once the pdu has been written (or the connection
+		// died), so the caller may then free its buffers. concurrent
+		// senders queue up and whichever of them is writing sends every
+		// queued pdu in one writev.
 		bool send(char *b, int sz);
+		// send a pdu gathered from several buffers with writev. the
+		// first buffer holds the header, whose leading rpc_sz_t is
+		// overwritten with the pdu size.
+		bool send(const struct iovec *iov, int iovcnt);
+		// trail the pdus sent from now on with a CRC32C. a connection
+		// also starts doing so once it reads a pdu that has one.
+		void set_summed(bool on) { summed_ = on; }
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -46,32 +84,53 @@ class connection : public aio_callback {
                 
                 int compare(connection *another);
 	private:
+		// a pdu waiting in the send queue; lives on its sender's stack
+		struct sendreq {
+			const struct iovec *iov;
+			int iovcnt;
+			int sz;
+			int solong;  // bytes written so far
+			bool done;
+			bool ok;
+			sendreq *next;
+		};
 
-		bool readpdu();
-		bool writepdu();
+		void init();
+		bool readpdu(bool *blocked);
+		bool writepdu(sendreq *mine);
+		void fail_queue();
+		ssize_t recv(void *buf, size_t n);
+		void shut();
 
 		chanmgr *mgr_;
-		const int fd_;
+		shmring *shm_;  // or NULL for a socket
+		const int fd_;  // the socket, or the ring's doorbell
 		bool dead_;
 
-		charbuf wpdu_;
+		sendreq *sq_head_;
+		sendreq *sq_tail_;
+		bool writing_;  // a thread is in writev with m_ released
+		bool wpoll_;    // the socket was full; write_cb drains the queue
 		charbuf rpdu_;
+		int rsz_;     // size prefix of the next pdu, while it is read
+		int rszlen_;  // bytes of rsz_ read so far
                 
                 struct timeval create_time_;
 
-		int waiters_;
 		int refno_;
 		const int lossy_;
+		std::atomic<bool> summed_;
+		bool rsummed_;  // the pdu being read has a checksum trailer
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
 		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
 };
 
+// accepts connections on a tcp port or a unix-domain socket
 class tcpsconn {
 	public:
-		tcpsconn(chanmgr *m1, int port, int lossytest=0);
+		tcpsconn(chanmgr *m1, const rpcaddr &a, int lossytest=0);
 		~tcpsconn();
 
 		void accept_conn();
@@ -82,6 +141,7 @@ class tcpsconn {
 		int pipe_[2];
 
 		int tcp_; //file desciptor for accepting connection
+		rpcaddr addr_;
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
@@ -97,5 +157,5 @@ struct bundle {
 };
 
 void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
-connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
+connection *connect_to_dst(const rpcaddr &dst, chanmgr *mgr, int lossy=0);
 #endif
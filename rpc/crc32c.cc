@@ -0,0 +1,106 @@
+#include "crc32c.h"
+#include <pthread.h>
+#include <string.h>
+#include "lang/verify.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78  // reflected
+
+// table[k][b] is the crc of byte b followed by k zero bytes, so eight
+// lookups take in eight bytes at once
+static uint32_t table[8][256];
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+static void
+make_table()
+{
+	for (int i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (int i = 0; i < 256; i++)
+		for (int k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^
+				table[0][table[k - 1][i] & 0xff];
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t n)
+{
+	VERIFY(pthread_once(&table_once, make_table) == 0);
+	const unsigned char *p = (const unsigned char *) buf;
+	crc = ~crc;
+	while (n >= 8) {
+		// assembled byte by byte, which compilers turn into one load
+		// where the byte order allows
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+		uint32_t hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t) p[7] << 24;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+			table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+			table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+		p += 8;
+		n -= 8;
+	}
+	while (n--)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#if CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *buf, size_t n)
+{
+	const unsigned char *p = (const unsigned char *) buf;
+	uint64_t c = ~crc;
+	while (n > 0 && ((uintptr_t) p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		n--;
+	}
+	while (n >= 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		n -= 8;
+	}
+	while (n--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~(uint32_t) c;
+}
+#endif
+
+static bool
+detect_hw()
+{
+#if CRC32C_X86
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+#else
+	return false;
+#endif
+}
+
+bool
+crc32c_hw()
+{
+	static const bool hw = detect_hw();
+	return hw;
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *p, size_t n)
+{
+#if CRC32C_X86
+	if (crc32c_hw())
+		return crc32c_sse42(crc, p, n);
+#endif
+	return crc32c_sw(crc, p, n);
+}
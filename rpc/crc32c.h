@@ -0,0 +1,21 @@
+#ifndef crc32c_h
+#define crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli), the checksum rpc pdus carry; see connection.cc.
+// Uses the SSE4.2 crc32 instruction when the cpu has it, and otherwise
+// tables sliced eight ways.
+
+// extend crc, which is 0 to start, over n more bytes at p, so that a
+// buffer can be summed in pieces
+uint32_t crc32c(uint32_t crc, const void *p, size_t n);
+
+// the table version, whatever the cpu; for tests
+uint32_t crc32c_sw(uint32_t crc, const void *p, size_t n);
+
+// whether crc32c() uses the instruction
+bool crc32c_hw();
+
+#endif
@@ -0,0 +1,205 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFF 65535
+// after this many misses in a row the search starts skipping ahead,
+// so incompressible data goes by quickly
+#define LZ_SKIP_SHIFT 6
+
+static inline uint32_t
+load32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t
+hash4(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// the part of a length that did not fit in its token nibble
+static inline unsigned char *
+put_len(unsigned char *op, size_t n)
+{
+	while (n >= 255) {
+		*op++ = 255;
+		n -= 255;
+	}
+	*op++ = (unsigned char) n;
+	return op;
+}
+
+static inline bool
+get_len(const unsigned char **ip, const unsigned char *iend, size_t max,
+		size_t *n)
+{
+	unsigned char b;
+	do {
+		if (*ip >= iend || *n > max)
+			return false;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return true;
+}
+
+// room for a sequence with lit literals and a match of mlen
+static inline size_t
+seq_bound(size_t lit, size_t mlen)
+{
+	return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+int
+lz_compress(const char *src, int n, char *dst, int cap)
+{
+	const unsigned char *in = (const unsigned char *) src;
+	const unsigned char *end = in + n;
+	const unsigned char *ip = in, *anchor = in;
+	unsigned char *op = (unsigned char *) dst;
+	unsigned char *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+	unsigned int misses = 0;
+
+	// positions are offsets from in; a stale or zero entry just fails
+	// the comparison below
+	memset(table, 0, sizeof(table));
+
+	while (end - ip >= LZ_MIN_MATCH) {
+		uint32_t v = load32(ip);
+		uint32_t h = hash4(v);
+		const unsigned char *ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > LZ_MAX_OFF || load32(ref) != v) {
+			ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+		misses = 0;
+
+		// take in any literals that match too, then as much as
+		// matches going forward, eight bytes at a time
+		while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		const unsigned char *mp = ip + LZ_MIN_MATCH;
+		const unsigned char *rp = ref + LZ_MIN_MATCH;
+		while (end - mp >= 8) {
+			uint64_t a, b;
+			memcpy(&a, mp, 8);
+			memcpy(&b, rp, 8);
+			if (a != b)
+				break;
+			mp += 8;
+			rp += 8;
+		}
+		while (mp < end && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+
+		size_t lit = ip - anchor;
+		size_t mlen = mp - ip;
+		if (seq_bound(lit, mlen) > (size_t) (oend - op))
+			return 0;
+		unsigned char *tok = op++;
+		*tok = (lit >= 15 ? 15 : lit) << 4;
+		if (lit >= 15)
+			op = put_len(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		size_t off = ip - ref;
+		*op++ = off & 0xff;
+		*op++ = off >> 8;
+		size_t m = mlen - LZ_MIN_MATCH;
+		*tok |= m >= 15 ? 15 : m;
+		if (m >= 15)
+			op = put_len(op, m - 15);
+
+		ip = anchor = mp;
+		// so that a repeat of what just matched can be found from
+		// its end as well
+		if (end - ip >= LZ_MIN_MATCH + 2)
+			table[hash4(load32(ip - 2))] = ip - 2 - in;
+	}
+
+	size_t lit = end - anchor;
+	if (lit > 0) {
+		if (seq_bound(lit, 0) > (size_t) (oend - op))
+			return 0;
+		*op++ = (lit >= 15 ? 15 : lit) << 4;
+		if (lit >= 15)
+			op = put_len(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+	}
+	return op - (unsigned char *) dst;
+}
+
+int
+lz_decompress(const char *src, int n, char *dst, int cap)
+{
+	const unsigned char *ip = (const unsigned char *) src;
+	const unsigned char *iend = ip + n;
+	unsigned char *op = (unsigned char *) dst;
+	unsigned char *ostart = op;
+	unsigned char *oend = op + cap;
+
+	while (ip < iend) {
+		unsigned int tok = *ip++;
+		size_t lit = tok >> 4;
+		if (lit == 15 && !get_len(&ip, iend, cap, &lit))
+			return -1;
+		if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op))
+			return -1;
+		if (lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+			memcpy(op, ip, 16);  // the usual few, in one fixed-size copy
+		else
+			memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		size_t off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (off == 0 || off > (size_t) (op - ostart))
+			return -1;
+		size_t m = tok & 15;
+		if (m == 15 && !get_len(&ip, iend, cap, &m))
+			return -1;
+		m += LZ_MIN_MATCH;
+		if (m > (size_t) (oend - op))
+			return -1;
+		// the match may overlap what it produces, as in a run. the
+		// bytes from r on repeat every off bytes, so each copy can
+		// take in everything written so far
+		const unsigned char *r = op - off;
+		if (off >= 8 && (size_t) (oend - op) >= m + 8) {
+			// eight bytes at a time, writing a little past the end
+			unsigned char *mend = op + m;
+			do {
+				memcpy(op, r, 8);
+				op += 8;
+				r += 8;
+			} while (op < mend);
+			op = mend;
+			continue;
+		}
+		while (m > 0) {
+			size_t k = (size_t) (op - r) < m ? (size_t) (op - r) : m;
+			memcpy(op, r, k);
+			op += k;
+			m -= k;
+		}
+	}
+	return op - ostart;
+}
@@ -0,0 +1,27 @@
+#ifndef lz_h
+#define lz_h
+
+#include <stddef.h>
+
+// A small LZ77 block codec for rpc bodies, in the style of LZ4: greedy
+// matching through a hash of 4-byte sequences, no entropy coding, and a
+// decoder that only copies bytes. It trades ratio for speed, which is
+// what a codec sitting in the path of every large pdu needs.
+//
+// A block is a series of sequences, each a token byte holding a literal
+// count and a match length in its two nibbles, the literals, a 2-byte
+// little-endian match offset and any length bytes that did not fit in
+// the token. The last sequence stops after its literals.
+
+// compress n bytes at src into at most cap bytes at dst. returns the
+// compressed size, or 0 if it would not fit; pass a cap below n to give
+// up early on data that does not shrink.
+int lz_compress(const char *src, int n, char *dst, int cap);
+
+// expand a block of n bytes into at most cap bytes at dst. returns the
+// expanded size, or -1 if the block is malformed or too big. the block
+// may come straight off the network, so every length and offset is
+// checked.
+int lz_decompress(const char *src, int n, char *dst, int cap);
+
+#endif
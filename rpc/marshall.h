@@ -6,12 +6,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <utility>
 #include <stdlib.h>
 #include <string.h>
 #include <cstddef>
 #include <inttypes.h>
+#include <sys/uio.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "rpcbuf.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -24,17 +27,40 @@ struct req_header {
 };
 
 struct reply_header {
-	reply_header(int x=0, int r=0): xid(x), ret(r) {}
+	reply_header(int x=0, int r=0, int f=0): xid(x), ret(r), flags(f) {}
 	int xid;
 	int ret;
+	int flags;  // RPC_REP_Z; in room a request header needs anyway
+};
+
+// bits a req_header's proc carries above the handler number, and
+// reply_header flags, once rpcc::bind() has found the server takes them
+enum {
+	RPC_PROC_Z = 0x40000000,    // the body is compressed
+	RPC_PROC_ZOK = 0x20000000,  // the reply may be compressed
+	RPC_PROC_DL = 0x10000000,   // a deadline trails the body
+	RPC_PROC_FLAGS = RPC_PROC_Z | RPC_PROC_ZOK | RPC_PROC_DL,
+	RPC_REP_Z = 0x1,            // the body is compressed
 };
 
 typedef uint64_t rpc_checksum_t;
 typedef int rpc_sz_t;
 
+// a pdu whose size word has this bit set ends in a CRC32C of everything
+// after the size word; the size counts it. see connection::send().
+#define RPC_SZ_SUMMED 0x80000000u
+
 enum {
 	//size of initial buffer allocation 
 	DEFAULT_RPC_SZ = 1024,
+	//payloads at least this big may be referenced instead of copied
+	RPC_SG_MIN = 8192,
+	//most external segments one marshall will reference
+	RPC_SG_MAX = 64,
+	//bodies at least this big are worth compressing
+	RPC_Z_MIN = 4096,
+	//most a compressed body may expand to
+	RPC_Z_MAX = 64 << 20,
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
 	RPC_HEADER_SZ = static_max<sizeof(req_header), sizeof(reply_header)>::value + sizeof(rpc_sz_t) + sizeof(rpc_checksum_t)
@@ -43,33 +69,86 @@ enum {
 #endif
 };
 
+// a view of bytes owned by someone else. unmarshalled as a handler
+// argument it points into the request PDU, so it is only valid until the
+// handler returns; on the wire it is the same as a std::string.
+struct rpc_bytes {
+	rpc_bytes() : p(NULL), n(0) {}
+	rpc_bytes(const char *xp, size_t xn) : p(xp), n(xn) {}
+	rpc_bytes(const std::string &s) : p(s.data()), n(s.size()) {}
+	const char *data() const { return p; }
+	size_t size() const { return n; }
+	std::string str() const { return std::string(p, n); }
+
+	const char *p;
+	size_t n;
+};
+
 class marshall {
 	private:
+		// bytes referenced in place of being copied; each sits logically
+		// at offset off of the inline buffer, before the bytes from there on
+		struct segment {
+			int off;
+			const char *p;
+			int n;
+		};
+
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		bool _refs;     // reference large payloads instead of copying them
+		int _extra;     // total bytes in _segs
+		std::vector<segment> _segs;
 
 	public:
-		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
-			_capa = DEFAULT_RPC_SZ;
+		// with REF_LARGE, payloads of RPC_SG_MIN bytes or more are only
+		// referenced and must stay alive and unchanged until the marshall
+		// is sent or flattened.
+		enum ref_mode { COPY_ALL, REF_LARGE };
+
+		marshall(ref_mode mode = COPY_ALL) {
+			_buf = rpcbuf_alloc(DEFAULT_RPC_SZ);
+			_capa = rpcbuf_capacity(_buf);
 			_ind = RPC_HEADER_SZ;
+			_refs = mode == REF_LARGE;
+			_extra = 0;
+		}
+
+		// room for the header, a body of the given size as rpc_size()
+		// counts it, and the deadline rpcc may append, in one buffer
+		marshall(ref_mode mode, int body) {
+			_buf = rpcbuf_alloc(RPC_HEADER_SZ + body + sizeof(unsigned int));
+			_capa = rpcbuf_capacity(_buf);
+			_ind = RPC_HEADER_SZ;
+			_refs = mode == REF_LARGE;
+			_extra = 0;
 		}
 
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			rpcbuf_free(_buf);
 		}
 
-		int size() { return _ind;}
-		char *cstr() { return _buf;}
+		int size() { return _ind + _extra;}
+		char *cstr() { flatten(); return _buf;}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
+		// make room for n more bytes now rather than as they come
+		void reserve(int n);
+		// payload bytes: referenced if large and allowed, copied otherwise
+		void bytes(const char *, int);
+		// copy referenced segments in, leaving one contiguous buffer
+		void flatten();
+		// describe the whole pdu for writev; the first entry holds the header
+		void iov(std::vector<struct iovec> &v);
+		// replace the body with its size and its lz compression, unless
+		// that would not make it smaller
+		bool compress();
 
 		// Return the current content (excluding header) as a string
 		std::string get_content() { 
+			flatten();
 			return std::string(_buf+RPC_HEADER_SZ,_ind-RPC_HEADER_SZ);
 		}
 
@@ -104,10 +183,12 @@ class marshall {
 #endif
 			pack(h.xid);
 			pack(h.ret);
+			pack(h.flags);
 			_ind = saved_sz;
 		}
 
 		void take_buf(char **b, int *s) {
+			flatten();
 			*b = _buf;
 			*s = _ind;
 			_buf = NULL;
@@ -124,6 +205,7 @@ marshall& operator<<(marshall &, unsigned short);
 marshall& operator<<(marshall &, short);
 marshall& operator<<(marshall &, unsigned long long);
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, const rpc_bytes &);
 
 class unmarshall {
 	private:
@@ -140,7 +222,7 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			rpcbuf_free(_buf);
 		}
 
 		//take contents from another unmarshall object
@@ -149,8 +231,7 @@ class unmarshall {
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
 			_sz = s.size()+RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
-			VERIFY(_buf);
+			_buf = rpcbuf_realloc(_buf,_sz);
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
 			_ok = true;
@@ -159,8 +240,14 @@ class unmarshall {
 		bool ok() { return _ok; }
 		char *cstr() { return _buf;}
 		bool okdone();
+		// undo marshall::compress() on the body; false if it is corrupt
+		bool decompress();
+		// take off the int that follows the body, as the deadline of
+		// an RPC_PROC_DL request does; false if there is none
+		bool take_tail(unsigned int *v);
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		void rawbytes(rpc_bytes &b, unsigned int n);
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
@@ -194,6 +281,7 @@ class unmarshall {
 #endif
 			unpack(&h->xid);
 			unpack(&h->ret);
+			unpack(&h->flags);
 			_ind = RPC_HEADER_SZ;
 		}
 };
@@ -207,9 +295,110 @@ unmarshall& operator>>(unmarshall &, unsigned int &);
 unmarshall& operator>>(unmarshall &, int &);
 unmarshall& operator>>(unmarshall &, unsigned long long &);
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, rpc_bytes &);
+
+// rpc_size(x, refs) is how many bytes marshalling x copies into the
+// pdu's own buffer, so that rpcc::call() and rpcs::reg() can size a
+// pdu before filling it and allocate it once. with refs, as for a
+// REF_LARGE marshall, payloads big enough to be referenced count only
+// their length word. a type without an rpc_size() counts 0, and its
+// bytes grow the buffer as they always have.
+inline int rpc_size(bool, bool) { return 1; }
+inline int rpc_size(char, bool) { return 1; }
+inline int rpc_size(unsigned char, bool) { return 1; }
+inline int rpc_size(short, bool) { return 2; }
+inline int rpc_size(unsigned short, bool) { return 2; }
+inline int rpc_size(int, bool) { return 4; }
+inline int rpc_size(unsigned int, bool) { return 4; }
+inline int rpc_size(unsigned long long, bool) { return 8; }
+
+inline int
+rpc_size_payload(size_t n, bool refs)
+{
+	return sizeof(unsigned int) + (refs && n >= RPC_SG_MIN ? 0 : n);
+}
+
+inline int rpc_size(const std::string &s, bool refs) { return rpc_size_payload(s.size(), refs); }
+inline int rpc_size(const rpc_bytes &b, bool refs) { return rpc_size_payload(b.size(), refs); }
+
+template <class C> int rpc_size(const std::vector<C> &v, bool refs);
+template <class A, class B> int rpc_size(const std::map<A,B> &d, bool refs);
+
+// RPC_FIELDS(a, b, ...) inside a struct marshalls it as those members
+// in that order, in place of hand-written <<, >> and rpc_size():
+//
+//	struct attr {
+//		unsigned int type;
+//		unsigned long long size;
+//		RPC_FIELDS(type, size)
+//	};
+#define RPC_FIELDS(...) \
+	template <class F> void rpc_fields(F &&f) { f(__VA_ARGS__); } \
+	template <class F> void rpc_fields(F &&f) const { f(__VA_ARGS__); }
+
+// what RPC_FIELDS structs and rpcc/rpcs argument lists are fed to
+struct rpc_marshaller {
+	marshall &m;
+	void operator()() { }
+	template <class T, class... Ts> void operator()(const T &x, const Ts &... xs);
+};
+
+struct rpc_unmarshaller {
+	unmarshall &u;
+	void operator()() { }
+	template <class T, class... Ts> void operator()(T &x, Ts &... xs);
+};
+
+struct rpc_sizer {
+	bool refs;
+	int n;
+	void operator()() { }
+	template <class T, class... Ts> void operator()(const T &x, const Ts &... xs);
+};
+
+template <class T> auto
+operator<<(marshall &m, const T &x) -> decltype(x.rpc_fields(rpc_marshaller{m}), m)
+{
+	x.rpc_fields(rpc_marshaller{m});
+	return m;
+}
+
+template <class T> auto
+operator>>(unmarshall &u, T &x) -> decltype(x.rpc_fields(rpc_unmarshaller{u}), u)
+{
+	x.rpc_fields(rpc_unmarshaller{u});
+	return u;
+}
+
+template <class T> auto
+rpc_size(const T &x, bool refs) -> decltype(x.rpc_fields(rpc_sizer{refs, 0}), int())
+{
+	rpc_sizer s = {refs, 0};
+	x.rpc_fields(s);
+	return s.n;
+}
+
+template <class T> auto
+rpc_size_or0(const T &x, bool refs, int) -> decltype(rpc_size(x, refs))
+{
+	return rpc_size(x, refs);
+}
+
+template <class T> int
+rpc_size_or0(const T &, bool, long)
+{
+	return 0;
+}
+
+// rpc_size(x, refs), or 0 for a type that has none
+template <class T> int
+rpc_size_or0(const T &x, bool refs)
+{
+	return rpc_size_or0(x, refs, 0);
+}
 
 template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+operator<<(marshall &m, const std::vector<C> &v)
 {
 	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
@@ -222,14 +411,26 @@ operator>>(unmarshall &u, std::vector<C> &v)
 {
 	unsigned n;
 	u >> n;
-	for(unsigned i = 0; i < n; i++){
-		C z;
-		u >> z;
-		v.push_back(z);
+	// every element takes a byte at least, which keeps a corrupt
+	// count from reserving more than the pdu could hold
+	unsigned left = u.ok() ? u.size() - u.ind() : 0;
+	v.reserve(v.size() + (n < left ? n : left));
+	for(unsigned i = 0; i < n && u.ok(); i++){
+		v.emplace_back();
+		u >> v.back();
 	}
 	return u;
 }
 
+template <class C> int
+rpc_size(const std::vector<C> &v, bool refs)
+{
+	int n = sizeof(unsigned int);
+	for(unsigned i = 0; i < v.size(); i++)
+		n += rpc_size_or0(v[i], refs);
+	return n;
+}
+
 template <class A, class B> marshall &
 operator<<(marshall &m, const std::map<A,B> &d) {
 	typename std::map<A,B>::const_iterator i;
@@ -249,13 +450,43 @@ operator>>(unmarshall &u, std::map<A,B> &d) {
 
 	d.clear();
 
-	for (unsigned int lcv = 0; lcv < n; lcv++) {
+	for (unsigned int lcv = 0; lcv < n && u.ok(); lcv++) {
 		A a;
-		B b;
-		u >> a >> b;
-		d[a] = b;
+		u >> a;
+		u >> d[std::move(a)];
 	}
 	return u;
 }
 
+template <class A, class B> int
+rpc_size(const std::map<A,B> &d, bool refs)
+{
+	int n = sizeof(unsigned int);
+	typename std::map<A,B>::const_iterator i;
+	for (i = d.begin(); i != d.end(); i++)
+		n += rpc_size_or0(i->first, refs) + rpc_size_or0(i->second, refs);
+	return n;
+}
+
+template <class T, class... Ts> void
+rpc_marshaller::operator()(const T &x, const Ts &... xs)
+{
+	m << x;
+	(*this)(xs...);
+}
+
+template <class T, class... Ts> void
+rpc_unmarshaller::operator()(T &x, Ts &... xs)
+{
+	u >> x;
+	(*this)(xs...);
+}
+
+template <class T, class... Ts> void
+rpc_sizer::operator()(const T &x, const Ts &... xs)
+{
+	n += rpc_size_or0(x, refs);
+	(*this)(xs...);
+}
+
 #endif
@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -25,15 +27,52 @@ PollMgr::Instance()
 	return instance;
 }
 
-PollMgr::PollMgr() : pending_change_(false)
+PollMgr::PollMgr()
 {
-	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
-	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 8)
+		n = 8;
+	char *env = getenv("RPC_REACTORS");
+	if (env)
+		n = atoi(env);
+	if (n < 1)
+		n = 1;
+	if (n > MAX_REACTORS)
+		n = MAX_REACTORS;
 
-	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
-	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
-	VERIFY((th_ = method_thread(this, false, &PollMgr::wait_loop)) != 0);
+#ifdef __linux__
+	aio_name_ = "epoll";
+#else
+	aio_name_ = "select";
+#endif
+	env = getenv("RPC_AIO");
+	if (env && strcmp(env, "select") == 0)
+		aio_name_ = "select";
+#ifdef RPC_HAVE_URING
+	if (env && strcmp(env, "uring") == 0)
+		aio_name_ = "uring";
+#endif
+
+	for (int i = 0; i < n; i++) {
+		aio_mgr *aio = NULL;
+#ifdef RPC_HAVE_URING
+		if (strcmp(aio_name_, "uring") == 0) {
+			aio = UringAIO::create();
+			if (!aio) {
+				jsl_log(JSL_DBG_OFF, "PollMgr: no io_uring, using epoll\n");
+				aio_name_ = "epoll";
+			}
+		}
+#endif
+#ifdef __linux__
+		if (!aio && strcmp(aio_name_, "epoll") == 0)
+			aio = new EPollAIO();
+#endif
+		if (!aio)
+			aio = new SelectAIO();
+		reactors_.push_back(new Reactor(aio));
+	}
+	jsl_log(JSL_DBG_2, "PollMgr: %d reactors using %s\n", n, aio_name_);
 }
 
 PollMgr::~PollMgr()
@@ -45,49 +84,111 @@ PollMgr::~PollMgr()
 void
 PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
 {
-	VERIFY(fd < MAX_POLL_FDS);
+	reactor(fd)->add_callback(fd, flag, ch);
+}
+
+//remove all callbacks related to fd
+//the return guarantees that callbacks related to fd
+//will never be called again
+void
+PollMgr::block_remove_fd(int fd)
+{
+	reactor(fd)->block_remove_fd(fd);
+}
+
+void
+PollMgr::del_callback(int fd, poll_flag flag)
+{
+	reactor(fd)->del_callback(fd, flag);
+}
+
+bool
+PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
+{
+	return reactor(fd)->has_callback(fd, flag, c);
+}
+
+Reactor::Reactor(aio_mgr *aio) : aio_(aio), pending_change_(false)
+{
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
+	VERIFY((th_ = method_thread(this, false, &Reactor::wait_loop)) != 0);
+}
+
+Reactor::~Reactor()
+{
+	//never kill me!!!
+	VERIFY(0);
+}
+
+void
+Reactor::add_callback(int fd, poll_flag flag, aio_callback *ch)
+{
+	VERIFY(fd >= 0);
 
 	ScopedLock ml(&m_);
 	aio_->watch_fd(fd, flag);
 
+	if (fd >= (int) callbacks_.size())
+		callbacks_.resize(fd + 1, NULL);
 	VERIFY(!callbacks_[fd] || callbacks_[fd]==ch);
 	callbacks_[fd] = ch;
 }
 
-//remove all callbacks related to fd
-//the return guarantees that callbacks related to fd
-//will never be called again
 void
-PollMgr::block_remove_fd(int fd)
+Reactor::block_remove_fd(int fd)
 {
 	ScopedLock ml(&m_);
 	aio_->unwatch_fd(fd, CB_RDWR);
-	pending_change_ = true;
-	VERIFY(pthread_cond_wait(&changedone_c_, &m_)==0);
-	callbacks_[fd] = NULL;
+	if (!pthread_equal(pthread_self(), th_)) {
+		// wait for wait_loop to come around, so that no callback
+		// for fd is still running. a callback (e.g. an async rpc
+		// callback whose send failed) needs no wait, and would wait
+		// forever.
+		pending_change_ = true;
+		VERIFY(pthread_cond_wait(&changedone_c_, &m_)==0);
+	}
+	if (fd < (int) callbacks_.size())
+		callbacks_[fd] = NULL;
 }
 
 void
-PollMgr::del_callback(int fd, poll_flag flag)
+Reactor::del_callback(int fd, poll_flag flag)
 {
 	ScopedLock ml(&m_);
-	if (aio_->unwatch_fd(fd, flag)) {
+	if (aio_->unwatch_fd(fd, flag) && fd < (int) callbacks_.size()) {
 		callbacks_[fd] = NULL;
 	}
 }
 
 bool
-PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
+Reactor::has_callback(int fd, poll_flag flag, aio_callback *c)
 {
 	ScopedLock ml(&m_);
-	if (!callbacks_[fd] || callbacks_[fd]!=c)
+	if (fd >= (int) callbacks_.size() || !callbacks_[fd] || callbacks_[fd]!=c)
 		return false;
 
 	return aio_->is_watched(fd, flag);
 }
 
 void
-PollMgr::wait_loop()
+Reactor::kick(int fd)
+{
+	ScopedLock ml(&m_);
+	kicked_.push_back(fd);
+	aio_->wakeup();
+}
+
+aio_callback *
+Reactor::callback(int fd)
+{
+	// callbacks_ may be resized by add_callback on another thread
+	ScopedLock ml(&m_);
+	return fd < (int) callbacks_.size() ? callbacks_[fd] : NULL;
+}
+
+void
+Reactor::wait_loop()
 {
 
 	std::vector<int> readable;
@@ -104,23 +205,29 @@ PollMgr::wait_loop()
 		readable.clear();
 		writable.clear();
 		aio_->wait_ready(&readable,&writable);
+		{
+			ScopedLock ml(&m_);
+			readable.insert(readable.end(), kicked_.begin(), kicked_.end());
+			kicked_.clear();
+		}
 
 		if (!readable.size() && !writable.size()) {
 			continue;
 		} 
-		//no locking of m_
-		//because no add_callback() and del_callback should 
-		//modify callbacks_[fd] while the fd is not dead
+		//the callback of a live fd does not change, and one removed
+		//by a callback on this thread reads as NULL from here on
 		for (unsigned int i = 0; i < readable.size(); i++) {
 			int fd = readable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->read_cb(fd);
+			aio_callback *cb = callback(fd);
+			if (cb)
+				cb->read_cb(fd);
 		}
 
 		for (unsigned int i = 0; i < writable.size(); i++) {
 			int fd = writable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->write_cb(fd);
+			aio_callback *cb = callback(fd);
+			if (cb)
+				cb->write_cb(fd);
 		}
 	}
 }
@@ -149,6 +256,7 @@ SelectAIO::~SelectAIO()
 void
 SelectAIO::watch_fd(int fd, poll_flag flag)
 {
+	VERIFY(fd < FD_SETSIZE);
 	ScopedLock ml(&m_);
 	if (highfds_ <= fd) 
 		highfds_ = fd;
@@ -162,6 +270,12 @@ SelectAIO::watch_fd(int fd, poll_flag flag)
 		FD_SET(fd,&wfds_);
 	}
 
+	wakeup();
+}
+
+void
+SelectAIO::wakeup()
+{
 	char tmp = 1;
 	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
 }
@@ -208,8 +322,7 @@ SelectAIO::unwatch_fd(int fd, poll_flag flag)
 		}
 	}
 	if (flag == CB_RDWR) {
-		char tmp = 1;
-		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+		wakeup();
 	}
 	return (!FD_ISSET(fd, &rfds_) && !FD_ISSET(fd, &wfds_));
 }
@@ -262,12 +375,23 @@ EPollAIO::EPollAIO()
 {
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
-	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	VERIFY(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
+	close(pipefd_[0]);
+	close(pipefd_[1]);
 }
 
 static inline
@@ -287,7 +411,8 @@ int poll_flag_to_event(poll_flag flag)
 void
 EPollAIO::watch_fd(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
+	if (fd >= (int) fdstatus_.size())
+		fdstatus_.resize(fd + 1, 0);
 
 	struct epoll_event ev;
 	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
@@ -313,7 +438,13 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 bool 
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
+	if (flag == CB_RDWR) {
+		// wake wait_ready so a blocked block_remove_fd() gets its
+		// changedone_c_ even when nothing else happens
+		wakeup();
+	}
+	if (fd >= (int) fdstatus_.size() || !fdstatus_[fd])
+		return true;
 	fdstatus_[fd] &= ~(int)flag;
 
 	struct epoll_event ev;
@@ -336,19 +467,41 @@ EPollAIO::unwatch_fd(int fd, poll_flag flag)
 	return (op == EPOLL_CTL_DEL);
 }
 
+void
+EPollAIO::wakeup()
+{
+	char tmp = 1;
+	VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+}
+
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
-	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	if (fd >= (int) fdstatus_.size())
+		return false;
+	return ((fdstatus_[fd] & flag) == flag);
 }
 
 void
 EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
 	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	if (nfds < 0) {
+		if (errno == EINTR)
+			return;
+		perror("epoll_wait:");
+		jsl_log(JSL_DBG_OFF, "PollMgr::epoll_loop failure errno %d\n",errno);
+		VERIFY(0);
+	}
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
+		if (ready_[i].data.fd == pipefd_[0]) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			continue;
+		}
+		// errors and hangups are seen by the read callback
+		if (ready_[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
 			readable->push_back(ready_[i].data.fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
@@ -358,3 +511,527 @@ EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 }
 
 #endif
+
+#ifdef RPC_HAVE_URING
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024
+#define URING_SLOTS 16           // registered read buffers per ring
+#define URING_SLOT_SZ (64<<10)
+#define URING_EXTRA_SZ (16<<10)  // read buffer once the slots are taken
+
+// the submission and completion rings, mapped from the kernel. only
+// this file sees <linux/io_uring.h>, which drags <linux/fs.h> along.
+struct UringState {
+	UringState();
+	~UringState();
+	void reserve(unsigned n);
+	struct io_uring_sqe *get_sqe();
+	void enter(bool wait);
+
+	int fd;
+	unsigned sq_entries;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_map_sz, cq_map_sz, sqes_sz;
+	unsigned sqtail;    // local tail, published by enter()
+	unsigned pending;   // sqes not yet submitted
+};
+
+// user_data is a pointer or (fd, seq) pair with one of these in the
+// low bits
+enum { UD_RPOLL = 1, UD_READ, UD_WPOLL, UD_WAKE, UD_CANCEL };
+#define UD_TAG(ud) ((int) ((ud) & 7))
+
+static inline uint64_t
+wpoll_ud(int fd, uint32_t seq)
+{
+	return ((uint64_t) seq << 32) | ((uint64_t) fd << 3) | UD_WPOLL;
+}
+
+UringState::UringState()
+	: fd(-1), sq_entries(0), sqes(NULL), cqes(NULL), sq_map(MAP_FAILED),
+	cq_map(MAP_FAILED), sq_map_sz(0), cq_map_sz(0), sqes_sz(0), sqtail(0),
+	pending(0)
+{
+}
+
+UringState::~UringState()
+{
+	if (sqes)
+		munmap(sqes, sqes_sz);
+	if (cq_map != MAP_FAILED && cq_map != sq_map)
+		munmap(cq_map, cq_map_sz);
+	if (sq_map != MAP_FAILED)
+		munmap(sq_map, sq_map_sz);
+	if (fd >= 0)
+		close(fd);
+}
+
+// make room for n sqes that must go in together, submitting what is
+// queued if need be
+void
+UringState::reserve(unsigned n)
+{
+	while (sq_entries - (sqtail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE)) < n)
+		enter(false);
+}
+
+struct io_uring_sqe *
+UringState::get_sqe()
+{
+	reserve(1);
+	struct io_uring_sqe *sqe = &sqes[sqtail & *sq_mask];
+	sqtail++;
+	pending++;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// submit what is queued and, if wait, sleep until a completion arrives
+void
+UringState::enter(bool wait)
+{
+	if (!pending && !wait)
+		return;
+	__atomic_store_n(sq_tail, sqtail, __ATOMIC_RELEASE);
+	int r = syscall(__NR_io_uring_enter, fd, pending, wait ? 1 : 0,
+			wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (r < 0) {
+		// EBUSY/EAGAIN: the completion queue is backed up; reaping
+		// makes room
+		if (errno == EINTR || errno == EBUSY || errno == EAGAIN)
+			return;
+		perror("io_uring_enter:");
+		jsl_log(JSL_DBG_OFF, "UringAIO::enter failure errno %d\n", errno);
+		VERIFY(0);
+	}
+	pending -= r;
+}
+
+UringAIO::UringAIO()
+	: ring_(new UringState()), wake_fd_(-1), wakebuf_(0), wake_armed_(false),
+	sleeping_(false), wake_pending_(false), skip_ok_(false),
+	arena_(NULL), fixed_(false), free_reqs_(NULL)
+{
+	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
+}
+
+UringAIO::~UringAIO()
+{
+	while (free_reqs_) {
+		rdreq *r = free_reqs_;
+		free_reqs_ = r->next;
+		delete r;
+	}
+	free(arena_);
+	delete ring_;
+	if (wake_fd_ >= 0)
+		close(wake_fd_);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
+}
+
+UringAIO *
+UringAIO::create()
+{
+	UringAIO *u = new UringAIO();
+	if (!u->setup()) {
+		delete u;
+		return NULL;
+	}
+	return u;
+}
+
+bool
+UringAIO::setup()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring_->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ring_->fd < 0) {
+		jsl_log(JSL_DBG_1, "UringAIO: io_uring_setup failed errno %d\n", errno);
+		return false;
+	}
+	// FAST_POLL (5.7) also means IORING_OP_READ is there
+	if (!(p.features & IORING_FEAT_FAST_POLL)) {
+		jsl_log(JSL_DBG_1, "UringAIO: kernel io_uring too old\n");
+		return false;
+	}
+#if defined(IORING_FEAT_CQE_SKIP) && defined(IOSQE_CQE_SKIP_SUCCESS)
+	skip_ok_ = (p.features & IORING_FEAT_CQE_SKIP) != 0;
+#endif
+
+	ring_->sq_map_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring_->cq_map_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single) {
+		if (ring_->cq_map_sz > ring_->sq_map_sz)
+			ring_->sq_map_sz = ring_->cq_map_sz;
+		ring_->cq_map_sz = ring_->sq_map_sz;
+	}
+	ring_->sq_map = mmap(0, ring_->sq_map_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_->fd, IORING_OFF_SQ_RING);
+	if (ring_->sq_map == MAP_FAILED)
+		return false;
+	if (single) {
+		ring_->cq_map = ring_->sq_map;
+	} else {
+		ring_->cq_map = mmap(0, ring_->cq_map_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_->fd, IORING_OFF_CQ_RING);
+		if (ring_->cq_map == MAP_FAILED)
+			return false;
+	}
+	ring_->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	void *sqes = mmap(0, ring_->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring_->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	ring_->sqes = (struct io_uring_sqe *) sqes;
+
+	char *sq = (char *) ring_->sq_map, *cq = (char *) ring_->cq_map;
+	ring_->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring_->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring_->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring_->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring_->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring_->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring_->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	ring_->sq_entries = p.sq_entries;
+	ring_->sqtail = *ring_->sq_tail;
+	// sqe i always sits in array slot i
+	unsigned *array = (unsigned *) (sq + p.sq_off.array);
+	for (unsigned i = 0; i < ring_->sq_entries; i++)
+		array[i] = i;
+
+	wake_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd_ < 0)
+		return false;
+
+	// the read slots. without registration (e.g. RLIMIT_MEMLOCK) they
+	// are read into with plain IORING_OP_READ.
+	if (posix_memalign((void **) &arena_, 4096, URING_SLOTS * URING_SLOT_SZ) != 0) {
+		arena_ = NULL;
+		return false;
+	}
+	struct iovec iov[URING_SLOTS];
+	for (int i = 0; i < URING_SLOTS; i++) {
+		iov[i].iov_base = arena_ + i * URING_SLOT_SZ;
+		iov[i].iov_len = URING_SLOT_SZ;
+	}
+	fixed_ = syscall(__NR_io_uring_register, ring_->fd,
+			IORING_REGISTER_BUFFERS, iov, URING_SLOTS) == 0;
+	for (int i = URING_SLOTS - 1; i >= 0; i--) {
+		rdreq *r = new rdreq();
+		r->slot = i;
+		r->buf = arena_ + i * URING_SLOT_SZ;
+		r->cap = URING_SLOT_SZ;
+		r->next = free_reqs_;
+		free_reqs_ = r;
+	}
+	jsl_log(JSL_DBG_2, "UringAIO: %u entries, %s buffers, cqe skip %d\n",
+			ring_->sq_entries, fixed_ ? "registered" : "unregistered", skip_ok_);
+	return true;
+}
+
+UringAIO::rdreq *
+UringAIO::get_rdreq()
+{
+	rdreq *r = free_reqs_;
+	if (r) {
+		free_reqs_ = r->next;
+	} else {
+		r = new rdreq();
+		r->slot = -1;
+		r->buf = (char *) malloc(URING_EXTRA_SZ);
+		VERIFY(r->buf);
+		r->cap = URING_EXTRA_SZ;
+	}
+	r->res = r->off = 0;
+	r->next = NULL;
+	return r;
+}
+
+void
+UringAIO::put_rdreq(rdreq *r)
+{
+	if (r->slot < 0) {
+		free(r->buf);
+		delete r;
+		return;
+	}
+	r->next = free_reqs_;
+	free_reqs_ = r;
+}
+
+void
+UringAIO::cancel(uint64_t ud)
+{
+	struct io_uring_sqe *sqe = ring_->get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ud;
+	sqe->user_data = UD_CANCEL;
+}
+
+// a POLLIN poll linked to a read into rd's buffer, so the read is only
+// issued once there is data and never parks a kernel worker
+void
+UringAIO::arm_read(int fd)
+{
+	rdreq *r = get_rdreq();
+	r->fd = fd;
+	ring_->reserve(2);
+
+	struct io_uring_sqe *sqe = ring_->get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->flags = IOSQE_IO_LINK;
+#if defined(IORING_FEAT_CQE_SKIP) && defined(IOSQE_CQE_SKIP_SUCCESS)
+	if (skip_ok_)
+		sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+#endif
+	sqe->user_data = (uint64_t) (uintptr_t) r | UD_RPOLL;
+
+	sqe = ring_->get_sqe();
+	sqe->opcode = (fixed_ && r->slot >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t) (uintptr_t) r->buf;
+	sqe->len = r->cap;
+	if (sqe->opcode == IORING_OP_READ_FIXED)
+		sqe->buf_index = r->slot;
+	sqe->user_data = (uint64_t) (uintptr_t) r | UD_READ;
+
+	fds_[fd].rd = r;
+}
+
+void
+UringAIO::dirty(int fd)
+{
+	if (!fds_[fd].dirty) {
+		fds_[fd].dirty = true;
+		dirty_.push_back(fd);
+	}
+}
+
+// arm whatever fd is watched for but has nothing in flight for
+void
+UringAIO::sync(int fd)
+{
+	fdstate &st = fds_[fd];
+	st.dirty = false;
+	if ((st.flags & CB_RDONLY) && !st.rd && !st.staged)
+		arm_read(fd);
+	if ((st.flags & CB_WRONLY) && !st.wpoll) {
+		struct io_uring_sqe *sqe = ring_->get_sqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = wpoll_ud(fd, st.wseq);
+		st.wpoll = true;
+	}
+}
+
+void
+UringAIO::watch_fd(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if (fd >= (int) fds_.size()) {
+		fdstate z;
+		memset(&z, 0, sizeof(z));
+		fds_.resize(fd + 1, z);
+	}
+	fds_[fd].flags |= (int) flag;
+	dirty(fd);
+	if (sleeping_)
+		wake_locked();
+}
+
+bool
+UringAIO::unwatch_fd(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	// like EPollAIO, always come around for a blocked block_remove_fd()
+	if (flag == CB_RDWR)
+		wake_locked();
+	if (fd >= (int) fds_.size() || !fds_[fd].flags)
+		return true;
+
+	// requests already in flight for fd are cancelled and left to
+	// complete into the void: fd may be closed and reused before then
+	fdstate &st = fds_[fd];
+	st.flags &= ~(int) flag;
+	if (!(st.flags & CB_RDONLY)) {
+		if (st.rd) {
+			cancels_.push_back((uint64_t) (uintptr_t) st.rd | UD_RPOLL);
+			cancels_.push_back((uint64_t) (uintptr_t) st.rd | UD_READ);
+			st.rd = NULL;
+		}
+		if (st.staged) {
+			put_rdreq(st.staged);
+			st.staged = NULL;
+		}
+	}
+	if (!(st.flags & CB_WRONLY) && st.wpoll) {
+		cancels_.push_back(wpoll_ud(fd, st.wseq));
+		st.wpoll = false;
+		st.wseq++;
+	}
+	return st.flags == 0;
+}
+
+void
+UringAIO::wakeup()
+{
+	ScopedLock ml(&m_);
+	wake_locked();
+}
+
+void
+UringAIO::wake_locked()
+{
+	if (sleeping_) {
+		uint64_t one = 1;
+		VERIFY(write(wake_fd_, &one, sizeof(one)) == sizeof(one));
+	} else {
+		wake_pending_ = true;
+	}
+}
+
+bool
+UringAIO::is_watched(int fd, poll_flag flag)
+{
+	ScopedLock ml(&m_);
+	if (fd >= (int) fds_.size())
+		return false;
+	return (fds_[fd].flags & flag) == flag;
+}
+
+void
+UringAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
+{
+	bool wait;
+	{
+		ScopedLock ml(&m_);
+		for (size_t i = 0; i < cancels_.size(); i++)
+			cancel(cancels_[i]);
+		cancels_.clear();
+		for (size_t i = 0; i < dirty_.size(); i++)
+			sync(dirty_[i]);
+		dirty_.clear();
+		if (!wake_armed_) {
+			struct io_uring_sqe *sqe = ring_->get_sqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = wake_fd_;
+			sqe->addr = (uint64_t) (uintptr_t) &wakebuf_;
+			sqe->len = sizeof(wakebuf_);
+			sqe->user_data = UD_WAKE;
+			wake_armed_ = true;
+		}
+		wait = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE) == *ring_->cq_head &&
+			!wake_pending_;
+		wake_pending_ = false;
+		sleeping_ = wait;
+	}
+
+	// one syscall submits every change made since the last round and
+	// waits for the next completion
+	ring_->enter(wait);
+
+	ScopedLock ml(&m_);
+	sleeping_ = false;
+	reap(readable, writable);
+}
+
+void
+UringAIO::reap(std::vector<int> *readable, std::vector<int> *writable)
+{
+	unsigned head = *ring_->cq_head;
+	unsigned tail = __atomic_load_n(ring_->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring_->cqes[head & *ring_->cq_mask];
+		uint64_t ud = cqe->user_data;
+		int res = cqe->res;
+
+		switch (UD_TAG(ud)) {
+		case UD_WAKE:
+			wake_armed_ = false;
+			break;
+		case UD_READ: {
+			rdreq *r = (rdreq *) (uintptr_t) (ud & ~(uint64_t) 7);
+			int fd = r->fd;
+			if (fd >= (int) fds_.size() || fds_[fd].rd != r) {
+				// cancelled by unwatch_fd
+				put_rdreq(r);
+				break;
+			}
+			fdstate &st = fds_[fd];
+			st.rd = NULL;
+			if (res == -EAGAIN || res == -ECANCELED || res == -EINTR) {
+				put_rdreq(r);
+				dirty(fd);
+				break;
+			}
+			r->res = res;
+			st.staged = r;
+			readable->push_back(fd);
+			break;
+		}
+		case UD_WPOLL: {
+			int fd = (int) ((ud >> 3) & 0x1fffffff);
+			uint32_t seq = (uint32_t) (ud >> 32);
+			if (fd >= (int) fds_.size() || !fds_[fd].wpoll || fds_[fd].wseq != seq)
+				break;
+			fds_[fd].wpoll = false;
+			fds_[fd].wseq++;
+			// re-armed if write_cb still watches for it
+			dirty(fd);
+			writable->push_back(fd);
+			break;
+		}
+		default:
+			// UD_RPOLL: the linked read reports; UD_CANCEL
+			break;
+		}
+	}
+	__atomic_store_n(ring_->cq_head, head, __ATOMIC_RELEASE);
+}
+
+ssize_t
+UringAIO::recv(int fd, void *buf, size_t n)
+{
+	ScopedLock ml(&m_);
+	rdreq *r = fd < (int) fds_.size() ? fds_[fd].staged : NULL;
+	if (!r) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (r->res <= 0) {
+		// eof or an error, for as long as anyone asks
+		if (r->res == 0)
+			return 0;
+		errno = -r->res;
+		return -1;
+	}
+	size_t m = r->res - r->off;
+	if (m > n)
+		m = n;
+	memcpy(buf, r->buf + r->off, m);
+	r->off += m;
+	if (r->off == r->res) {
+		fds_[fd].staged = NULL;
+		put_rdreq(r);
+		dirty(fd);
+	}
+	return m;
+}
+
+#endif /* RPC_HAVE_URING */
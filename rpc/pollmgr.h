@@ -2,13 +2,23 @@
 #define pollmgr_h 
 
 #include <sys/select.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <vector>
 
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#define RPC_HAVE_URING 1
+#endif
+#endif
 #endif
 
-#define MAX_POLL_FDS 128
+#define MAX_POLL_FDS 128 // events taken from the kernel per epoll_wait
+#define MAX_REACTORS 64
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -24,6 +34,12 @@ class aio_mgr {
 		virtual bool unwatch_fd(int fd, poll_flag flag) = 0;
 		virtual bool is_watched(int fd, poll_flag flag) = 0;
 		virtual void wait_ready(std::vector<int> *readable, std::vector<int> *writable) = 0;
+		// read from a watched fd, on its reactor thread. readiness based
+		// aio_mgrs just read(); a completion based one hands out what its
+		// own reads brought in and fails with EAGAIN until there is more.
+		virtual ssize_t recv(int fd, void *buf, size_t n) { return read(fd, buf, n); }
+		// make a wait_ready() in progress on another thread return
+		virtual void wakeup() = 0;
 		virtual ~aio_mgr() {}
 };
 
@@ -34,34 +50,65 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
-class PollMgr {
+// one event loop: a thread waiting on its own aio_mgr and running the
+// callbacks of the fds it watches.
+class Reactor {
 	public:
-		PollMgr();
-		~PollMgr();
-
-		static PollMgr *Instance();
-		static PollMgr *CreateInst();
+		Reactor(aio_mgr *aio);
+		~Reactor();
 
 		void add_callback(int fd, poll_flag flag, aio_callback *ch);
 		void del_callback(int fd, poll_flag flag);
 		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
 		void block_remove_fd(int fd);
+		ssize_t recv(int fd, void *buf, size_t n) { return aio_->recv(fd, buf, n); }
+		void kick(int fd);
 		void wait_loop();
 
-
-		static PollMgr *instance;
-		static int useful;
-		static int useless;
-
 	private:
 		pthread_mutex_t m_;
 		pthread_cond_t changedone_c_;
 		pthread_t th_;
 
-		aio_callback *callbacks_[MAX_POLL_FDS];
+		std::vector<aio_callback *> callbacks_; // indexed by fd, grows as needed
 		aio_mgr *aio_;
 		bool pending_change_;
+		std::vector<int> kicked_; // run read_cb for these next time around
+
+		aio_callback *callback(int fd);
+};
+
+// PollMgr runs RPC_REACTORS reactors (default: one per core, up to 8)
+// and hashes every fd to one of them, so all callbacks of a connection
+// run on the same thread. RPC_AIO=select or RPC_AIO=uring selects
+// SelectAIO or UringAIO instead of the default EPollAIO.
+class PollMgr {
+	public:
+		PollMgr();
+		~PollMgr();
+
+		static PollMgr *Instance();
 
+		void add_callback(int fd, poll_flag flag, aio_callback *ch);
+		void del_callback(int fd, poll_flag flag);
+		bool has_callback(int fd, poll_flag flag, aio_callback *ch);
+		void block_remove_fd(int fd);
+		ssize_t recv(int fd, void *buf, size_t n) { return reactor(fd)->recv(fd, buf, n); }
+		// call fd's read_cb soon, as if fd had become readable. for a
+		// callback that left data unconsumed and wants another go,
+		// which edge-triggered or completion based readiness would
+		// otherwise not give it.
+		void kick(int fd) { reactor(fd)->kick(fd); }
+		int nreactors() { return reactors_.size(); }
+		const char *aio_name() { return aio_name_; }
+
+		static PollMgr *instance;
+
+	private:
+		std::vector<Reactor *> reactors_;
+		const char *aio_name_;
+
+		Reactor *reactor(int fd) { return reactors_[fd % reactors_.size()]; }
 };
 
 class SelectAIO : public aio_mgr {
@@ -73,6 +120,7 @@ class SelectAIO : public aio_mgr {
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
 		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wakeup();
 
 	private:
 
@@ -94,14 +142,88 @@ class EPollAIO : public aio_mgr {
 		bool unwatch_fd(int fd, poll_flag flag);
 		bool is_watched(int fd, poll_flag flag);
 		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		void wakeup();
 
 	private:
 		int pollfd_;
+		int pipefd_[2];  // wakes wait_ready
 		struct epoll_event ready_[MAX_POLL_FDS];
-		int fdstatus_[MAX_POLL_FDS];
+		std::vector<int> fdstatus_;  // indexed by fd, grows as needed
 
 };
 #endif /* __linux */
 
+#ifdef RPC_HAVE_URING
+struct UringState;  // the rings shared with the kernel, see pollmgr.cc
+
+// io_uring through raw syscalls. Instead of reporting readiness and
+// leaving the read to the connection, it keeps a POLLIN-linked read in
+// flight on every fd watched for reading, into one of a set of
+// registered buffers, and recv() hands out what came in. Changes are
+// queued and submitted together with the wait in one io_uring_enter,
+// so a busy reactor makes about one syscall per batch of events rather
+// than one per read plus one per wait. Writes stay with the
+// connection's writev; CB_WRONLY arms a POLLOUT poll.
+class UringAIO : public aio_mgr {
+	public:
+		static UringAIO *create();  // NULL if io_uring is unavailable
+		~UringAIO();
+		void watch_fd(int fd, poll_flag flag);
+		bool unwatch_fd(int fd, poll_flag flag);
+		bool is_watched(int fd, poll_flag flag);
+		void wait_ready(std::vector<int> *readable, std::vector<int> *writable);
+		ssize_t recv(int fd, void *buf, size_t n);
+		void wakeup();
+
+	private:
+		// an armed POLLIN+read pair, then the data that read brought in
+		struct rdreq {
+			int fd;
+			int slot;   // registered buffer index, or -1
+			char *buf;
+			int cap;
+			int res;    // bytes read, 0 at eof, or -errno
+			int off;    // bytes already handed out by recv()
+			rdreq *next;
+		};
+		struct fdstate {
+			int flags;
+			rdreq *rd;       // in flight
+			rdreq *staged;   // completed, not yet consumed
+			bool wpoll;      // POLLOUT armed
+			bool dirty;      // on dirty_
+			uint32_t wseq;   // tells a stale POLLOUT completion apart
+		};
+
+		UringAIO();
+		bool setup();
+		void wake_locked();
+		void dirty(int fd);
+		void sync(int fd);
+		void arm_read(int fd);
+		void cancel(uint64_t ud);
+		void reap(std::vector<int> *readable, std::vector<int> *writable);
+		rdreq *get_rdreq();
+		void put_rdreq(rdreq *r);
+
+		UringState *ring_;
+		int wake_fd_;
+		uint64_t wakebuf_;
+		bool wake_armed_;
+		bool sleeping_;
+		bool wake_pending_;  // wakeup() came while not sleeping
+		bool skip_ok_;   // IOSQE_CQE_SKIP_SUCCESS works
+
+		char *arena_;
+		bool fixed_;         // arena registered with the ring
+		rdreq *free_reqs_;
+
+		std::vector<fdstate> fds_;
+		std::vector<int> dirty_;
+		std::vector<uint64_t> cancels_;
+		pthread_mutex_t m_;
+};
+#endif /* RPC_HAVE_URING */
+
 #endif /* pollmgr_h */
 
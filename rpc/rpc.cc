@@ -10,25 +10,57 @@
  delivery etc.
 
  Both rpcc and rpcs use the connection class as an abstraction for the
- underlying communication channel.  To send an RPC request/reply, one calls
+ underlying communication channel: a TCP connection, or for peers on one host
+ a unix-domain socket or a pair of shared-memory rings (see make_rpcaddr() and
+ shmring.h).  To send an RPC request/reply, one calls
  connection::send() which blocks until data is sent or the connection has failed
- (thus the caller can free the buffer when send() returns).  When a
+ (thus the caller can free the buffer when send() returns).  Concurrent sends on
+ one connection queue up, and the sender that gets to write flushes the whole
+ queue with a single writev.  When a
  request/reply is received, connection makes a callback into the corresponding
  rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
 
+ An rpcc with batching on (rpcc::set_batching()) and a server that said
+ at bind it takes batches holds small requests back for a few
+ microseconds and sends those that gather as one batch pdu (handler
+ number rpc_const::batch).  rpcs splits a batch into one dispatch
+ job per request, each through the at-most-once logic as usual, and answers
+ each as it finishes.
+
+ An rpcc with compression on (rpcc::set_compression()) and a server that
+ said at bind it can take it sends large request bodies compressed with
+ the codec in lz.h, and lets the server compress large replies.  Flag bits
+ above the handler number in the request header, and in the reply header,
+ mark what is compressed; rpcs decompresses a request before anything
+ looks at its arguments.
+
  Thread organization:
  rpcc uses application threads to send RPC requests and blocks to receive the
- reply or error. All connections use a single PollMgr object to perform async
- socket IO.  PollMgr creates a single thread to examine the readiness of socket
- file descriptors and informs the corresponding connection whenever a socket is
- ready to be read or written.  (We use asynchronous socket IO to reduce the
- number of threads needed to manage these connections; without async IO, at
- least one thread is needed per connection to read data without blocking other
+ reply or error. rpcc::call_async() instead returns once the request is sent;
+ its callback runs on a PollMgr reactor thread when the reply arrives, or on a
+ per-rpcc timer thread that handles retransmission and timeouts for
+ asynchronous calls, so one thread can keep many calls outstanding.  All
+ connections use a single PollMgr object to perform async socket IO.  PollMgr
+ runs a few reactor threads (RPC_REACTORS), each examining the readiness of the
+ socket file descriptors hashed to it, and informs the corresponding connection
+ whenever a socket is ready to be read or written.  (We use asynchronous socket
+ IO to reduce the number of threads needed to manage these connections; without
+ async IO, at least one thread is needed per connection to read data without blocking other
  activities.)  Each rpcs object creates one thread for listening on the server
  port and a pool of threads for executing RPC requests.  The
  thread pool allows us to control the number of threads spawned at the server
  (spawning one thread per request will hurt when the server faces thousands of
- requests).
+ requests).  When its queue is full, rpcs::got_pdu() refuses the request and
+ the connection stops reading until a worker frees up, so an overloaded server
+ slows its clients down through TCP flow control instead of dropping requests
+ that would only be retransmitted.
+
+ A handler registered with rpcs::reg_async() does not answer as it returns:
+ it gets an rpc_reply to answer through later, typically from the callbacks
+ of rpcc::call_async()s it starts to other servers.  Its dispatch thread goes
+ back to the pool meanwhile, so requests that fan out into nested calls do not
+ each hold a thread for the whole round trip.  The answer may come on a
+ reactor thread, which must not block, so a dispatch thread sends it.
 
  In order to delete a connection object, we must maintain a reference count.
  For rpcc,
@@ -54,10 +86,9 @@
  accepting new incoming connections. 2. close existing active connections.
  3.  delete the dispatch thread pool which involves waiting for current active
  RPC handlers to finish.  It is interesting how a thread pool can be deleted
- without using thread cancellation. The trick is to inject x "poison pills" for
- a thread pool of x threads. Upon getting a poison pill instead of a normal 
- task, a worker thread will exit (and thread pool destructor waits to join all
- x exited worker threads).
+ without using thread cancellation. The destructor sets a flag and wakes every
+ worker; a worker that finds no work left and the flag set exits, and the
+ destructor joins them all.
  */
 
 #include "rpc.h"
@@ -69,25 +100,85 @@
 #include <netinet/tcp.h>
 #include <time.h>
 #include <netdb.h>
+#include <sched.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "jsl_log.h"
 #include "gettime.h"
+#include "lz.h"
 #include "lang/verify.h"
 
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
-rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+// callslot states. S_ASYNC marks a call that has a callback.
+static const unsigned int S_FREE = 0;     // no call in the slot
+static const unsigned int S_LOCKED = 1;   // someone is filling in or updating the caller
+static const unsigned int S_PENDING = 2;  // sent, waiting for the reply
+static const unsigned int S_CLAIMED = 3;  // being finished by whoever claimed it
+static const unsigned int S_DONE = 4;     // reply or cancel posted to call1()
+static const unsigned int S_STATE = 7;
+static const unsigned int S_ASYNC = 8;
+
+static inline unsigned int
+slot_xid(uint64_t w)
+{
+	return (unsigned int) (w >> 32);
+}
+
+// move x on past xid, unless another thread already has. a failed
+// compare_exchange would overwrite its expected value, so it gets a copy.
+static inline void
+advance_xid(std::atomic<unsigned int> &x, unsigned int xid)
+{
+	x.compare_exchange_strong(xid, xid + 1);
+}
+
+static inline int64_t
+ts_ns(const struct timespec &t)
+{
+	return (int64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#ifdef __linux__
+static void
+futex_wait(std::atomic<uint32_t> *a, uint32_t v, const struct timespec *rel)
+{
+	syscall(SYS_futex, (uint32_t *) a, FUTEX_WAIT_PRIVATE, v, rel, NULL, 0);
+}
+
+static void
+futex_wake(std::atomic<uint32_t> *a)
+{
+	syscall(SYS_futex, (uint32_t *) a, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+// no futex: poll every millisecond
+static void
+futex_wait(std::atomic<uint32_t> *a, uint32_t v, const struct timespec *rel)
+{
+	struct timespec ts = { 0, 1000000 };
+	if (rel->tv_sec == 0 && rel->tv_nsec < ts.tv_nsec)
+		ts = *rel;
+	if (a->load() == v)
+		nanosleep(&ts, NULL);
+}
+
+static void
+futex_wake(std::atomic<uint32_t> *a)
 {
-	VERIFY(pthread_mutex_init(&m,0) == 0);
-	VERIFY(pthread_cond_init(&c, 0) == 0);
 }
+#endif
 
-rpcc::caller::~caller()
+rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
+: xid(xxid), un(xun), intret(0), done(false), sent(false), gen(0), curr_to(0),
+	xid_rep(0), zrep(false), proc(0), start(0), retrans(0), raw_out(0),
+	wire_out(0), wire_in(0)
 {
-	VERIFY(pthread_mutex_destroy(&m) == 0);
-	VERIFY(pthread_cond_destroy(&c) == 0);
 }
 
 inline
@@ -98,13 +189,26 @@ void set_rand_seed()
 	srandom((int)ts.tv_nsec^((int)getpid()));
 }
 
-rpcc::rpcc(sockaddr_in d, bool retrans) : 
+rpcc::rpcc(sockaddr_in d, bool retrans) : rpcc(rpcaddr(d), retrans)
+{
+}
+
+rpcc::rpcc(const rpcaddr &d, bool retrans) : 
 	dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+	retrans_(retrans), reachable_(true), chan_(NULL), chan_gen_(0), destroy_wait_ (false),
+	timer_started_(false), timer_stop_(false), timer_next_(0), async_running_(0),
+	acked_(1), batch_usecs_(0), batch_max_(RPC_BATCH_MAX), batch_started_(false),
+	batch_stop_(false), batch_(NULL), z_min_(0), z_ok_(false), dl_ok_(false), ck_ok_(false),
+	batch_ok_(false),
+	srtt_(0), rttvar_(0),
+	xid_rep_done_(-1)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&timer_c_, 0) == 0);
+	VERIFY(pthread_mutex_init(&batch_m_, 0) == 0);
+	VERIFY(pthread_cond_init(&batch_c_, 0) == 0);
 
 	if(retrans){
 		set_rand_seed();
@@ -121,8 +225,31 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 		lossytest_ = atoi(loss_env);
 	}
 
-	// xid starts with 1 and latest received reply starts with 0
-	xid_rep_window_.push_back(0);
+	char *batch_env = getenv("RPC_BATCH");
+	if(batch_env != NULL){
+		batch_usecs_ = atoi(batch_env);
+	}
+
+	char *z_env = getenv("RPC_COMPRESS");
+	if(z_env != NULL){
+		z_min_ = atoi(z_env);
+	}
+
+	// xid starts with 1 and latest received reply starts with 0. each
+	// slot starts out as if the xid RPCC_SLOTS before its first one had
+	// come and gone.
+	stats_ = new rpc_stats("rpcc " + d.str());
+	stats_->set_extra([this]() { return rtt_json(); });
+
+	slots_ = new callslot[RPCC_SLOTS];
+	for (unsigned int i = 0; i < RPCC_SLOTS; i++) {
+		slots_[i].w = (uint64_t) (i - RPCC_SLOTS) << 32 | S_FREE;
+		slots_[i].cur = 0;
+		slots_[i].seq = 0;
+		slots_[i].waiting = 0;
+		slots_[i].due = 0;
+		slots_[i].ca = NULL;
+	}
 
 	jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n", 
 			clt_nonce_, lossytest_); 
@@ -134,27 +261,62 @@ rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n", 
 			clt_nonce_, chan_?chan_->channo():-1); 
+	stats_->set_extra(NULL);
+	cancel_async();
+	if(timer_started_){
+		{
+			ScopedLock ml(&m_);
+			timer_stop_ = true;
+			VERIFY(pthread_cond_signal(&timer_c_) == 0);
+		}
+		VERIFY(pthread_join(timer_th_, NULL) == 0);
+	}
+	if(batch_started_){
+		{
+			ScopedLock bl(&batch_m_);
+			batch_stop_ = true;
+			VERIFY(pthread_cond_signal(&batch_c_) == 0);
+		}
+		VERIFY(pthread_join(batch_th_, NULL) == 0);
+	}
+	delete batch_;
 	if(chan_){
 		chan_->closeconn();
 		chan_->decref();
 	}
-	VERIFY(calls_.size() == 0);
+	VERIFY(!busy());
+	delete[] slots_;
+	delete stats_;
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_cond_destroy(&timer_c_) == 0);
+	VERIFY(pthread_mutex_destroy(&batch_m_) == 0);
+	VERIFY(pthread_cond_destroy(&batch_c_) == 0);
 }
 
 int
 rpcc::bind(TO to)
 {
 	int r;
-	int ret = call(rpc_const::bind, 0, r, to);
-	if(ret == 0){
-		ScopedLock ml(&m_);
-		bind_done_ = true;
+	// ask for every feature, whether or not it is on yet; the server
+	// returns those it has, and an old one returns 0
+	int ret = call(rpc_const::bind, (int) rpc_const::features, r, to);
+	if(ret >= 0){
 		srv_nonce_ = r;
+		z_ok_ = (ret & rpc_const::feat_compress) != 0;
+		dl_ok_ = (ret & rpc_const::feat_deadline) != 0;
+		batch_ok_ = (ret & rpc_const::feat_batch) != 0;
+		if(ret & rpc_const::feat_checksum){
+			ScopedLock ml(&chan_m_);
+			ck_ok_ = true;
+			if(chan_)
+				chan_->set_summed(true);
+		}
+		ret = 0;
+		bind_done_ = true;
 	} else {
 		jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n", 
-				inet_ntoa(dst_.sin_addr), ret);
+				dst_.str().c_str(), ret);
 	}
 	return ret;
 };
@@ -163,28 +325,231 @@ rpcc::bind(TO to)
 void
 rpcc::cancel(void)
 {
-  ScopedLock ml(&m_);
+  cancel_async();
+
   printf("rpcc::cancel: force callers to fail\n");
-  std::map<int,caller*>::iterator it;
-  for(it = calls_.begin(); it != calls_.end(); it++){
-    caller *ca = it->second;
+  for (int i = 0; i < RPCC_SLOTS; i++) {
+    callslot &s = slots_[i];
+    if ((s.w & (S_STATE|S_ASYNC)) != S_PENDING)
+      continue;
+    if (!claim(s, s.cur, S_CLAIMED))
+      continue;
 
     jsl_log(JSL_DBG_2, "rpcc::cancel: force caller to fail\n");
-    {
-      ScopedLock cl(&ca->m);
-      ca->done = true;
-      ca->intret = rpc_const::cancel_failure;
-      VERIFY(pthread_cond_signal(&ca->c) == 0);
-    }
+    s.ca->done = true;
+    s.ca->intret = rpc_const::cancel_failure;
+    post_done(s);
   }
 
-  while (calls_.size () > 0){
-    destroy_wait_ = true;
+  ScopedLock ml(&m_);
+  while (busy() || async_running_ > 0)
     VERIFY(pthread_cond_wait(&destroy_wait_c_,&m_) == 0);
-  }
   printf("rpcc::cancel: done\n");
 }
 
+// Fail every outstanding asynchronous call with cancel_failure and wait
+// for callbacks already claimed by got_pdu() or timer_loop() to return.
+// No new calls are accepted after this.
+void
+rpcc::cancel_async()
+{
+	destroy_wait_ = true;
+
+	std::list<caller *> cancelled;
+	for (int i = 0; i < RPCC_SLOTS; i++) {
+		callslot &s = slots_[i];
+		if (!(s.w & S_ASYNC) || !claim(s, s.cur, S_CLAIMED))
+			continue;
+		cancelled.push_back(s.ca);
+		async_running_++;
+		free_slot(s);
+	}
+	for (std::list<caller *>::iterator i = cancelled.begin();
+			i != cancelled.end(); i++) {
+		unmarshall none;
+		finish_async(*i, rpc_const::cancel_failure, none);
+	}
+
+	ScopedLock ml(&m_);
+	while (async_running_ > 0)
+		VERIFY(pthread_cond_wait(&destroy_wait_c_, &m_) == 0);
+}
+
+// Take the next xid whose slot is free and put ca in it, S_LOCKED. An
+// xid whose slot still holds an older call is skipped and never sent,
+// so a call stuck at the server does not hold up the ones behind it;
+// only when every slot is busy does this wait.
+rpcc::callslot *
+rpcc::new_call(caller *ca)
+{
+	int skipped = 0;
+	while (1) {
+		unsigned int xid = xid_;
+		if (xid == 0) {
+			// marks a batch reply; never a call's
+			advance_xid(xid_, xid);
+			continue;
+		}
+		callslot &s = slot(xid);
+		uint64_t w = s.w;
+		if ((int) (slot_xid(w) - xid) >= 0) {
+			// taken or skipped by another thread
+			advance_xid(xid_, xid);
+			continue;
+		}
+		if ((w & S_STATE) == S_FREE) {
+			if (!s.w.compare_exchange_strong(w, (uint64_t) xid << 32 | S_LOCKED))
+				continue;
+			advance_xid(xid_, xid);
+			ca->xid = xid;
+			s.ca = ca;
+			s.cur = xid;
+			return &s;
+		}
+		if ((w & S_STATE) == S_LOCKED) {
+			// its owner is about to say which call it holds
+			sched_yield();
+			continue;
+		}
+		if (skipped >= RPCC_SLOTS) {
+			usleep(100);
+			continue;
+		}
+		if (s.w.compare_exchange_strong(w, (uint64_t) xid << 32 | (w & 0xffffffff))) {
+			skipped++;
+			advance_xid(xid_, xid);
+		}
+	}
+}
+
+// Move the pending call xid in s to state to, waiting out a short
+// S_LOCKED spell. False if xid is not pending: it has been answered,
+// given up or cancelled, or was never sent.
+bool
+rpcc::claim(callslot &s, unsigned int xid, unsigned int to)
+{
+	uint64_t w = s.w;
+	while (1) {
+		unsigned int st = w & S_STATE;
+		if ((st != S_PENDING && st != S_LOCKED) || s.cur != xid)
+			return false;
+		if (st == S_LOCKED) {
+			sched_yield();
+			w = s.w;
+			continue;
+		}
+		if (s.w.compare_exchange_weak(w, (w & ~(uint64_t) S_STATE) | to))
+			return true;
+	}
+}
+
+// Change the state of a call this thread has claimed or locked. The
+// slot's xid mark may move under us as other threads skip it.
+void
+rpcc::set_state(callslot &s, unsigned int st)
+{
+	uint64_t keep = st == S_FREE ? ~(uint64_t) 0xffffffff : ~(uint64_t) S_STATE;
+	uint64_t w = s.w;
+	while (!s.w.compare_exchange_weak(w, (w & keep) | st))
+		;
+}
+
+// hand a claimed synchronous call back to its thread in call1()
+void
+rpcc::post_done(callslot &s)
+{
+	set_state(s, S_DONE);
+	s.seq++;
+	if (s.waiting)
+		futex_wake(&s.seq);
+}
+
+// wait in call1() until the call in s is done or deadline passes
+bool
+rpcc::wait_done(callslot &s, const struct timespec &deadline)
+{
+	while (1) {
+		uint32_t seq = s.seq;
+		if ((s.w & S_STATE) == S_DONE)
+			return true;
+
+		struct timespec now, rel;
+		clock_gettime(CLOCK_REALTIME, &now);
+		int64_t left = ts_ns(deadline) - ts_ns(now);
+		if (left <= 0)
+			return false;
+		rel.tv_sec = left / 1000000000;
+		rel.tv_nsec = left % 1000000000;
+
+		// post_done() either sees waiting or bumps seq before we sleep
+		s.waiting = 1;
+		if ((s.w & S_STATE) != S_DONE) {
+			jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
+			futex_wait(&s.seq, seq, &rel);
+		}
+		s.waiting = 0;
+	}
+}
+
+// call1() is through with its call: free the slot, first waiting for a
+// reply or cancel that has claimed the call to be posted. True if one
+// was.
+bool
+rpcc::end_call(callslot &s)
+{
+	bool done = !claim(s, s.cur, S_CLAIMED);
+	if (done) {
+		while ((s.w & S_STATE) != S_DONE)
+			sched_yield();
+	}
+	free_slot(s);
+	return done;
+}
+
+void
+rpcc::free_slot(callslot &s)
+{
+	set_state(s, S_FREE);
+	if (destroy_wait_) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
+	}
+}
+
+bool
+rpcc::busy()
+{
+	for (int i = 0; i < RPCC_SLOTS; i++) {
+		if ((slots_[i].w & S_STATE) != S_FREE)
+			return true;
+	}
+	return false;
+}
+
+// The highest xid such that every call up to it is done, which tells
+// the server which replies it may forget. Moves acked_ past finished
+// calls and skipped xids.
+int
+rpcc::acked_xid()
+{
+	unsigned int l = acked_;
+	while (1) {
+		callslot &s = slot(l);
+		uint64_t w = s.w;
+		unsigned int st = w & S_STATE;
+		if ((int) (slot_xid(w) - l) < 0)
+			break;  // not handed out yet
+		if (st != S_FREE && st != S_DONE &&
+				(s.cur == l || (st == S_LOCKED && slot_xid(w) == l)))
+			break;  // still outstanding, or being set up
+		if (s.w != w)
+			continue;
+		if (acked_.compare_exchange_weak(l, l + 1))
+			l++;
+	}
+	return l - 1;
+}
+
 int
 rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		TO to)
@@ -192,26 +557,31 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 
 	caller ca(0, &rep);
         int xid_rep;
-	{
-		ScopedLock ml(&m_);
-
-		if((proc != rpc_const::bind && !bind_done_) ||
-				(proc == rpc_const::bind && bind_done_)){
-			jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
-			return rpc_const::bind_failure;
-		}
 
-		if(destroy_wait_){
-		  return rpc_const::cancel_failure;
-		}
+	if((proc != rpc_const::bind && !bind_done_) ||
+			(proc == rpc_const::bind && bind_done_)){
+		jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
+		return rpc_const::bind_failure;
+	}
 
-		ca.xid = xid_++;
-		calls_[ca.xid] = &ca;
+	if(destroy_wait_){
+	  return rpc_const::cancel_failure;
+	}
 
-		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_,
-                             xid_rep_window_.front());
-		req.pack_req_header(h);
-                xid_rep = xid_rep_window_.front();
+	ca.proc = proc;
+	ca.start = rpc_now_us();
+	ca.raw_out = req.size();
+	int flags = reqflags(req, to.to);
+	callslot &s = *new_call(&ca);
+	xid_rep = acked_xid();
+	req_header h(ca.xid, proc | flags, clt_nonce_, srv_nonce_, xid_rep);
+	req.pack_req_header(h);
+	set_state(s, S_PENDING);
+
+	if(destroy_wait_){
+		// cancel() may have scanned the slots before we got here
+		end_call(s);
+		return rpc_const::cancel_failure;
 	}
 
 	TO curr_to;
@@ -219,28 +589,23 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 
 	clock_gettime(CLOCK_REALTIME, &now);
 	add_timespec(now, to.to, &finaldeadline); 
-	curr_to.to = to_min.to;
+	curr_to.to = rto();
 
 	bool transmit = true;
 	connection *ch = NULL;
+	int sends = 0;
 
 	while (1){
 		if(transmit){
 			get_refconn(&ch);
 			if(ch){
-			        if(reachable_) {
-                                        request forgot;
-                                        {
-                                                ScopedLock ml(&m_);
-                                                if (dup_req_.isvalid() && xid_rep_done_ > dup_req_.xid) {
-                                                        forgot = dup_req_;
-                                                        dup_req_.clear();
-                                                }
-                                        }
-                                        if (forgot.isvalid()) 
-                                                ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
-                                        ch->send(req.cstr(), req.size());
-                                }
+				sends++;
+			        if(reachable_){
+					// large arguments are still only referenced by req
+					std::vector<struct iovec> iov;
+					req.iov(iov);
+					send_req(ch, &iov[0], iov.size());
+				}
 				else jsl_log(JSL_DBG_1, "not reachable\n");
 				jsl_log(JSL_DBG_2, 
 						"rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n", 
@@ -259,42 +624,29 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 			finaldeadline.tv_sec = 0;
 		}
 
-		{
-			ScopedLock cal(&ca.m);
-			while (!ca.done){
-			        jsl_log(JSL_DBG_2, "rpcc:call1: wait\n");
-				if(pthread_cond_timedwait(&ca.c, &ca.m,
-                                                 &nextdeadline) == ETIMEDOUT){
-				  	jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
-					break;
-				}
-			}
-			if(ca.done){
-			        jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
-				break;
-			}
+		if(wait_done(s, nextdeadline)){
+		        jsl_log(JSL_DBG_2, "rpcc::call1: reply received\n");
+			break;
 		}
+		jsl_log(JSL_DBG_2, "rpcc::call1: timeout\n");
 
 		if(retrans_ && (!ch || ch->isdead())){
 			// since connection is dead, retransmit
                         // on the new connection 
 			transmit = true; 
 		}
-		curr_to.to <<= 1;
+		if(curr_to.to < RPCC_BACKOFF_MAX)
+			curr_to.to <<= 1;
 	}
 
-	{ 
-                // no locking of ca.m since only this thread changes ca.xid 
-		ScopedLock ml(&m_);
-		calls_.erase(ca.xid);
-		// may need to update the xid again here, in case the
-		// packet times out before it's even sent by the channel.
-		// I don't think there's any harm in maybe doing it twice
-		update_xid_rep(ca.xid);
-
-		if(destroy_wait_){
-		  VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
-		}
+	// a reply may have claimed the call just as we timed out
+	end_call(s);
+
+	ca.wire_in = ca.done ? rep.size() : 0;
+	if(ca.done && ca.zrep && !rep.decompress()){
+		jsl_log(JSL_DBG_1, "rpcc::call1 %u bad compressed reply xid %u\n",
+				clt_nonce_, ca.xid);
+		ca.intret = rpc_const::unmarshal_reply_failure;
 	}
 
         if (ca.done && lossytest_)
@@ -308,31 +660,473 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                         xid_rep_done_ = xid_rep;
         }
 
-	ScopedLock cal(&ca.m);
-
 	jsl_log(JSL_DBG_2, 
-			"rpcc::call1 %u call done for req proc %x xid %u %s:%d done? %d ret %d \n", 
-			clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-			ntohs(dst_.sin_port), ca.done, ca.intret);
+			"rpcc::call1 %u call done for req proc %x xid %u %s done? %d ret %d \n", 
+			clt_nonce_, proc, ca.xid, dst_.str().c_str(), ca.done, ca.intret);
 
 	if(ch)
 		ch->decref();
 
+	int ret = ca.done? ca.intret : rpc_const::timeout_failure;
+	rpc_sample smp;
+	smp.proc = proc;
+	smp.ret = proc == rpc_const::bind && ret > 0 ? 0 : ret;
+	smp.retrans = sends > 1 ? sends - 1 : 0;
+	smp.bytes_out = req.size();
+	smp.raw_out = ca.raw_out;
+	smp.bytes_in = ca.wire_in;
+	smp.raw_in = ca.done ? rep.size() : 0;
+	smp.e2e_us = rpc_now_us() - ca.start;
+	stats_->record(smp);
+	// a reply to a request sent more than once may answer any of them
+	if(ca.done && sends == 1)
+		rtt_sample(smp.e2e_us);
+
 	// destruction of req automatically frees its buffer
 /*	if (!ca.done) {
 		printf("timeout\n");
 	}*/
-	return (ca.done? ca.intret : rpc_const::timeout_failure);
+	return ret;
+}
+
+void
+rpcc::rtt_sample(int64_t us)
+{
+	int r = us > 0 ? (us < INT_MAX / 8 ? us : INT_MAX / 8) : 1;
+	int srtt = srtt_, var = rttvar_;
+	if(srtt == 0){
+		srtt = r;
+		var = r / 2;
+	} else {
+		var = (3 * (int64_t) var + abs(srtt - r)) / 4;
+		srtt = (7 * (int64_t) srtt + r) / 8;
+	}
+	rttvar_ = var;
+	srtt_ = srtt > 0 ? srtt : 1;
+}
+
+int
+rpcc::rto()
+{
+	int srtt = srtt_, var = rttvar_;
+	if(srtt == 0)
+		return to_min.to;
+	int64_t to = ((int64_t) srtt + 4 * (int64_t) var + 999) / 1000;
+	if(to < RPCC_RTO_MIN)
+		to = RPCC_RTO_MIN;
+	if(to > RPCC_RTO_MAX)
+		to = RPCC_RTO_MAX;
+	return to;
+}
+
+// what stats_json() adds for this rpcc
+std::string
+rpcc::rtt_json()
+{
+	char buf[128];
+	snprintf(buf, sizeof(buf), "\"srtt_us\": %d, \"rttvar_us\": %d, \"rto_ms\": %d",
+			srtt_.load(), rttvar_.load(), rto());
+	return buf;
+}
+
+// The flags for a request header: compress req if it is big enough and
+// the server takes compression, and then let the reply be compressed
+// too. Then tell a server that takes deadlines how long we are going
+// to wait, so that it need not run the call once we have given up.
+// Retransmissions carry the same budget, which only errs towards
+// running a call late.
+int
+rpcc::reqflags(marshall &req, int budget_ms)
+{
+	int flags = 0;
+	int min = z_min_;
+	if(min > 0 && z_ok_){
+		flags |= RPC_PROC_ZOK;
+		if(req.size() - RPC_HEADER_SZ >= min && req.compress())
+			flags |= RPC_PROC_Z;
+	}
+	if(dl_ok_){
+		req << (unsigned int) budget_ms;
+		flags |= RPC_PROC_DL;
+	}
+	return flags;
+}
+
+// in lossy mode, first resend an old request whose reply the server
+// may already have forgotten, to exercise its at-most-once logic.
+void
+rpcc::send_req(connection *ch, const char *buf, int sz)
+{
+	struct iovec v;
+	v.iov_base = (char *)buf;
+	v.iov_len = sz;
+	send_req(ch, &v, 1);
+}
+
+void
+rpcc::send_req(connection *ch, const struct iovec *iov, int iovcnt)
+{
+	request forgot;
+	{
+		ScopedLock ml(&m_);
+		if (dup_req_.isvalid() && xid_rep_done_ > dup_req_.xid) {
+			forgot = dup_req_;
+			dup_req_.clear();
+		}
+	}
+	if (forgot.isvalid()) 
+		ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
+	if (!batch_req(iov, iovcnt))
+		ch->send(iov, iovcnt);
+}
+
+void
+rpcc::set_batching(int usecs, int maxbytes)
+{
+	ScopedLock bl(&batch_m_);
+	batch_max_ = maxbytes;
+	batch_usecs_ = usecs;
+}
+
+// Add a request to the batch that goes out batch_usecs_ after its first
+// request, or as soon as the next one would take it past batch_max_.
+// False if batching is off, the server did not say at bind that it knows
+// batches, or the request is too big to share a pdu; the caller sends it
+// alone.
+bool
+rpcc::batch_req(const struct iovec *iov, int iovcnt)
+{
+	if (batch_usecs_ <= 0 || !batch_ok_)
+		return false;
+	int n = 0;
+	for (int i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len;
+
+	marshall *full = NULL;
+	{
+		ScopedLock bl(&batch_m_);
+		if (n + RPC_HEADER_SZ + (int) sizeof(unsigned int) > batch_max_)
+			return false;
+		if (batch_ && batch_->size() + n + (int) sizeof(unsigned int) > batch_max_) {
+			full = batch_;
+			batch_ = NULL;
+		}
+		if (!batch_) {
+			batch_ = new marshall;
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			int64_t due = ts_ns(now) + (int64_t) batch_usecs_ * 1000;
+			batch_due_.tv_sec = due / 1000000000;
+			batch_due_.tv_nsec = due % 1000000000;
+			if (!batch_started_) {
+				batch_started_ = true;
+				batch_th_ = method_thread(this, false, &rpcc::batch_loop);
+			}
+			VERIFY(pthread_cond_signal(&batch_c_) == 0);
+		}
+		*batch_ << (unsigned int) n;
+		for (int i = 0; i < iovcnt; i++)
+			batch_->rawbytes((const char *) iov[i].iov_base, iov[i].iov_len);
+	}
+	if (full)
+		send_batch(full);
+	return true;
+}
+
+// Send the requests in b as one pdu, for rpcs::dispatch() to take apart.
+void
+rpcc::send_batch(marshall *b)
+{
+	req_header h(0, rpc_const::batch, clt_nonce_, srv_nonce_, acked_xid());
+	b->pack_req_header(h);
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if (ch) {
+		if (reachable_)
+			ch->send(b->cstr(), b->size());
+		ch->decref();
+	}
+	delete b;
 }
 
+// Per-rpcc thread that sends each batch when its time is up.
 void
-rpcc::get_refconn(connection **ch)
+rpcc::batch_loop()
+{
+	VERIFY(pthread_mutex_lock(&batch_m_) == 0);
+	while (!batch_stop_) {
+		if (!batch_) {
+			VERIFY(pthread_cond_wait(&batch_c_, &batch_m_) == 0);
+			continue;
+		}
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (cmp_timespec(now, batch_due_) < 0) {
+			pthread_cond_timedwait(&batch_c_, &batch_m_, &batch_due_);
+			continue;
+		}
+		marshall *b = batch_;
+		batch_ = NULL;
+		VERIFY(pthread_mutex_unlock(&batch_m_) == 0);
+		send_batch(b);
+		VERIFY(pthread_mutex_lock(&batch_m_) == 0);
+	}
+	VERIFY(pthread_mutex_unlock(&batch_m_) == 0);
+}
+
+int
+rpcc::call1_async(unsigned int proc, marshall &req, callback cb, TO to)
+{
+	if((proc != rpc_const::bind && !bind_done_) ||
+			(proc == rpc_const::bind && bind_done_)){
+		jsl_log(JSL_DBG_1, "rpcc::call1_async rpcc has not been bound to dst or binding twice\n");
+		return rpc_const::bind_failure;
+	}
+
+	if(destroy_wait_){
+		return rpc_const::cancel_failure;
+	}
+
+	caller *ca = new caller(0, NULL);
+	ca->cb = cb;
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	add_timespec(now, to.to, &ca->finaldeadline);
+	ca->curr_to = rto();
+	add_timespec(now, ca->curr_to, &ca->nextdeadline);
+	if(cmp_timespec(ca->nextdeadline, ca->finaldeadline) > 0)
+		ca->nextdeadline = ca->finaldeadline;
+	int64_t due = ts_ns(ca->nextdeadline);
+
+	ca->proc = proc;
+	ca->start = rpc_now_us();
+	ca->raw_out = req.size();
+	int flags = reqflags(req, to.to);
+	ca->wire_out = req.size();
+	callslot &s = *new_call(ca);
+	unsigned int xid = ca->xid;
+	ca->xid_rep = acked_xid();
+	req_header h(xid, proc | flags, clt_nonce_, srv_nonce_, ca->xid_rep);
+	req.pack_req_header(h);
+	ca->req.assign(req.cstr(), req.size());
+	s.due = due;
+	// from here on the reply may complete and free ca at any time
+	set_state(s, S_PENDING | S_ASYNC);
+
+	if(destroy_wait_){
+		// unless cancel_async() got to it first
+		if(claim(s, xid, S_CLAIMED)){
+			free_slot(s);
+			delete ca;
+			return rpc_const::cancel_failure;
+		}
+		return 0;
+	}
+	timer_wake(due);
+
+	connection *ch = NULL;
+	unsigned int gen = 0;
+	get_refconn(&ch, &gen);
+	if(ch){
+		if(reachable_)
+			send_req(ch, req.cstr(), req.size());
+		else
+			jsl_log(JSL_DBG_1, "not reachable\n");
+		jsl_log(JSL_DBG_2, 
+				"rpcc::call1_async %u just sent req proc %x xid %u\n", 
+				clt_nonce_, proc, xid); 
+		ch->decref();
+
+		if(claim(s, xid, S_LOCKED)){
+			ca->sent = true;
+			ca->gen = gen;
+			set_state(s, S_PENDING);
+		}
+	}
+	return 0;
+}
+
+// Run an asynchronous caller's callback and free it. The caller must
+// already have been taken out of its slot and counted in async_running_.
+// The callback may issue further calls.
+void
+rpcc::finish_async(caller *ca, int ret, unmarshall &rep)
+{
+	jsl_log(JSL_DBG_2, "rpcc::finish_async %u xid %u ret %d\n",
+			clt_nonce_, ca->xid, ret);
+	rpc_sample smp;
+	smp.proc = ca->proc;
+	smp.ret = ret;
+	smp.retrans = ca->retrans;
+	smp.bytes_out = ca->wire_out;
+	smp.raw_out = ca->raw_out;
+	smp.bytes_in = ca->wire_in;
+	smp.raw_in = ca->wire_in ? rep.size() : 0;
+	smp.e2e_us = rpc_now_us() - ca->start;
+	stats_->record(smp);
+	if(ca->wire_in && ca->retrans == 0)
+		rtt_sample(smp.e2e_us);
+	ca->cb(ret, rep);
+	delete ca;
+
+	if(--async_running_ == 0 && destroy_wait_){
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_broadcast(&destroy_wait_c_) == 0);
+	}
+}
+
+// Resend an asynchronous request whose connection died, on a new one.
+void
+rpcc::retransmit(unsigned int xid)
+{
+	connection *ch = NULL;
+	unsigned int gen = 0;
+	get_refconn(&ch, &gen);
+	if(!ch)
+		return;
+
+	std::string buf;
+	callslot &s = slot(xid);
+	if(claim(s, xid, S_LOCKED)){
+		buf = s.ca->req;
+		if(s.ca->sent)
+			s.ca->retrans++;
+		s.ca->sent = true;
+		s.ca->gen = gen;
+		set_state(s, S_PENDING);
+	}
+	if(buf.size() && reachable_){
+		jsl_log(JSL_DBG_2, "rpcc::retransmit %u xid %u\n", clt_nonce_, xid);
+		send_req(ch, buf.c_str(), buf.size());
+	}
+	ch->decref();
+}
+
+// Make sure timer_loop() wakes by due for a call just made pending.
+// Either the timer sees the call when it scans the slots, or it has
+// published the timer_next_ it is going to sleep until by the time we
+// look.
+void
+rpcc::timer_wake(int64_t due)
+{
+	if(!timer_started_){
+		ScopedLock ml(&m_);
+		if(!timer_started_){
+			// it scans the slots before it first sleeps
+			timer_th_ = method_thread(this, false, &rpcc::timer_loop);
+			timer_started_ = true;
+			return;
+		}
+	}
+	if(due < timer_next_){
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_signal(&timer_c_) == 0);
+	}
+}
+
+// earliest nextdeadline of a pending asynchronous call
+int64_t
+rpcc::next_due()
+{
+	int64_t next = INT64_MAX;
+	for(int i = 0; i < RPCC_SLOTS; i++){
+		callslot &s = slots_[i];
+		if((s.w & (S_STATE|S_ASYNC)) == (S_PENDING|S_ASYNC) && s.due < next)
+			next = s.due;
+	}
+	return next;
+}
+
+// Per-rpcc thread that does for asynchronous calls what call1() does for
+// its own caller: back off, retransmit when the connection has died, and
+// fail the call once its deadline passes.
+void
+rpcc::timer_loop()
+{
+	VERIFY(pthread_mutex_lock(&m_) == 0);
+	while(!timer_stop_){
+		unsigned int gen;
+		bool dead;
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		{
+			ScopedLock cl(&chan_m_);
+			gen = chan_gen_;
+			dead = !chan_ || chan_->isdead();
+		}
+
+		struct timespec now, next;
+		clock_gettime(CLOCK_REALTIME, &now);
+		add_timespec(now, to_max.to, &next);
+
+		std::list<caller *> expired;
+		std::list<unsigned int> resend;
+		for(int i = 0; i < RPCC_SLOTS; i++){
+			callslot &s = slots_[i];
+			if((s.w & (S_STATE|S_ASYNC)) != (S_PENDING|S_ASYNC) ||
+					s.due > ts_ns(now))
+				continue;
+			unsigned int xid = s.cur;
+			if(!claim(s, xid, S_LOCKED))
+				continue;
+			caller *ca = s.ca;
+			if(cmp_timespec(ca->finaldeadline, now) <= 0){
+				expired.push_back(ca);
+				async_running_++;
+				free_slot(s);
+				continue;
+			}
+			if(retrans_ && (!ca->sent || ca->gen != gen || dead))
+				resend.push_back(xid);
+			if(ca->curr_to < RPCC_BACKOFF_MAX)
+				ca->curr_to <<= 1;
+			add_timespec(now, ca->curr_to, &ca->nextdeadline);
+			if(cmp_timespec(ca->nextdeadline, ca->finaldeadline) > 0)
+				ca->nextdeadline = ca->finaldeadline;
+			s.due = ts_ns(ca->nextdeadline);
+			set_state(s, S_PENDING);
+		}
+
+		if(expired.size() || resend.size()){
+			for(std::list<caller *>::iterator i = expired.begin();
+					i != expired.end(); i++){
+				unmarshall none;
+				finish_async(*i, rpc_const::timeout_failure, none);
+			}
+			for(std::list<unsigned int>::iterator i = resend.begin();
+					i != resend.end(); i++)
+				retransmit(*i);
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+			continue;
+		}
+
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		int64_t due = next_due();
+		if(due < ts_ns(next)){
+			next.tv_sec = due / 1000000000;
+			next.tv_nsec = due % 1000000000;
+		}
+		timer_next_ = ts_ns(next);
+		// a call that went pending after that scan sees the new
+		// timer_next_; one that did not is found by this one
+		if(next_due() < timer_next_)
+			continue;
+		pthread_cond_timedwait(&timer_c_, &m_, &next);
+	}
+	VERIFY(pthread_mutex_unlock(&m_) == 0);
+}
+
+void
+rpcc::get_refconn(connection **ch, unsigned int *gen)
 {
 	ScopedLock ml(&chan_m_);
 	if(!chan_ || chan_->isdead()){
 		if(chan_)
 			chan_->decref();
 		chan_ = connect_to_dst(dst_, this, lossytest_);
+		if(chan_ && ck_ok_)
+			chan_->set_summed(true);
+		chan_gen_++;
 	}
 	if(ch && chan_){
 		if(*ch){
@@ -341,9 +1135,11 @@ rpcc::get_refconn(connection **ch)
 		*ch = chan_;
 		(*ch)->incref();
 	}
+	if(gen)
+		*gen = chan_gen_;
 }
 
-// PollMgr's thread is being used to 
+// a PollMgr reactor thread is being used to 
 // make this upcall from connection object to rpcc. 
 // this funtion must not block.
 //
@@ -360,64 +1156,109 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 		return true;
 	}
 
-	ScopedLock ml(&m_);
+	if(h.xid == 0){
+		// replies to a batch of requests in one pdu, as servers
+		// before rpcs::dispatch() split batches up sent them
+		while(rep.ind() < rep.size()){
+			rpc_bytes sub;
+			rep >> sub;
+			if(!rep.ok()){
+				jsl_log(JSL_DBG_1, "rpcc:got_pdu bad batch reply\n");
+				break;
+			}
+			char *sb = rpcbuf_alloc(sub.size());
+			memcpy(sb, sub.data(), sub.size());
+			unmarshall subrep(sb, sub.size());
+			reply_header sh;
+			subrep.unpack_reply_header(&sh);
+			if(subrep.ok())
+				got_reply(subrep, sh);
+		}
+		return true;
+	}
 
-	update_xid_rep(h.xid);
+	got_reply(rep, h);
+	return true;
+}
 
-	if(calls_.find(h.xid) == calls_.end()){
+// Hand a reply to the call waiting for it, if any.
+void
+rpcc::got_reply(unmarshall &rep, const reply_header &h)
+{
+	callslot &s = slot(h.xid);
+	if(!claim(s, h.xid, S_CLAIMED)){
 		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
-		return true;
+		return;
 	}
-	caller *ca = calls_[h.xid];
+	caller *ca = s.ca;
 
-	ScopedLock cl(&ca->m);
-	if(!ca->done){
+	if(!ca->cb){
+		// a thread is waiting in call1(); ca lives on its stack, and
+		// expands the reply there rather than on this reactor
 		ca->un->take_in(rep);
 		ca->intret = h.ret;
+		ca->zrep = z_ok_ && (h.flags & RPC_REP_Z);
 		if(ca->intret < 0){
 			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
 					h.xid, ca->intret);
 		}
-		ca->done = 1;
-	}
-	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
-	return true;
-}
-
-// assumes thread holds mutex m
-void 
-rpcc::update_xid_rep(unsigned int xid)
-{
-	std::list<unsigned int>::iterator it;
-
-	if(xid <= xid_rep_window_.front()){
+		ca->done = true;
+		post_done(s);
 		return;
 	}
 
-	for (it = xid_rep_window_.begin(); it != xid_rep_window_.end(); it++){
-		if(*it > xid){
-			xid_rep_window_.insert(it, xid);
-			goto compress;
+	async_running_++;
+	free_slot(s);
+	if(lossytest_){
+		ScopedLock ml(&m_);
+		if (!dup_req_.isvalid()) {
+			dup_req_.buf = ca->req;
+			dup_req_.xid = ca->xid;
 		}
+		if (ca->xid_rep > xid_rep_done_)
+			xid_rep_done_ = ca->xid_rep;
 	}
-	xid_rep_window_.push_back(xid);
 
-compress:
-	it = xid_rep_window_.begin();
-	for (it++; it != xid_rep_window_.end(); it++){
-		while (xid_rep_window_.front() + 1 == *it)
-			xid_rep_window_.pop_front();
+	int ret = h.ret;
+	ca->wire_in = rep.size();
+	if(z_ok_ && (h.flags & RPC_REP_Z) && !rep.decompress()){
+		jsl_log(JSL_DBG_1, "rpcc::got_pdu: bad compressed reply xid %d\n",
+				h.xid);
+		ret = rpc_const::unmarshal_reply_failure;
+	}
+	if(ret < 0){
+		jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+				h.xid, ret);
 	}
+	finish_async(ca, ret, rep);
+}
+
+// a tcp address for listening on port p
+static rpcaddr
+port_addr(unsigned int p)
+{
+	sockaddr_in sin;
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(p);
+	return rpcaddr(sin);
 }
 
+rpcs::rpcs(unsigned int p1, int count) : rpcs(port_addr(p1), count)
+{
+}
 
-rpcs::rpcs(unsigned int p1, int count)
-  : port_(p1), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
+rpcs::rpcs(const rpcaddr &a, int count)
+  : port_(a.kind == rpcaddr::TCP ? ntohs(a.in.sin_port) : 0), counting_(count), curr_counts_(count), lossytest_(0), reachable_ (true)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
+	for (int i = 0; i < RW_SHARDS; i++)
+		VERIFY(pthread_mutex_init(&reply_window_[i].m, 0) == 0);
 	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
+	VERIFY(pthread_mutex_init(&paused_m_, 0) == 0);
+	npaused_ = 0;
+	ndeferred_ = 0;
 
 	set_rand_seed();
 	nonce_ = random();
@@ -428,17 +1269,32 @@ rpcs::rpcs(unsigned int p1, int count)
 		lossytest_ = atoi(loss_env);
 	}
 
+	// the rpc library's own procs take no part in admission control
+	max_inflight_ = 0;
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
-	dispatchpool_ = new ThrPool(10,false);
+	reg(rpc_const::stats, this, &rpcs::rpcstat);
+	char *inflight_env = getenv("RPC_MAX_INFLIGHT");
+	if(inflight_env != NULL){
+		max_inflight_ = atoi(inflight_env);
+	}
+	// 10 workers, and up to 40 while handlers block with work queued
+	dispatchpool_ = new ThrPool(10,false,40);
+	stats_ = new rpc_stats("rpcs " + a.str());
+	stats_->set_extra([this]() { return gauges(); });
 
-	listener_ = new tcpsconn(this, port_, lossytest_);
+	listener_ = new tcpsconn(this, a, lossytest_);
 }
 
 rpcs::~rpcs()
 {
+	stats_->set_extra(NULL);
 	// must delete listener before dispatchpool
 	delete listener_;
 	delete dispatchpool_;
+	delete stats_;
+	for (std::list<connection *>::iterator i = paused_.begin();
+			i != paused_.end(); i++)
+		(*i)->decref();
 	free_reply_window();
 }
 
@@ -447,28 +1303,91 @@ rpcs::got_pdu(connection *c, char *b, int sz)
 {
         if(!reachable_){
             jsl_log(JSL_DBG_1, "rpcss::got_pdu: not reachable\n");
+            rpcbuf_free(b);
             return true;
         }
 
 	djob_t *j = new djob_t(c, b, sz);
 	c->incref();
-	bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
-	if(!succ || !reachable_){
+	bool succ = dispatchpool_->addObjJob(this, &rpcs::run_dispatch, j);
+	if(!succ){
+		// overloaded: rather than drop the request and have the
+		// client retransmit it into the same full queue, leave it
+		// with the connection, which stops reading until resumed
 		c->decref();
 		delete j;
+		pause(c);
 	}
 	return succ; 
 }
 
+void
+rpcs::pause(connection *c)
+{
+	{
+		ScopedLock pl(&paused_m_);
+		for (std::list<connection *>::iterator i = paused_.begin();
+				i != paused_.end(); i++) {
+			if (*i == c)
+				return;
+		}
+		c->incref();
+		paused_.push_back(c);
+		npaused_++;
+	}
+	// the pool may have drained since addObjJob() failed, with no
+	// finishing request left to see c
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (!dispatchpool_->full())
+		resume_paused();
+}
+
+void
+rpcs::resume_paused()
+{
+	connection *c;
+	{
+		ScopedLock pl(&paused_m_);
+		if (paused_.empty())
+			return;
+		c = paused_.front();
+		paused_.pop_front();
+		npaused_--;
+	}
+	jsl_log(JSL_DBG_2, "rpcs::resume_paused: resuming connection %d\n",
+			c->channo());
+	c->resume();
+	c->decref();
+}
+
+void
+rpcs::run_dispatch(djob_t *j)
+{
+	dispatch(j);
+	// this request's slot in the pool is free
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (npaused_ > 0)
+		resume_paused();
+}
+
 void
 rpcs::reg1(unsigned int proc, handler *h)
 {
 	ScopedLock pl(&procs_m_);
 	VERIFY(procs_.count(proc) == 0);
+	h->max_inflight = max_inflight_;
 	procs_[proc] = h;
 	VERIFY(procs_.count(proc) >= 1);
 }
 
+void
+rpcs::set_max_inflight(unsigned int proc, int n)
+{
+	ScopedLock pl(&procs_m_);
+	VERIFY(procs_.count(proc) == 1);
+	procs_[proc]->max_inflight = n;
+}
+
 void
 rpcs::updatestat(unsigned int proc)
 {
@@ -483,31 +1402,102 @@ rpcs::updatestat(unsigned int proc)
 		}
 		printf("\n");
 
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
-		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-			totalrep += clt->second.size();
-			if(clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		// how much smaller requests and replies went out, for the
+		// procs that clients compressed
+		std::map<int, rpc_stat> procs;
+		std::map<unsigned int, rpc_stat> clients;
+		stats_->get(&procs, &clients);
+		bool any = false;
+		std::map<int, rpc_stat>::iterator z;
+		for (z = procs.begin(); z != procs.end(); z++){
+			if(z->second.raw_in == z->second.bytes_in &&
+					z->second.raw_out == z->second.bytes_out)
+				continue;
+			if(!any)
+				printf("RPC COMPRESSION: ");
+			any = true;
+			printf("%x:%.2f/%.2f ", z->first,
+					(double) z->second.raw_in / z->second.bytes_in,
+					(double) z->second.raw_out / z->second.bytes_out);
 		}
+		if(any)
+			printf("\n");
+
+		unsigned int nclients, totalrep, maxrep;
+		window_sizes(&nclients, &totalrep, &maxrep);
 		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n", 
-                        (int) reply_window_.size(), totalrep, maxrep);
+                        nclients, totalrep, maxrep);
+
+		rpcbuf_stats bs;
+		rpcbuf_get_stats(&bs);
+		uint64_t hits = bs.thread_hits + bs.pool_hits;
+		jsl_log(JSL_DBG_1, "BUFFER POOL: allocs %llu hit %.1f%% (thread %llu pool %llu) "
+				"miss %llu large %llu released %llu\n",
+				(unsigned long long) bs.allocs,
+				bs.allocs ? 100.0 * hits / bs.allocs : 0.0,
+				(unsigned long long) bs.thread_hits,
+				(unsigned long long) bs.pool_hits,
+				(unsigned long long) bs.misses, (unsigned long long) bs.large,
+				(unsigned long long) bs.released);
 		curr_counts_ = counting_;
 	}
 }
 
+void
+rpcs::window_sizes(unsigned int *nclients, unsigned int *total,
+		unsigned int *max)
+{
+	*nclients = *total = *max = 0;
+	for (int i = 0; i < RW_SHARDS; i++) {
+		ScopedLock rwl(&reply_window_[i].m);
+		std::unordered_map<unsigned int, client_window *>::iterator clt;
+		for (clt = reply_window_[i].clients.begin();
+				clt != reply_window_[i].clients.end(); clt++) {
+			(*nclients)++;
+			*total += clt->second->n;
+			if ((unsigned int) clt->second->n > *max)
+				*max = clt->second->n;
+		}
+	}
+}
+
+// server-wide state for stats_json(), as JSON members
+std::string
+rpcs::gauges()
+{
+	unsigned int nclients, totalrep, maxrep;
+	window_sizes(&nclients, &totalrep, &maxrep);
+	rpcbuf_stats bs;
+	rpcbuf_get_stats(&bs);
+	char buf[512];
+	snprintf(buf, sizeof(buf), "\"nonce\": %u, \"clients\": %u, "
+			"\"replies\": %u, \"max_replies\": %u, \"threads\": %d, "
+			"\"paused\": %d, \"deferred\": %d, \"bad_checksums\": %llu, "
+			"\"bufpool\": {\"allocs\": %llu, "
+			"\"thread_hits\": %llu, \"pool_hits\": %llu, \"misses\": %llu, "
+			"\"large\": %llu, \"released\": %llu}",
+			nonce_, nclients, totalrep, maxrep, dispatchpool_->nthreads(),
+			npaused_.load(), ndeferred_.load(),
+			(unsigned long long) connection_bad_checksums(),
+			(unsigned long long) bs.allocs,
+			(unsigned long long) bs.thread_hits,
+			(unsigned long long) bs.pool_hits,
+			(unsigned long long) bs.misses, (unsigned long long) bs.large,
+			(unsigned long long) bs.released);
+	return buf;
+}
+
 void
 rpcs::dispatch(djob_t *j)
 {
 	connection *c = j->conn;
 	unmarshall req(j->buf, j->sz);
+	int64_t arrived = j->arrived;
+	bool inbatch = j->inbatch;
 	delete j;
 
 	req_header h;
 	req.unpack_req_header(&h);
-	int proc = h.proc;
 
 	if(!req.ok()){
 		jsl_log(JSL_DBG_1, "rpcs:dispatch unmarshall header failed!!!\n");
@@ -515,6 +1505,105 @@ rpcs::dispatch(djob_t *j)
 		return;
 	}
 
+	if(h.proc != (int) rpc_const::batch){
+		dispatch1(c, req, h, arrived);
+		c->decref();
+		return;
+	}
+	if(inbatch){
+		jsl_log(JSL_DBG_1, "rpcs:dispatch batch inside a batch\n");
+		c->decref();
+		return;
+	}
+
+	// a batch from rpcc::send_batch(): each request becomes a dispatch
+	// job of its own, so one that is slow, or waits on another from the
+	// same batch, holds up no other. each answers on its own too; the
+	// connection's writev still sends replies that finish together as
+	// one. the last request, or any the pool has no room for, runs here.
+	jsl_log(JSL_DBG_2, "rpcs::dispatch: batch of %d bytes from clt %u\n",
+			req.size(), h.clt_nonce);
+	djob_t *last = NULL;
+	while(req.ind() < req.size()){
+		rpc_bytes sub;
+		req >> sub;
+		if(!req.ok()){
+			jsl_log(JSL_DBG_1, "rpcs:dispatch bad batch\n");
+			break;
+		}
+		if(last && !dispatchpool_->addObjJob(this, &rpcs::run_dispatch, last))
+			dispatch(last);
+		char *sb = rpcbuf_alloc(sub.size());
+		memcpy(sb, sub.data(), sub.size());
+		last = new djob_t(c, sb, sub.size());
+		last->arrived = arrived;
+		last->inbatch = true;
+		c->incref();
+	}
+	c->decref();
+	if(last)
+		dispatch(last);
+}
+
+// Send a new reply to the client, on its latest connection if c has
+// died.
+void
+rpcs::send_reply(connection *&c, unsigned int clt_nonce, char *b, int sz)
+{
+	// get the latest connection to the client
+	{
+		ScopedLock rwl(&conss_m_);
+		if(clt_nonce > 0 && c->isdead() && c != conns_[clt_nonce]){
+			c->decref();
+			c = conns_[clt_nonce];
+			c->incref();
+		}
+	}
+
+	if(!c->send(b, sz) && clt_nonce > 0){
+		// c died under us. a retransmission that arrived in
+		// the meantime was dropped as INPROGRESS, but it made
+		// conns_ point at its connection: reply there too.
+		connection *latest = NULL;
+		{
+			ScopedLock rwl(&conss_m_);
+			if(conns_[clt_nonce] != c){
+				latest = conns_[clt_nonce];
+				latest->incref();
+			}
+		}
+		if(latest){
+			latest->send(b, sz);
+			latest->decref();
+		}
+	}
+}
+
+// Run one request and send its reply. c may be replaced by a later
+// connection from the same client; the caller still holds one reference
+// to whichever it is.
+void
+rpcs::dispatch1(connection *&c, unmarshall &req, const req_header &h,
+		int64_t arrived)
+{
+	int proc = h.proc & ~RPC_PROC_FLAGS;
+	rpc_sample smp;
+	smp.proc = proc;
+	smp.clt = h.clt_nonce;
+	smp.bytes_in = smp.raw_in = req.size();
+
+	// the client's deadline, in our time, from how long it said it
+	// would wait when it sent the request
+	unsigned int budget = 0;
+	int64_t deadline = 0;
+	bool badtail = false;
+	if(h.proc & RPC_PROC_DL){
+		if(req.take_tail(&budget))
+			deadline = arrived + (int64_t) budget * 1000;
+		else
+			badtail = true;
+	}
+
 	jsl_log(JSL_DBG_2,
 			"rpcs::dispatch: rpc %u (proc %x, last_rep %u) from clt %u for srv instance %u \n",
 			h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
@@ -530,6 +1619,9 @@ rpcs::dispatch(djob_t *j)
 		rh.ret = rpc_const::oldsrv_failure;
 		rep.pack_reply_header(rh);
 		c->send(rep.cstr(),rep.size());
+		smp.ret = rh.ret;
+		smp.bytes_out = smp.raw_out = rep.size();
+		stats_->record(smp);
 		return;
 	}
 
@@ -540,7 +1632,6 @@ rpcs::dispatch(djob_t *j)
 		if(procs_.count(proc) < 1){
 			fprintf(stderr, "rpcs::dispatch: unknown proc %x.\n",
 				proc);
-			c->decref();
                         VERIFY(0);
 			return;
 		}
@@ -551,20 +1642,11 @@ rpcs::dispatch(djob_t *j)
 	rpcs::rpcstate_t stat;
 	char *b1;
 	int sz1;
+	bool kept;
+	int64_t start;
+	int n, max;
 
 	if(h.clt_nonce){
-		// have i seen this client before?
-		{
-			ScopedLock rwl(&reply_window_m_);
-			// if we don't know about this clt_nonce, create a cleanup object
-			if(reply_window_.find(h.clt_nonce) == reply_window_.end()){
-				VERIFY (reply_window_[h.clt_nonce].size() == 0); // create
-				jsl_log(JSL_DBG_2,
-						"rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n", 
-						h.clt_nonce, h.xid, c->channo(), (int)reply_window_.size());
-			}
-		}
-
 		// save the latest good connection to the client
 		{
 			ScopedLock rwl(&conss_m_);
@@ -591,48 +1673,82 @@ rpcs::dispatch(djob_t *j)
 				updatestat(proc);
 			}
 
-			rh.ret = f->fn(req, rep);
-                        if (rh.ret == rpc_const::unmarshal_args_failure) {
-                                fprintf(stderr, "rpcs::dispatch: failed to"
-                                       " unmarshall the arguments. You are"
-                                       " probably calling RPC 0x%x with wrong"
-                                       " types of arguments.\n", proc);
-                                VERIFY(0);
-                        }
-			VERIFY(rh.ret >= 0);
-
-			rep.pack_reply_header(rh);
-			rep.take_buf(&b1,&sz1);
-
-			jsl_log(JSL_DBG_2,
-					"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
-					sz1, h.xid, proc, rh.ret, h.clt_nonce);
-
-			if(h.clt_nonce > 0){
-				// only record replies for clients that require at-most-once logic
-				add_reply(h.clt_nonce, h.xid, b1, sz1);
-			}
-
-			// get the latest connection to the client
-			{
-				ScopedLock rwl(&conss_m_);
-				if(c->isdead() && c != conns_[h.clt_nonce]){
-					c->decref();
-					c = conns_[h.clt_nonce];
+			start = rpc_now_us();
+			smp.queue_us = start - arrived;
+			n = ++f->inflight;
+			max = f->max_inflight;
+			if(deadline && start >= deadline){
+				// the client has stopped waiting; say so cheaply in
+				// case it is still there
+				jsl_log(JSL_DBG_2, "rpcs::dispatch: rpc %u from clt %u expired %lldus ago\n",
+						h.xid, h.clt_nonce, (long long) (start - deadline));
+				rh.ret = rpc_const::deadline_failure;
+				smp.shed = true;
+			} else if(max > 0 && n > max){
+				jsl_log(JSL_DBG_2, "rpcs::dispatch: rpc %u from clt %u refused, %d of proc %x running\n",
+						h.xid, h.clt_nonce, n - 1, proc);
+				rh.ret = rpc_const::overload_failure;
+				smp.shed = true;
+			} else if(badtail || ((h.proc & RPC_PROC_Z) && !req.decompress())){
+				// damaged on the way, not a mismatched handler
+				jsl_log(JSL_DBG_1, "rpcs::dispatch: damaged rpc %u from clt %u\n",
+						h.xid, h.clt_nonce);
+				rh.ret = rpc_const::unmarshal_args_failure;
+			} else {
+				smp.raw_in = req.size();
+				if(f->deferred){
+					// answered through d, perhaps long after this
+					// returns; see answer()
 					c->incref();
+					ndeferred_++;
+					std::shared_ptr<rpc_deferred> d(
+							new rpc_deferred(this, c, h, f, smp, start));
+					rh.ret = f->fn_deferred(req, d);
+				} else {
+					rh.ret = f->fn(req, rep);
+					smp.handler_us = rpc_now_us() - start;
+				}
+				if (rh.ret == rpc_const::unmarshal_args_failure) {
+					fprintf(stderr, "rpcs::dispatch: failed to"
+					       " unmarshall the arguments. You are"
+					       " probably calling RPC 0x%x with wrong"
+					       " types of arguments.\n", proc);
+					VERIFY(0);
 				}
+				VERIFY(rh.ret >= 0);
+				if(f->deferred)
+					break;
+
+				smp.raw_out = rep.size();
+				if((h.proc & RPC_PROC_ZOK) &&
+						rep.size() - RPC_HEADER_SZ >= RPC_Z_MIN && rep.compress())
+					rh.flags = RPC_REP_Z;
 			}
+			f->inflight--;
 
-			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
+			seal_reply(h, smp, rh, rep, &b1, &sz1);
+
+			// only record replies for clients that require at-most-once
+			// logic, and only while the client may still ask again
+			kept = h.clt_nonce > 0 && add_reply(h.clt_nonce, h.xid, b1, sz1);
+
+			send_reply(c, h.clt_nonce, b1, sz1);
+			if(!kept){
+				// reply is not in the at-most-once window, free it
+				rpcbuf_free(b1);
 			}
 			break;
 		case INPROGRESS: // server is working on this request
+			smp.dup = true;
+			stats_->record(smp);
 			break;
 		case DONE: // duplicate and we still have the response
+			// b1 is a copy: the window may drop the original meanwhile
 			c->send(b1, sz1);
+			rpcbuf_free(b1);
+			smp.dup = true;
+			smp.bytes_out = smp.raw_out = sz1;
+			stats_->record(smp);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
@@ -640,9 +1756,103 @@ rpcs::dispatch(djob_t *j)
 			rh.ret = rpc_const::atmostonce_failure;
 			rep.pack_reply_header(rh);
 			c->send(rep.cstr(),rep.size());
+			smp.dup = true;
+			smp.bytes_out = smp.raw_out = rep.size();
+			stats_->record(smp);
 			break;
 	}
-	c->decref();
+}
+
+// Frame the reply to a new request and count the call, before the
+// client can see the reply. the caller sends *b, then keeps it in the
+// at-most-once window or frees it.
+void
+rpcs::seal_reply(const req_header &h, rpc_sample &smp, reply_header &rh,
+		marshall &rep, char **b, int *sz)
+{
+	int proc = h.proc & ~RPC_PROC_FLAGS;
+	rep.pack_reply_header(rh);
+	rep.take_buf(b, sz);
+	// bind answers with the features it takes, not an error
+	smp.ret = proc == rpc_const::bind && rh.ret > 0 ? 0 : rh.ret;
+	smp.bytes_out = *sz;
+	if(rh.flags == 0)
+		smp.raw_out = *sz;
+	stats_->record(smp);
+
+	jsl_log(JSL_DBG_2,
+			"rpcs::dispatch: sending and saving reply of size %d for rpc %u, proc %x ret %d, clt %u\n",
+			*sz, h.xid, proc, rh.ret, h.clt_nonce);
+}
+
+rpc_deferred::rpc_deferred(rpcs *srv, connection *c, const req_header &h,
+		handler *f, const rpc_sample &smp, int64_t start)
+	: srv_(srv), c_(c), h_(h), f_(f), smp_(smp), start_(start),
+	answered_(false)
+{
+}
+
+rpc_deferred::~rpc_deferred()
+{
+	if(!answered_.exchange(true)){
+		jsl_log(JSL_DBG_1, "rpc_deferred: rpc %u from clt %u dropped unanswered\n",
+				h_.xid, h_.clt_nonce);
+		marshall rep;
+		srv_->answer(this, rpc_const::cancel_failure, rep);
+	}
+}
+
+void
+rpc_deferred::reply(int ret, marshall &rep)
+{
+	if(!answered_.exchange(true))
+		srv_->answer(this, ret, rep);
+}
+
+// A deferred handler has answered, on whatever thread it was on when
+// its nested calls finished: finish the reply as dispatch1() does for
+// the others.
+void
+rpcs::answer(rpc_deferred *d, int ret, marshall &rep)
+{
+	rpc_sample &smp = d->smp_;
+	reply_header rh(d->h_.xid, ret);
+	smp.handler_us = rpc_now_us() - d->start_;
+	smp.raw_out = rep.size();
+	if((d->h_.proc & RPC_PROC_ZOK) &&
+			rep.size() - RPC_HEADER_SZ >= RPC_Z_MIN && rep.compress())
+		rh.flags = RPC_REP_Z;
+	d->f_->inflight--;
+
+	deferred_job *j = new deferred_job;
+	seal_reply(d->h_, smp, rh, rep, &j->b, &j->sz);
+	j->c = d->c_;
+	j->h = d->h_;
+	d->c_ = NULL;
+	ndeferred_--;
+
+	// a reactor thread, where rpcc callbacks run, must not wait on a
+	// full socket, so a dispatch thread sends the reply
+	if(!dispatchpool_->addObjJob(this, &rpcs::send_deferred, j))
+		send_deferred(j);
+}
+
+void
+rpcs::send_deferred(deferred_job *j)
+{
+	// kept before it is sent, as dispatch1() does: a retransmission
+	// that finds the request still INPROGRESS is dropped, and an async
+	// client only asks again once its connection dies
+	bool kept = j->h.clt_nonce > 0 &&
+		add_reply(j->h.clt_nonce, j->h.xid, j->b, j->sz);
+	send_reply(j->c, j->h.clt_nonce, j->b, j->sz);
+	if(!kept)
+		rpcbuf_free(j->b);
+	j->c->decref();
+	delete j;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (npaused_ > 0)
+		resume_paused();
 }
 
 // rpcs::dispatch calls this when an RPC request arrives.
@@ -657,105 +1867,122 @@ rpcs::dispatch(djob_t *j)
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, a copy of the previous reply returned in *b
+//         and *sz, for the caller to free.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
 rpcs::rpcstate_t 
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
                                 unsigned int xid_rep, char **b, int *sz)
 {
-	
-    ScopedLock rwl(&reply_window_m_);
-    // Your lab7 code goes here
-    bool flag = true;
-    std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin();
-	for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-	{
-		reply_t reply = *it;
-		if (reply.xid == xid)
-		{
-			if (reply.cb_present)
-			{
-				*b = reply.buf;
-				*sz = reply.sz;
-				return DONE;
+	rw_shard &sh = shard(clt_nonce);
+	ScopedLock rwl(&sh.m);
+
+	client_window *&wp = sh.clients[clt_nonce];
+	if (!wp) {
+		wp = new client_window();
+		jsl_log(JSL_DBG_2,
+				"rpcs::checkduplicate_and_update: new client %u xid %d, "
+				"clients in shard %d\n", clt_nonce, xid, (int) sh.clients.size());
+	}
+	client_window &w = *wp;
+
+	// the client has every reply up to xid_rep: drop them. each xid is
+	// dropped once, so this is O(1) per request on average.
+	if (xid_rep > w.acked) {
+		if (xid_rep - w.acked >= w.ring.size()) {
+			for (size_t i = 0; i < w.ring.size(); i++) {
+				if (w.ring[i].xid && w.ring[i].xid <= xid_rep) {
+					rpcbuf_free(w.ring[i].buf);
+					w.ring[i] = reply_t();
+					w.n--;
+				}
+			}
+		} else {
+			for (unsigned int x = w.acked + 1; x <= xid_rep; x++) {
+				reply_t &r = w.slot(x);
+				if (r.xid == x) {
+					rpcbuf_free(r.buf);
+					r = reply_t();
+					w.n--;
+				}
 			}
-			return INPROGRESS;
 		}
+		w.acked = xid_rep;
 	}
 
-	if (reply_window_[clt_nonce].size() > 0 && reply_window_[clt_nonce].front().xid > xid)
+	if (xid <= w.acked)
 		return FORGOTTEN;
 
-	reply_t reply(xid);
-    reply.cb_present = false;
-
-    for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-    {
-        if ((*it).xid > xid) 
-        {
-            reply_window_[clt_nonce].insert(it, reply);
-            break;
-        }
-    }
-
-    if (it == reply_window_[clt_nonce].end())
-        reply_window_[clt_nonce].push_back(reply);
-
-    for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-    {
-        if ((*it).xid >= xid_rep)
-        {
-        	flag = false;
-        	reply_window_[clt_nonce].erase(reply_window_[clt_nonce].begin(), it);
-        	break;
-        }
-    }
+	reply_t &r = w.slot(xid);
+	if (r.xid == xid) {
+		if (!r.cb_present)
+			return INPROGRESS;
+		*b = rpcbuf_alloc(r.sz);
+		memcpy(*b, r.buf, r.sz);
+		*sz = r.sz;
+		return DONE;
+	}
 
-    if (flag == true)
-    {
-    	reply_window_[clt_nonce].erase(reply_window_[clt_nonce].begin(), it);
-    }
-    return NEW;
+	if (xid - w.acked > w.ring.size()) {
+		// double the ring until (acked, xid] fits, moving every
+		// reply to its slot in the bigger ring
+		size_t n = w.ring.size();
+		while (xid - w.acked > n)
+			n *= 2;
+		std::vector<reply_t> ring(n);
+		for (size_t i = 0; i < w.ring.size(); i++) {
+			if (w.ring[i].xid)
+				ring[w.ring[i].xid & (n - 1)] = w.ring[i];
+		}
+		w.ring.swap(ring);
+	}
+	reply_t &nr = w.slot(xid);
+	VERIFY(nr.xid == 0);
+	nr.xid = xid;
+	w.n++;
+	return NEW;
 }
 
 // rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
 // and passes the return value in b and sz.
-// add_reply() should remember b and sz.
-// free_reply_window() and checkduplicate_and_update is responsible for 
-// calling free(b).
-void
+// add_reply() remembers b and sz and returns true; free_reply_window()
+// and checkduplicate_and_update are then responsible for calling
+// rpcbuf_free(b). it returns false, leaving b to the caller, if the
+// client has acknowledged xid meanwhile.
+bool
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
 {
-    ScopedLock rwl(&reply_window_m_);
+	rw_shard &sh = shard(clt_nonce);
+	ScopedLock rwl(&sh.m);
 
-    // Your lab7 code goes here
-	for(std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++)
-	{
-		reply_t reply = *it;
-		if(reply.xid == xid)
-		{
-			it->buf = b;
-			it->sz = sz;
-			it->cb_present = true;
-			break;
-		}
-	}
+	std::unordered_map<unsigned int, client_window *>::iterator it =
+		sh.clients.find(clt_nonce);
+	if (it == sh.clients.end())
+		return false;
+	reply_t &r = it->second->slot(xid);
+	if (r.xid != xid)
+		return false;
+	r.buf = b;
+	r.sz = sz;
+	r.cb_present = true;
+	return true;
 }
 
 void
 rpcs::free_reply_window(void)
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
-
-	ScopedLock rwl(&reply_window_m_);
-	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
+	for (int i = 0; i < RW_SHARDS; i++) {
+		ScopedLock rwl(&reply_window_[i].m);
+		std::unordered_map<unsigned int, client_window *>::iterator clt;
+		for (clt = reply_window_[i].clients.begin();
+				clt != reply_window_[i].clients.end(); clt++) {
+			client_window *w = clt->second;
+			for (size_t j = 0; j < w->ring.size(); j++)
+				rpcbuf_free(w->ring[j].buf);
+			delete w;
 		}
-		clt->second.clear();
+		reply_window_[i].clients.clear();
 	}
-	reply_window_.clear();
 }
 
 // rpc handler
@@ -764,6 +1991,14 @@ rpcs::rpcbind(int a, int &r)
 {
 	jsl_log(JSL_DBG_2, "rpcs::rpcbind called return nonce %u\n", nonce_);
 	r = nonce_;
+	// the features asked for that we have; old clients ask for none
+	return a & rpc_const::features;
+}
+
+int
+rpcs::rpcstat(int a, std::string &r)
+{
+	r = stats_->json();
 	return 0;
 }
 
@@ -771,10 +2006,9 @@ void
 marshall::rawbyte(unsigned char x)
 {
 	if(_ind >= _capa){
-		_capa *= 2;
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = rpcbuf_realloc(_buf, _capa * 2);
+		_capa = rpcbuf_capacity(_buf);
 	}
 	_buf[_ind++] = x;
 }
@@ -783,15 +2017,24 @@ void
 marshall::rawbytes(const char *p, int n)
 {
 	if((_ind+n) > _capa){
-		_capa = _capa > n? 2*_capa:(_capa+n);
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = rpcbuf_realloc(_buf, _capa > n? 2*_capa:(_capa+n));
+		_capa = rpcbuf_capacity(_buf);
 	}
 	memcpy(_buf+_ind, p, n);
 	_ind += n;
 }
 
+void
+marshall::reserve(int n)
+{
+	if(_ind + n > _capa){
+		VERIFY (_buf != NULL);
+		_buf = rpcbuf_realloc(_buf, _ind + n);
+		_capa = rpcbuf_capacity(_buf);
+	}
+}
+
 marshall &
 operator<<(marshall &m, bool x)
 {
@@ -848,11 +2091,108 @@ operator<<(marshall &m, int x)
 	return m;
 }
 
+void
+marshall::bytes(const char *p, int n)
+{
+	if(!_refs || n < RPC_SG_MIN || _segs.size() >= RPC_SG_MAX){
+		rawbytes(p, n);
+		return;
+	}
+	segment sg;
+	sg.off = _ind;
+	sg.p = p;
+	sg.n = n;
+	_segs.push_back(sg);
+	_extra += n;
+}
+
+void
+marshall::flatten()
+{
+	if(_segs.empty())
+		return;
+	int total = size();
+	char *nb = rpcbuf_alloc(total);
+	int from = 0, to = 0;
+	for(size_t i = 0; i < _segs.size(); i++){
+		memcpy(nb+to, _buf+from, _segs[i].off-from);
+		to += _segs[i].off-from;
+		from = _segs[i].off;
+		memcpy(nb+to, _segs[i].p, _segs[i].n);
+		to += _segs[i].n;
+	}
+	memcpy(nb+to, _buf+from, _ind-from);
+	rpcbuf_free(_buf);
+	_buf = nb;
+	_ind = total;
+	_capa = rpcbuf_capacity(nb);
+	_segs.clear();
+	_extra = 0;
+}
+
+void
+marshall::iov(std::vector<struct iovec> &v)
+{
+	struct iovec e;
+	int from = 0;
+	v.clear();
+	for(size_t i = 0; i < _segs.size(); i++){
+		if(_segs[i].off > from){
+			e.iov_base = _buf+from;
+			e.iov_len = _segs[i].off-from;
+			v.push_back(e);
+		}
+		from = _segs[i].off;
+		e.iov_base = (void *)_segs[i].p;
+		e.iov_len = _segs[i].n;
+		v.push_back(e);
+	}
+	if(_ind > from){
+		e.iov_base = _buf+from;
+		e.iov_len = _ind-from;
+		v.push_back(e);
+	}
+}
+
+bool
+marshall::compress()
+{
+	flatten();
+	int n = _ind - RPC_HEADER_SZ;
+	// give up as soon as the output is no smaller than the input
+	int cap = n - (int) sizeof(unsigned int) - 1;
+	if(cap <= 0)
+		return false;
+	char *nb = rpcbuf_alloc(RPC_HEADER_SZ + sizeof(unsigned int) + cap);
+	int zn = lz_compress(_buf + RPC_HEADER_SZ, n,
+			nb + RPC_HEADER_SZ + sizeof(unsigned int), cap);
+	if(zn <= 0){
+		rpcbuf_free(nb);
+		return false;
+	}
+	memcpy(nb, _buf, RPC_HEADER_SZ);
+	rpcbuf_free(_buf);
+	_buf = nb;
+	_capa = rpcbuf_capacity(nb);
+	_ind = RPC_HEADER_SZ;
+	*this << (unsigned int) n;
+	_ind += zn;
+	return true;
+}
+
 marshall &
 operator<<(marshall &m, const std::string &s)
 {
 	m << (unsigned int) s.size();
-	m.rawbytes(s.data(), s.size());
+	m.bytes(s.data(), s.size());
+	return m;
+}
+
+marshall &
+operator<<(marshall &m, const rpc_bytes &b)
+{
+	m << (unsigned int) b.size();
+	m.bytes(b.data(), b.size());
 	return m;
 }
 
@@ -886,13 +2226,51 @@ unmarshall::unpack(int *x)
 void
 unmarshall::take_in(unmarshall &another)
 {
-	if(_buf)
-		free(_buf);
+	rpcbuf_free(_buf);
 	another.take_buf(&_buf, &_sz);
 	_ind = RPC_HEADER_SZ;
 	_ok = _sz >= RPC_HEADER_SZ?true:false;
 }
 
+bool
+unmarshall::take_tail(unsigned int *v)
+{
+	if(!ok() || _sz - _ind < (int) sizeof(*v)){
+		_ok = false;
+		return false;
+	}
+	int ind = _ind;
+	_ind = _sz - sizeof(*v);
+	unpack((int *) v);
+	_sz -= sizeof(*v);
+	_ind = ind;
+	return true;
+}
+
+bool
+unmarshall::decompress()
+{
+	_ind = RPC_HEADER_SZ;
+	unsigned int n;
+	*this >> n;
+	if(!ok() || n > RPC_Z_MAX){
+		_ok = false;
+		return false;
+	}
+	char *nb = rpcbuf_alloc(RPC_HEADER_SZ + n);
+	if(lz_decompress(_buf + _ind, _sz - _ind, nb + RPC_HEADER_SZ, n) != (int) n){
+		rpcbuf_free(nb);
+		_ok = false;
+		return false;
+	}
+	memcpy(nb, _buf, RPC_HEADER_SZ);
+	rpcbuf_free(_buf);
+	_buf = nb;
+	_sz = RPC_HEADER_SZ + n;
+	_ind = RPC_HEADER_SZ;
+	return true;
+}
+
 bool
 unmarshall::okdone()
 {
@@ -993,6 +2371,16 @@ operator>>(unmarshall &u, std::string &s)
 	return u;
 }
 
+unmarshall &
+operator>>(unmarshall &u, rpc_bytes &b)
+{
+	unsigned sz;
+	u >> sz;
+	if(u.ok())
+		u.rawbytes(b, sz);
+	return u;
+}
+
 void
 unmarshall::rawbytes(std::string &ss, unsigned int n)
 {
@@ -1006,6 +2394,18 @@ unmarshall::rawbytes(std::string &ss, unsigned int n)
 	}
 }
 
+// no copy: b points into this unmarshall's buffer
+void
+unmarshall::rawbytes(rpc_bytes &b, unsigned int n)
+{
+	if((_ind+n) > (unsigned)_sz){
+		_ok = false;
+	} else {
+		b = rpc_bytes(_buf+_ind, n);
+		_ind += n;
+	}
+}
+
 bool operator<(const sockaddr_in &a, const sockaddr_in &b){
 	return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
 			((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
@@ -1032,6 +2432,22 @@ make_sockaddr(const char *hostandport, struct sockaddr_in *dst){
 
 }
 
+void
+make_rpcaddr(const char *s, rpcaddr *dst)
+{
+	if (!strncmp(s, "unix:", 5)) {
+		dst->kind = rpcaddr::UNIX;
+		dst->path = s + 5;
+	} else if (!strncmp(s, "shm:", 4)) {
+		dst->kind = rpcaddr::SHM;
+		dst->path = s + 4;
+	} else {
+		dst->kind = rpcaddr::TCP;
+		dst->path.clear();
+		make_sockaddr(s, &dst->in);
+	}
+}
+
 void
 make_sockaddr(const char *host, const char *port, struct sockaddr_in *dst){
 
@@ -5,17 +5,41 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <vector>
+#include <string>
+#include <functional>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <tuple>
+#include <type_traits>
 
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "rpcstat.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
 #endif
 
+// rpc_seq<0, 1, ..., N-1> from rpc_gen_seq<N>, for picking apart the
+// argument packs of rpcc::call() and rpcs::reg()
+template<int... Is> struct rpc_seq { };
+template<int N, int... Is> struct rpc_gen_seq : rpc_gen_seq<N - 1, N - 1, Is...> { };
+template<int... Is> struct rpc_gen_seq<0, Is...> : rpc_seq<Is...> { };
+
+// whether the last of As is a T, give or take const and &
+template<class T, class... As> struct rpc_ends_with : std::false_type { };
+template<class T, class A> struct rpc_ends_with<T, A>
+	: std::is_same<T, typename std::decay<A>::type> { };
+template<class T, class A, class... As> struct rpc_ends_with<T, A, As...>
+	: rpc_ends_with<T, As...> { };
+
 class rpc_const {
 	public:
 		static const unsigned int bind = 1;   // handler number reserved for bind
@@ -26,51 +50,168 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+		static const int deadline_failure = -8;  // expired before it ran
+		static const int overload_failure = -9;  // refused by admission control
+		static const unsigned int batch = 2;  // handler number for a batch of requests
+		static const unsigned int stats = 3;  // handler number for rpcs::rpcstat()
+		// features rpcc::bind() asks for and rpcs::rpcbind() answers
+		// with those it has; old peers know none
+		static const int feat_compress = 0x1;  // RPC_PROC_Z and RPC_REP_Z
+		static const int feat_deadline = 0x2;  // RPC_PROC_DL
+		static const int feat_checksum = 0x4;  // RPC_SZ_SUMMED
+		static const int feat_batch = 0x8;  // proc batch
+		static const int features = feat_compress | feat_deadline | feat_checksum |
+			feat_batch;
 };
 
+#define RPCC_SLOTS 1024     // call table per rpcc, power of two
+#define RPC_BATCH_MAX (64 << 10)  // default size cap of a batch pdu
+#define RPCC_RTO_MIN 10     // ms, least first timeout rto() hands out
+#define RPCC_RTO_MAX 60000  // ms, most
+#define RPCC_BACKOFF_MAX 1000  // ms, longest a pending call goes unchecked
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
+// and any thread can have many asynchronous RPCs outstanding.
 class rpcc : public chanmgr {
 
+	public:
+		// completion of an asynchronous call. ret is what call1() would
+		// have returned; rep holds the reply body when ret >= 0.
+		typedef std::function<void(int ret, unmarshall &rep)> callback;
+
 	private:
 
 		//manages per rpc info
 		struct caller {
 			caller(unsigned int xxid, unmarshall *un);
-			~caller();
 
 			unsigned int xid;
 			unmarshall *un;
 			int intret;
 			bool done;
-			pthread_mutex_t m;
-			pthread_cond_t c;
-		};
 
-		void get_refconn(connection **ch);
-		void update_xid_rep(unsigned int xid);
+			// asynchronous callers live on the heap and are driven by
+			// got_pdu() and timer_loop() instead of a waiting thread
+			callback cb;
+			std::string req;  // marshalled request, for retransmission
+			bool sent;        // req went out on connection generation gen
+			unsigned int gen;
+			int curr_to;
+			struct timespec nextdeadline, finaldeadline;
+			int xid_rep;
+			bool zrep;        // the reply body is compressed
+
+			// for stats_
+			int proc;
+			int64_t start;    // us
+			int retrans;
+			int raw_out, wire_out;
+			int wire_in;
+		};
 
+		// outstanding calls sit in a fixed table indexed by xid. a
+		// slot's word holds the highest xid handed to the slot and the
+		// state of the call in it; every change is a compare-and-swap
+		// on that word, so callers, got_pdu() and timer_loop() agree on
+		// who finishes a call without a lock. a thread in call1()
+		// sleeps on seq, a futex word bumped when its call is done.
+		struct callslot {
+			std::atomic<uint64_t> w;     // (xid << 32) | flags | state
+			std::atomic<unsigned int> cur;  // xid of the call in the slot
+			std::atomic<uint32_t> seq;
+			std::atomic<uint32_t> waiting;
+			std::atomic<int64_t> due;    // async: nextdeadline, in ns
+			caller *ca;
+		};
 
-		sockaddr_in dst_;
+		void get_refconn(connection **ch, unsigned int *gen = NULL);
+		void send_req(connection *ch, const char *buf, int sz);
+		void send_req(connection *ch, const struct iovec *iov, int iovcnt);
+		bool batch_req(const struct iovec *iov, int iovcnt);
+		void send_batch(marshall *b);
+		void batch_loop();
+		void got_reply(unmarshall &rep, const reply_header &h);
+		int reqflags(marshall &req, int budget_ms);
+
+		callslot &slot(unsigned int xid) {
+			return slots_[xid & (RPCC_SLOTS - 1)];
+		}
+		callslot *new_call(caller *ca);
+		bool claim(callslot &s, unsigned int xid, unsigned int to);
+		void set_state(callslot &s, unsigned int st);
+		void post_done(callslot &s);
+		bool wait_done(callslot &s, const struct timespec &deadline);
+		bool end_call(callslot &s);
+		void free_slot(callslot &s);
+		bool busy();
+		int acked_xid();
+
+		void timer_loop();
+		void timer_wake(int64_t due);
+		int64_t next_due();
+		void retransmit(unsigned int xid);
+		void finish_async(caller *ca, int ret, unmarshall &rep);
+		void cancel_async();
+
+
+		rpcaddr dst_;
 		unsigned int clt_nonce_;
 		unsigned int srv_nonce_;
-		bool bind_done_;
-		unsigned int xid_;
+		std::atomic<bool> bind_done_;
+		std::atomic<unsigned int> xid_;
 		int lossytest_;
 		bool retrans_;
 		bool reachable_;
 
 		connection *chan_;
+		unsigned int chan_gen_;  // bumped each time chan_ is replaced
 
-		pthread_mutex_t m_; // protect insert/delete to calls[]
+		pthread_mutex_t m_; // timer, cancel and lossy-mode state
 		pthread_mutex_t chan_m_;
 
-		bool destroy_wait_;
+		std::atomic<bool> destroy_wait_;
 		pthread_cond_t destroy_wait_c_;
 
-		std::map<int, caller *> calls_;
-		std::list<unsigned int> xid_rep_window_;
+		// retransmission and timeouts for asynchronous calls
+		pthread_t timer_th_;
+		std::atomic<bool> timer_started_;
+		bool timer_stop_;
+		std::atomic<int64_t> timer_next_;  // when timer_loop() will next wake, ns
+		pthread_cond_t timer_c_;
+		std::atomic<int> async_running_;  // async callbacks claimed but not yet finished
+
+		callslot *slots_;
+		std::atomic<unsigned int> acked_;  // every xid below is done
+
+		// batching of small requests, see set_batching()
+		std::atomic<int> batch_usecs_;
+		int batch_max_;
+		pthread_mutex_t batch_m_;
+		pthread_cond_t batch_c_;
+		pthread_t batch_th_;
+		bool batch_started_;
+		bool batch_stop_;
+		marshall *batch_;  // requests waiting to go out, or NULL
+		struct timespec batch_due_;
+
+		// compression, see set_compression()
+		std::atomic<int> z_min_;
+		bool z_ok_;  // the server said at bind that it takes it
+		bool dl_ok_;  // and that it takes deadlines
+		bool ck_ok_;  // and checksums; under chan_m_
+		bool batch_ok_;  // and batches
+
+		// round trips to dst_, in us, smoothed as TCP does (RFC 6298).
+		// threads update them without a lock, so a racing sample is
+		// lost now and then, which an estimate can afford.
+		std::atomic<int> srtt_;    // 0 until the first sample
+		std::atomic<int> rttvar_;
+		void rtt_sample(int64_t us);
+		std::string rtt_json();
+
+		rpc_stats *stats_;
                 
                 struct request {
                     request() { clear(); }
@@ -84,6 +225,7 @@ class rpcc : public chanmgr {
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
+		rpcc(const rpcaddr &d, bool retrans=true);
 		~rpcc();
 
 		struct TO {
@@ -100,45 +242,85 @@ class rpcc : public chanmgr {
 		void set_reachable(bool r) { reachable_ = r; }
 
 		void cancel();
+
+		// send small requests issued within usecs of each other in
+		// one pdu, up to maxbytes; the server runs and answers each
+		// on its own as usual. only a server that said at bind that
+		// it takes batches gets them; until then, and with an old
+		// server, each request goes out alone. 0 turns batching off.
+		// RPC_BATCH=usecs in the environment turns it on for every
+		// rpcc.
+		void set_batching(int usecs, int maxbytes = RPC_BATCH_MAX);
+
+		// compress request bodies of minbytes or more, and let the
+		// server compress replies of RPC_Z_MIN or more, if it said at
+		// bind that it can. 0 turns compression off.
+		// RPC_COMPRESS=minbytes in the environment turns it on for
+		// every rpcc.
+		void set_compression(int minbytes = RPC_Z_MIN) { z_min_ = minbytes; }
+
+		// how long a call waits before it first looks for a dead
+		// connection to retransmit on, in ms: to_min until a reply has
+		// come, then the round-trip estimate plus four deviations. each
+		// later wait doubles.
+		int rto();
+
+		// the totals so far for calls to proc, or for everything as
+		// JSON; see rpcstat.h
+		rpc_stat get_stat(int proc) { return stats_->get(proc); }
+		std::string stats_json() { return stats_->json(); }
                 
                 int islossy() { return lossytest_ > 0; }
 
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
 
+		// send the request and return without waiting. cb runs exactly
+		// once, on the PollMgr thread when the reply arrives or on an
+		// rpcc thread on timeout or cancel, so it must not block. a
+		// negative return means the call was not issued and cb will
+		// not run.
+		int call1_async(unsigned int proc, marshall &req,
+				callback cb, TO to);
+
 		bool got_pdu(connection *c, char *b, int sz);
 
 
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
 
+		// call(proc, args..., r) or call(proc, args..., r, to):
+		// marshall args, call proc and unmarshall its reply into r.
+		// the request is sized with rpc_size() and allocated once.
+		// the arguments outlive a synchronous call, so call() marshalls
+		// with REF_LARGE and big payloads reach the socket uncopied.
+		template<class... As>
+			int call(unsigned int proc, As &&... as);
+
+		// asynchronous versions of call(). the reply type R must be
+		// given explicitly, e.g. c->call_async<int>(proc, a, cb), and
+		// cb is anything a std::function<void(int, R &)> can hold.
 		template<class R>
-			int call(unsigned int proc, R & r, TO to = to_max); 
-		template<class R, class A1>
-			int call(unsigned int proc, const A1 & a1, R & r, TO to = to_max); 
-		template<class R, class A1, class A2>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, R & r, 
-					TO to = to_max); 
-		template<class R, class A1, class A2, class A3>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, R & r, TO to = to_max);
-		template<class R, class A1, class A2, class A3, class A4, class A5>
-			int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-					const A4 & a4, const A5 & a5, R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5,
-			class A6>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 & a6,
-						R & r, TO to = to_max); 
-		template<class R, class A1, class A2, class A3, class A4, class A5, 
-			class A6, class A7>
-				int call(unsigned int proc, const A1 & a1, const A2 & a2, const A3 & a3, 
-						const A4 & a4, const A5 & a5, const A6 &a6, const A7 &a7,
-						R & r, TO to = to_max); 
+			int call_m_async(unsigned int proc, marshall &req,
+					std::function<void(int, R &)> cb, TO to);
+
+		// call_async<R>(proc, args..., cb) or (proc, args..., cb, to)
+		template<class R, class... As>
+			int call_async(unsigned int proc, As &&... as);
 
+	private:
+		// the arguments at Is of t are marshalled; the reply, or the
+		// callback, comes next and then perhaps a TO
+		template<class... As, int... Is>
+			int call_t(unsigned int proc, std::tuple<As...> t,
+					rpc_seq<Is...>);
+		template<class R, class... As, int... Is>
+			int call_async_t(unsigned int proc, std::tuple<As...> t,
+					rpc_seq<Is...>);
+		template<int N, class T>
+			static TO to_at(T &t, std::true_type) { return std::get<N>(t); }
+		template<int N, class T>
+			static TO to_at(T &, std::false_type) { return to_max; }
 };
 
 template<class R> int 
@@ -158,110 +340,201 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
-template<class R> int
-rpcc::call(unsigned int proc, R & r, TO to) 
-{
-	marshall m;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1> int
-rpcc::call(unsigned int proc, const A1 & a1, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		R & r, TO to) 
+template<class... As> int
+rpcc::call(unsigned int proc, As &&... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	return call_m(proc, m, r, to);
+	return call_t(proc, std::forward_as_tuple(as...),
+			rpc_gen_seq<sizeof...(As) - 1 - rpc_ends_with<TO, As...>::value>());
 }
 
-template<class R, class A1, class A2, class A3> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, R & r, TO to) 
+template<class... As, int... Is> int
+rpcc::call_t(unsigned int proc, std::tuple<As...> t, rpc_seq<Is...>)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	return call_m(proc, m, r, to);
+	rpc_sizer sz = {true, 0};
+	sz(std::get<Is>(t)...);
+	marshall m(marshall::REF_LARGE, sz.n);
+	rpc_marshaller{m}(std::get<Is>(t)...);
+	return call_m(proc, m, std::get<sizeof...(Is)>(t),
+			to_at<sizeof...(Is) + 1>(t,
+				std::integral_constant<bool, rpc_ends_with<TO, As...>::value>()));
 }
 
-template<class R, class A1, class A2, class A3, class A4> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, R & r, TO to) 
-{
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3, class A4, class A5> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, R & r, TO to) 
+template<class R> int
+rpcc::call_m_async(unsigned int proc, marshall &req,
+		std::function<void(int, R &)> cb, TO to)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	return call_m(proc, m, r, to);
+	return call1_async(proc, req, [proc, cb](int intret, unmarshall &u) {
+		R r = R();
+		if (intret >= 0) {
+			u >> r;
+			if(u.okdone() != true) {
+				fprintf(stderr, "rpcc::call_m_async: failed to unmarshall the reply."
+						"You are probably calling RPC 0x%x with wrong return "
+						"type.\n", proc);
+				VERIFY(0);
+			}
+		}
+		cb(intret, r);
+	}, to);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, R & r, TO to) 
+template<class R, class... As> int
+rpcc::call_async(unsigned int proc, As &&... as)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	return call_m(proc, m, r, to);
+	return call_async_t<R>(proc, std::forward_as_tuple(as...),
+			rpc_gen_seq<sizeof...(As) - 1 - rpc_ends_with<TO, As...>::value>());
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-	class A6, class A7> int
-rpcc::call(unsigned int proc, const A1 & a1, const A2 & a2,
-		const A3 & a3, const A4 & a4, const A5 & a5, 
-		const A6 & a6, const A7 & a7,
-		R & r, TO to) 
+// call1_async() keeps a copy of the request, so the arguments outlive
+// all the marshall needs them for and it may reference them too
+template<class R, class... As, int... Is> int
+rpcc::call_async_t(unsigned int proc, std::tuple<As...> t, rpc_seq<Is...>)
 {
-	marshall m;
-	m << a1;
-	m << a2;
-	m << a3;
-	m << a4;
-	m << a5;
-	m << a6;
-	m << a7;
-	return call_m(proc, m, r, to);
+	rpc_sizer sz = {true, 0};
+	sz(std::get<Is>(t)...);
+	marshall m(marshall::REF_LARGE, sz.n);
+	rpc_marshaller{m}(std::get<Is>(t)...);
+	return call_m_async(proc, m,
+			std::function<void(int, R &)>(std::get<sizeof...(Is)>(t)),
+			to_at<sizeof...(Is) + 1>(t,
+				std::integral_constant<bool, rpc_ends_with<TO, As...>::value>()));
 }
 
 bool operator<(const sockaddr_in &a, const sockaddr_in &b);
 
+class rpcs;
+class rpc_deferred;
+
 class handler {
 	public:
-		handler() { }
+		handler() : deferred(false), max_inflight(0), inflight(0) { }
 		virtual ~handler() { }
 		virtual int fn(unmarshall &, marshall &) = 0;
+		// in place of fn() for handlers from rpcs::reg_async(): take up
+		// the request and answer it through d, now or later
+		virtual int fn_deferred(unmarshall &, const std::shared_ptr<rpc_deferred> &d) {
+			VERIFY(0);
+			return 0;
+		}
+
+		bool deferred;
+
+		// admission control, see rpcs::set_max_inflight()
+		std::atomic<int> max_inflight;  // 0 for no limit
+		std::atomic<int> inflight;
+};
+
+// what rpcs::reg() registers: unmarshalls the arguments of meth, all
+// but the last, which is the reply, calls it on sob, and marshalls the
+// reply into a buffer already sized for it
+template<class S, class... As>
+class method_handler : public handler {
+	private:
+		typedef std::tuple<typename std::decay<As>::type...> args;
+		S *sob;
+		int (S::*meth)(As...);
+
+		template<int... Is>
+			int call(unmarshall &u, marshall &ret, rpc_seq<Is...>) {
+				args a;
+				rpc_unmarshaller{u}(std::get<Is>(a)...);
+				if(!u.okdone())
+					return rpc_const::unmarshal_args_failure;
+				auto &r = std::get<sizeof...(Is)>(a);
+				int b = (sob->*meth)(std::get<Is>(a)..., r);
+				ret.reserve(rpc_size_or0(r, false));
+				ret << r;
+				return b;
+			}
+	public:
+		method_handler(S *xsob, int (S::*xmeth)(As...))
+			: sob(xsob), meth(xmeth) { }
+		int fn(unmarshall &args, marshall &ret) {
+			return call(args, ret, rpc_gen_seq<sizeof...(As) - 1>());
+		}
+};
+
+// a request whose handler answers it after returning, see
+// rpcs::reg_async(). it holds the request's connection, and its place
+// in the at-most-once window, until answered. if the last reference
+// goes unanswered the call fails with cancel_failure.
+class rpc_deferred {
+	public:
+		~rpc_deferred();
+		// answer with ret and the reply body in rep, from any thread;
+		// only the first answer counts
+		void reply(int ret, marshall &rep);
+
+	private:
+		friend class rpcs;
+		rpc_deferred(rpcs *srv, connection *c, const req_header &h,
+				handler *f, const rpc_sample &smp, int64_t start);
+
+		rpcs *srv_;
+		connection *c_;  // a reference of our own
+		req_header h_;
+		handler *f_;
+		rpc_sample smp_;
+		int64_t start_;
+		std::atomic<bool> answered_;
+};
+
+// what a deferred handler answers through, reply(ret, r) as a
+// synchronous handler would return ret with r. copies share one
+// request.
+template<class R>
+class rpc_reply {
+	public:
+		rpc_reply() { }
+		explicit rpc_reply(const std::shared_ptr<rpc_deferred> &d) : d_(d) { }
+		void operator()(int ret, const R &r) const {
+			VERIFY(ret >= 0);
+			marshall rep;
+			rep.reserve(rpc_size_or0(r, false));
+			rep << r;
+			d_->reply(ret, rep);
+		}
+
+	private:
+		std::shared_ptr<rpc_deferred> d_;
+};
+
+// what rpcs::reg_async() registers: like method_handler, but the last
+// argument of meth is the rpc_reply it answers through
+template<class S, class... As>
+class deferred_handler : public handler {
+	private:
+		typedef std::tuple<typename std::decay<As>::type...> args;
+		typedef typename std::tuple_element<sizeof...(As) - 1, args>::type reply_t;
+		S *sob;
+		void (S::*meth)(As...);
+
+		template<int... Is>
+			int call(unmarshall &u, const std::shared_ptr<rpc_deferred> &d,
+					rpc_seq<Is...>) {
+				args a;
+				rpc_unmarshaller{u}(std::get<Is>(a)...);
+				if(!u.okdone())
+					return rpc_const::unmarshal_args_failure;
+				std::get<sizeof...(Is)>(a) = reply_t(d);
+				(sob->*meth)(std::get<Is>(a)..., std::get<sizeof...(Is)>(a));
+				return 0;
+			}
+	public:
+		deferred_handler(S *xsob, void (S::*xmeth)(As...))
+			: sob(xsob), meth(xmeth) { deferred = true; }
+		int fn(unmarshall &, marshall &) {
+			VERIFY(0);
+			return 0;
+		}
+		int fn_deferred(unmarshall &args, const std::shared_ptr<rpc_deferred> &d) {
+			return call(args, d, rpc_gen_seq<sizeof...(As) - 1>());
+		}
 };
 
+#define RW_SHARD_BITS 4      // reply window shards
+#define RW_SHARDS (1 << RW_SHARD_BITS)
+#define RW_RING_MIN 16       // initial per-client ring, power of two
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -280,34 +553,58 @@ class rpcs : public chanmgr {
         // has been sent; in that case buf points to a copy of the reply,
         // and sz holds the size of the reply.
 	struct reply_t {
-		reply_t (unsigned int _xid) {
-			xid = _xid;
+		reply_t () {
+			xid = 0;
 			cb_present = false;
 			buf = NULL;
 			sz = 0;
 		}
-		unsigned int xid;
+		unsigned int xid; // 0 for an empty slot; clients start at 1
 		bool cb_present; // whether the reply buffer is valid
 		char *buf;      // the reply buffer
 		int sz;         // the size of reply buffer
 	};
 
+	// one client's replies, in a ring indexed by xid. every xid the
+	// client has not acknowledged lies in (acked, acked + ring.size()],
+	// so each has a slot of its own; the ring doubles when a new xid
+	// would not fit.
+	struct client_window {
+		client_window() : acked(0), n(0), ring(RW_RING_MIN) {}
+		unsigned int acked;  // client has every reply up to here
+		int n;               // slots in use
+		std::vector<reply_t> ring;
+		reply_t &slot(unsigned int xid) { return ring[xid & (ring.size() - 1)]; }
+	};
+
+	// clients are hashed to shards, each with its own lock, so
+	// requests from different clients rarely contend.
+	struct rw_shard {
+		pthread_mutex_t m;
+		std::unordered_map<unsigned int, client_window *> clients;
+	};
+
 	int port_;
 	unsigned int nonce_;
 
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
-        // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	rw_shard reply_window_[RW_SHARDS];
 
+	rw_shard &shard(unsigned int clt_nonce) {
+		return reply_window_[(clt_nonce * 2654435761u) >> (32 - RW_SHARD_BITS)];
+	}
 	void free_reply_window(void);
-	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+	bool add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
 
 	rpcstate_t checkduplicate_and_update(unsigned int clt_nonce, 
 			unsigned int xid, unsigned int rep_xid,
 			char **b, int *sz);
 
 	void updatestat(unsigned int proc);
+	void window_sizes(unsigned int *nclients, unsigned int *total,
+			unsigned int *max);
+	std::string gauges();
 
 	// latest connection to the client
 	std::map<unsigned int, connection *> conns_;
@@ -316,28 +613,58 @@ class rpcs : public chanmgr {
 	const int counting_;
 	int curr_counts_;
 	std::map<int, int> counts_;
+	rpc_stats *stats_;
 
 	int lossytest_; 
 	bool reachable_;
+	int max_inflight_;  // for procs registered from now on
 
 	// map proc # to function
 	std::map<int, handler *> procs_;
 
 	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
 	pthread_mutex_t count_m_;  //protect modification of counts
-	pthread_mutex_t reply_window_m_; // protect reply window et al
 	pthread_mutex_t conss_m_; // protect conns_
 
+	// connections whose got_pdu() found the dispatch pool full; each
+	// finished request resumes one
+	std::list<connection *> paused_;
+	std::atomic<int> npaused_;
+	pthread_mutex_t paused_m_;
+	void pause(connection *c);
+	void resume_paused();
+
+	// answers of deferred handlers, sent by a dispatch thread
+	friend class rpc_deferred;
+	struct deferred_job {
+		connection *c;
+		req_header h;
+		char *b;
+		int sz;
+	};
+	std::atomic<int> ndeferred_;  // taken up and not yet answered
+	void answer(rpc_deferred *d, int ret, marshall &rep);
+	void send_deferred(deferred_job *j);
+
 
 	protected:
 
 	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c),
+			arrived(rpc_now_us()), inbatch(false) {}
 		char *buf;
 		int sz;
 		connection *conn;
+		int64_t arrived;
+		bool inbatch;  // taken out of a batch, which must not nest
 	};
 	void dispatch(djob_t *);
+	void dispatch1(connection *&c, unmarshall &req, const req_header &h,
+			int64_t arrived);
+	void send_reply(connection *&c, unsigned int clt_nonce, char *b, int sz);
+	void seal_reply(const req_header &h, rpc_sample &smp, reply_header &rh,
+			marshall &rep, char **b, int *sz);
+	void run_dispatch(djob_t *);
 
 	// internal handler registration
 	void reg1(unsigned int proc, handler *);
@@ -347,279 +674,58 @@ class rpcs : public chanmgr {
 
 	public:
 	rpcs(unsigned int port, int counts=0);
+	rpcs(const rpcaddr &a, int counts=0);
 	~rpcs();
 
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
+	//RPC handler returning stats_json(); a is unused
+	int rpcstat(int a, std::string &r);
 
-	void set_reachable(bool r) { reachable_ = r; }
-
-	bool got_pdu(connection *c, char *b, int sz);
-
-	// register a handler
-	template<class S, class A1, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, R & r));
-	template<class S, class A1, class A2, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1 a1, const A2, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-		void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-					const A3, const A4, const A5, 
-					R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, R & r));
-	template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-		class A7, class R>
-			void reg(unsigned int proc, S*, int (S::*meth)(const A1, const A2, 
-						const A3, const A4, const A5, 
-						const A6, const A7,
-						R & r));
-};
-
-template<class S, class A1, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				R r;
-				args >> a1;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				R r;
-				args >> a1;
-				args >> a2;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	// run at most n calls to proc at once, and fail the rest fast
+	// with overload_failure so that a slow proc cannot take every
+	// dispatch thread; 0 for no limit. RPC_MAX_INFLIGHT=n in the
+	// environment sets the limit for every proc registered later.
+	void set_max_inflight(unsigned int proc, int n);
 
-template<class S, class A1, class A2, class A3, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	// the totals so far for proc, or for everything as JSON
+	rpc_stat get_stat(int proc) { return stats_->get(proc); }
+	std::string stats_json() { return stats_->json(); }
 
-template<class S, class A1, class A2, class A3, class A4, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, R & r))
-				: sob(xsob), meth(xmeth)  { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
-
-template<class S, class A1, class A2, class A3, class A4, class A5, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	void set_reachable(bool r) { reachable_ = r; }
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6, 
-			R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	bool got_pdu(connection *c, char *b, int sz);
 
-template<class S, class A1, class A2, class A3, class A4, class A5, 
-	class A6, class A7, class R> void
-rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
-			const A3 a3, const A4 a4, 
-			const A5 a5, const A6 a6,
-			const A7 a7, R & r))
-{
-	class h1 : public handler {
-		private:
-			S * sob;
-			int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, 
-					const A5 a5, const A6 a6, const A7 a7, R & r);
-		public:
-			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, 
-						const A4 a4, const A5 a5, const A6 a6,
-						const A7 a7, R & r))
-				: sob(xsob), meth(xmeth) { }
-			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
-				R r;
-				args >> a1;
-				args >> a2;
-				args >> a3;
-				args >> a4;
-				args >> a5;
-				args >> a6;
-				args >> a7;
-				if(!args.okdone())
-					return rpc_const::unmarshal_args_failure;
-				int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-				ret << r;
-				return b;
-			}
-	};
-	reg1(proc, new h1(sob, meth));
-}
+	// register a handler: meth(args..., R &r) unmarshalls its
+	// arguments by their types and returns r in the reply. arguments
+	// may be taken by value or by const reference.
+	template<class S, class... As>
+		void reg(unsigned int proc, S *sob, int (S::*meth)(As...)) {
+			reg1(proc, new method_handler<S, As...>(sob, meth));
+		}
 
+	// register a handler that answers when it is ready rather than as
+	// it returns: meth(args..., rpc_reply<R> reply) returns at once,
+	// say after starting rpcc::call_async()s, and reply(ret, r) from
+	// their callbacks answers the call. the dispatch thread is free
+	// meanwhile, so a few threads can keep many nested calls going.
+	// arguments live only until meth returns, so it copies what its
+	// callbacks need; the rpcs must outlive the answers. an rpcc with
+	// RPCC_SLOTS calls outstanding makes call_async() wait, which
+	// holds the dispatch thread again.
+	template<class S, class... As>
+		void reg_async(unsigned int proc, S *sob, void (S::*meth)(As...)) {
+			reg1(proc, new deferred_handler<S, As...>(sob, meth));
+		}
+};
 
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
 void make_sockaddr(const char *host, const char *port,
 		struct sockaddr_in *dst);
+// "unix:/path" for a unix-domain socket, "shm:/path" for a shared-memory
+// ring set up through one, and otherwise as make_sockaddr(): "host:port"
+// or "port" for tcp. a server given "port" listens on every interface.
+void make_rpcaddr(const char *s, rpcaddr *dst);
 
 int cmp_timespec(const struct timespec &a, const struct timespec &b);
 void add_timespec(const struct timespec &a, int b, struct timespec *result);
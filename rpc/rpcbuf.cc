@@ -0,0 +1,279 @@
+#include "rpcbuf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include "slock.h"
+#include "lang/verify.h"
+
+// every buffer is preceded by this header. 16 bytes keeps the payload
+// as aligned as malloc's.
+struct bufhdr {
+	int32_t cls;   // size class, or -1 for a buffer bigger than RPCBUF_MAX
+	uint32_t pad;
+	uint64_t cap;  // usable bytes after the header
+};
+
+// free buffers are chained through their payload
+struct freebuf {
+	freebuf *next;
+};
+
+struct freelist {
+	freebuf *head;
+	int n;
+};
+
+// a thread's cache. the counters are only written by the owning thread
+// and are atomic just so rpcbuf_get_stats() can read them.
+struct tcache {
+	freelist lists[RPCBUF_CLASSES];
+	std::atomic<uint64_t> allocs, thread_hits, pool_hits, misses, large,
+		frees, released;
+	tcache *prev, *next;
+};
+
+static pthread_once_t once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t key_;
+static bool enabled_;
+static __thread tcache *tc_;
+
+static pthread_mutex_t pool_m_[RPCBUF_CLASSES];
+static freelist pool_[RPCBUF_CLASSES];
+
+static pthread_mutex_t caches_m_ = PTHREAD_MUTEX_INITIALIZER;
+static tcache *caches_;
+static rpcbuf_stats retired_;  // counters of exited threads
+
+// buffers a thread keeps per class: up to 256KB worth, at least one
+static int
+thread_cap(int cls)
+{
+	int n = (256 << 10) >> (cls + RPCBUF_MIN_SHIFT);
+	return n > 0 ? n : 1;
+}
+
+static int
+pool_cap(int cls)
+{
+	return 4 * thread_cap(cls);
+}
+
+static inline void
+bump(std::atomic<uint64_t> &c)
+{
+	c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static inline bufhdr *
+hdr_of(const char *p)
+{
+	return (bufhdr *) (p - sizeof(bufhdr));
+}
+
+static void
+release(freebuf *b)
+{
+	free(hdr_of((char *) b));
+}
+
+// move n buffers from the front of a thread list to the shared pool,
+// releasing whatever does not fit
+static void
+spill(tcache *t, int cls, int n)
+{
+	freelist &l = t->lists[cls];
+	ScopedLock ml(&pool_m_[cls]);
+	while (n-- > 0 && l.head) {
+		freebuf *b = l.head;
+		l.head = b->next;
+		l.n--;
+		if (pool_[cls].n < pool_cap(cls)) {
+			b->next = pool_[cls].head;
+			pool_[cls].head = b;
+			pool_[cls].n++;
+		} else {
+			release(b);
+			bump(t->released);
+		}
+	}
+}
+
+static void
+thread_exit(void *arg)
+{
+	tcache *t = (tcache *) arg;
+	for (int cls = 0; cls < RPCBUF_CLASSES; cls++)
+		spill(t, cls, t->lists[cls].n);
+
+	ScopedLock ml(&caches_m_);
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		caches_ = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	retired_.allocs += t->allocs;
+	retired_.thread_hits += t->thread_hits;
+	retired_.pool_hits += t->pool_hits;
+	retired_.misses += t->misses;
+	retired_.large += t->large;
+	retired_.frees += t->frees;
+	retired_.released += t->released;
+	delete t;
+	tc_ = NULL;
+}
+
+static void
+init()
+{
+	for (int cls = 0; cls < RPCBUF_CLASSES; cls++)
+		VERIFY(pthread_mutex_init(&pool_m_[cls], 0) == 0);
+	VERIFY(pthread_key_create(&key_, thread_exit) == 0);
+	char *env = getenv("RPC_BUFPOOL");
+	enabled_ = env == NULL || atoi(env) != 0;
+}
+
+static tcache *
+get_tcache()
+{
+	if (tc_)
+		return tc_;
+	pthread_once(&once_, init);
+	tcache *t = new tcache();
+	memset(t->lists, 0, sizeof(t->lists));
+	t->allocs = t->thread_hits = t->pool_hits = t->misses = 0;
+	t->large = t->frees = t->released = 0;
+	{
+		ScopedLock ml(&caches_m_);
+		t->prev = NULL;
+		t->next = caches_;
+		if (caches_)
+			caches_->prev = t;
+		caches_ = t;
+	}
+	VERIFY(pthread_setspecific(key_, t) == 0);
+	tc_ = t;
+	return t;
+}
+
+static int
+class_of(size_t n)
+{
+	int cls = 0;
+	while (((size_t) RPCBUF_MIN << cls) < n)
+		cls++;
+	return cls;
+}
+
+char *
+rpcbuf_alloc(size_t n)
+{
+	tcache *t = get_tcache();
+	bump(t->allocs);
+
+	if (n > RPCBUF_MAX) {
+		bump(t->large);
+		bufhdr *h = (bufhdr *) malloc(sizeof(bufhdr) + n);
+		VERIFY(h);
+		h->cls = -1;
+		h->cap = n;
+		return (char *) (h + 1);
+	}
+
+	int cls = class_of(n);
+	freelist &l = t->lists[cls];
+	if (enabled_) {
+		if (l.head) {
+			bump(t->thread_hits);
+		} else {
+			// refill half a thread cache's worth from the shared pool
+			ScopedLock ml(&pool_m_[cls]);
+			int want = thread_cap(cls) / 2 + 1;
+			while (want-- > 0 && pool_[cls].head) {
+				freebuf *b = pool_[cls].head;
+				pool_[cls].head = b->next;
+				pool_[cls].n--;
+				b->next = l.head;
+				l.head = b;
+				l.n++;
+			}
+			if (l.head)
+				bump(t->pool_hits);
+		}
+		if (l.head) {
+			freebuf *b = l.head;
+			l.head = b->next;
+			l.n--;
+			return (char *) b;
+		}
+	}
+
+	bump(t->misses);
+	bufhdr *h = (bufhdr *) malloc(sizeof(bufhdr) + ((size_t) RPCBUF_MIN << cls));
+	VERIFY(h);
+	h->cls = cls;
+	h->cap = (size_t) RPCBUF_MIN << cls;
+	return (char *) (h + 1);
+}
+
+char *
+rpcbuf_realloc(char *p, size_t n)
+{
+	if (!p)
+		return rpcbuf_alloc(n);
+	size_t cap = hdr_of(p)->cap;
+	if (n <= cap)
+		return p;
+	char *np = rpcbuf_alloc(n);
+	memcpy(np, p, cap);
+	rpcbuf_free(p);
+	return np;
+}
+
+void
+rpcbuf_free(char *p)
+{
+	if (!p)
+		return;
+	tcache *t = get_tcache();
+	bump(t->frees);
+
+	bufhdr *h = hdr_of(p);
+	if (h->cls < 0 || !enabled_) {
+		bump(t->released);
+		free(h);
+		return;
+	}
+
+	int cls = h->cls;
+	freelist &l = t->lists[cls];
+	freebuf *b = (freebuf *) p;
+	b->next = l.head;
+	l.head = b;
+	l.n++;
+	if (l.n > thread_cap(cls))
+		spill(t, cls, l.n / 2);
+}
+
+size_t
+rpcbuf_capacity(const char *p)
+{
+	return hdr_of(p)->cap;
+}
+
+void
+rpcbuf_get_stats(rpcbuf_stats *s)
+{
+	ScopedLock ml(&caches_m_);
+	*s = retired_;
+	for (tcache *t = caches_; t; t = t->next) {
+		s->allocs += t->allocs.load(std::memory_order_relaxed);
+		s->thread_hits += t->thread_hits.load(std::memory_order_relaxed);
+		s->pool_hits += t->pool_hits.load(std::memory_order_relaxed);
+		s->misses += t->misses.load(std::memory_order_relaxed);
+		s->large += t->large.load(std::memory_order_relaxed);
+		s->frees += t->frees.load(std::memory_order_relaxed);
+		s->released += t->released.load(std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef rpcbuf_h
+#define rpcbuf_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Size-classed buffer pool for rpc PDUs.
+//
+// marshall, unmarshall and connection allocate their buffers here instead
+// of with malloc/realloc/free. Buffers are rounded up to a power-of-two
+// class between RPCBUF_MIN and RPCBUF_MAX bytes; freed buffers go to a
+// small per-thread cache and spill to a shared per-class pool, so the
+// steady state of an rpc loop does no malloc at all. Bigger buffers go
+// straight to malloc. A buffer may be freed by a different thread than
+// the one that allocated it.
+//
+// Setting RPC_BUFPOOL=0 in the environment turns caching off, which
+// helps tools like valgrind see every buffer.
+
+#define RPCBUF_MIN_SHIFT 10                 // 1KB, DEFAULT_RPC_SZ
+#define RPCBUF_MAX_SHIFT 20                 // 1MB
+#define RPCBUF_MIN (1 << RPCBUF_MIN_SHIFT)
+#define RPCBUF_MAX (1 << RPCBUF_MAX_SHIFT)
+#define RPCBUF_CLASSES (RPCBUF_MAX_SHIFT - RPCBUF_MIN_SHIFT + 1)
+
+char *rpcbuf_alloc(size_t n);
+// like realloc: keeps the first min(old, n) bytes. p may be NULL.
+char *rpcbuf_realloc(char *p, size_t n);
+void rpcbuf_free(char *p);
+// usable bytes in a buffer from rpcbuf_alloc
+size_t rpcbuf_capacity(const char *p);
+
+struct rpcbuf_stats {
+	uint64_t allocs;       // rpcbuf_alloc calls, including via realloc
+	uint64_t thread_hits;  // served from the calling thread's cache
+	uint64_t pool_hits;    // served from the shared pool
+	uint64_t misses;       // fell through to malloc (size-classed)
+	uint64_t large;        // bigger than RPCBUF_MAX, always malloc
+	uint64_t frees;
+	uint64_t released;     // frees that went back to the system
+};
+
+// counters summed over all threads, including ones that have exited
+void rpcbuf_get_stats(rpcbuf_stats *s);
+
+#endif
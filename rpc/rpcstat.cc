@@ -0,0 +1,371 @@
+#include "rpcstat.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <set>
+#include "slock.h"
+#include "gettime.h"
+#include "lang/verify.h"
+
+int64_t
+rpc_now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void
+appendf(std::string &out, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void
+appendf(std::string &out, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		out.append(buf, n < (int) sizeof(buf) ? n : (int) sizeof(buf) - 1);
+}
+
+rpc_hist::rpc_hist() : n(0), sum(0), min(0), max(0)
+{
+	for (int i = 0; i < RPCSTAT_BUCKETS; i++)
+		b[i] = 0;
+}
+
+void
+rpc_hist::add(uint64_t us)
+{
+	int i = 0;
+	while (i < RPCSTAT_BUCKETS - 1 && us >= (1ULL << i))
+		i++;
+	b[i]++;
+	if (n == 0 || us < min)
+		min = us;
+	n++;
+	sum += us;
+	if (us > max)
+		max = us;
+}
+
+void
+rpc_hist::merge(const rpc_hist &h)
+{
+	for (int i = 0; i < RPCSTAT_BUCKETS; i++)
+		b[i] += h.b[i];
+	if (h.n && (n == 0 || h.min < min))
+		min = h.min;
+	n += h.n;
+	sum += h.sum;
+	if (h.max > max)
+		max = h.max;
+}
+
+uint64_t
+rpc_hist::pct(double p) const
+{
+	if (n == 0)
+		return 0;
+	uint64_t want = (uint64_t) (p * n + 0.5);
+	if (want == 0)
+		want = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < RPCSTAT_BUCKETS; i++) {
+		if (seen + b[i] < want) {
+			seen += b[i];
+			continue;
+		}
+		// as if the bucket's values were spread evenly over it,
+		// within what was actually seen
+		double lo = i ? (double) (1ULL << (i - 1)) : 0;
+		double hi = i < RPCSTAT_BUCKETS - 1 ? (double) (1ULL << i) : max;
+		if (lo < min)
+			lo = min;
+		if (hi > max)
+			hi = max;
+		return (uint64_t) (lo + (hi - lo) * (want - seen) / b[i]);
+	}
+	return max;
+}
+
+void
+rpc_hist::json(std::string &out) const
+{
+	appendf(out, "{\"n\": %llu, \"avg_us\": %llu, \"p50_us\": %llu, "
+			"\"p90_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu, \"buckets\": [",
+			(unsigned long long) n,
+			(unsigned long long) (n ? sum / n : 0),
+			(unsigned long long) pct(0.5), (unsigned long long) pct(0.9),
+			(unsigned long long) pct(0.99), (unsigned long long) max);
+	int last = RPCSTAT_BUCKETS - 1;
+	while (last >= 0 && b[last] == 0)
+		last--;
+	for (int i = 0; i <= last; i++)
+		appendf(out, "%s%llu", i ? ", " : "", (unsigned long long) b[i]);
+	out += "]}";
+}
+
+rpc_stat::rpc_stat() : calls(0), errors(0), dups(0), retrans(0), shed(0),
+	bytes_in(0), bytes_out(0), raw_in(0), raw_out(0)
+{
+}
+
+void
+rpc_stat::merge(const rpc_stat &s)
+{
+	calls += s.calls;
+	errors += s.errors;
+	dups += s.dups;
+	retrans += s.retrans;
+	shed += s.shed;
+	bytes_in += s.bytes_in;
+	bytes_out += s.bytes_out;
+	raw_in += s.raw_in;
+	raw_out += s.raw_out;
+	queue.merge(s.queue);
+	handler.merge(s.handler);
+	e2e.merge(s.e2e);
+}
+
+void
+rpc_stat::json(std::string &out) const
+{
+	appendf(out, "{\"calls\": %llu, \"errors\": %llu, \"dups\": %llu, "
+			"\"retrans\": %llu, \"shed\": %llu, \"bytes_in\": %llu, "
+			"\"bytes_out\": %llu, \"raw_in\": %llu, \"raw_out\": %llu",
+			(unsigned long long) calls, (unsigned long long) errors,
+			(unsigned long long) dups, (unsigned long long) retrans,
+			(unsigned long long) shed,
+			(unsigned long long) bytes_in, (unsigned long long) bytes_out,
+			(unsigned long long) raw_in, (unsigned long long) raw_out);
+	// only the histograms this side keeps
+	if (queue.n) {
+		out += ", \"queue\": ";
+		queue.json(out);
+	}
+	if (handler.n) {
+		out += ", \"handler\": ";
+		handler.json(out);
+	}
+	if (e2e.n) {
+		out += ", \"e2e\": ";
+		e2e.json(out);
+	}
+	out += "}";
+}
+
+rpc_sample::rpc_sample() : proc(0), clt(0), ret(0), dup(false), shed(false),
+	retrans(0),
+	bytes_in(0), bytes_out(0), raw_in(0), raw_out(0),
+	queue_us(-1), handler_us(-1), e2e_us(-1)
+{
+}
+
+static void
+add_sample(rpc_stat &st, const rpc_sample &s)
+{
+	if (s.dup) {
+		st.dups++;
+	} else {
+		st.calls++;
+		if (s.ret != 0)
+			st.errors++;
+	}
+	if (s.shed)
+		st.shed++;
+	st.retrans += s.retrans;
+	st.bytes_in += s.bytes_in;
+	st.bytes_out += s.bytes_out;
+	st.raw_in += s.raw_in;
+	st.raw_out += s.raw_out;
+	if (s.queue_us >= 0)
+		st.queue.add(s.queue_us);
+	if (s.handler_us >= 0)
+		st.handler.add(s.handler_us);
+	if (s.e2e_us >= 0)
+		st.e2e.add(s.e2e_us);
+}
+
+// every live rpc_stats, for the RPC_STATS dump
+static pthread_mutex_t all_m = PTHREAD_MUTEX_INITIALIZER;
+static std::set<rpc_stats *> *all;
+static pthread_once_t dump_once = PTHREAD_ONCE_INIT;
+static int dump_secs;
+static FILE *dump_f;
+
+void *
+rpc_stats::dump_loop(void *)
+{
+	while (1) {
+		sleep(dump_secs);
+		ScopedLock al(&all_m);
+		std::set<rpc_stats *>::iterator i;
+		for (i = all->begin(); i != all->end(); i++)
+			fprintf(dump_f, "%s\n", (*i)->json_locked().c_str());
+		fflush(dump_f);
+	}
+	return NULL;
+}
+
+void
+rpc_stats::start_dump()
+{
+	char *e = getenv("RPC_STATS");
+	if (e == NULL || atoi(e) <= 0)
+		return;
+	dump_secs = atoi(e);
+	dump_f = stderr;
+	char *path = getenv("RPC_STATS_FILE");
+	if (path != NULL && (dump_f = fopen(path, "a")) == NULL) {
+		perror("rpc_stats: RPC_STATS_FILE");
+		dump_f = stderr;
+	}
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, rpc_stats::dump_loop, NULL) == 0);
+	VERIFY(pthread_detach(th) == 0);
+}
+
+rpc_stats::rpc_stats(const std::string &name) : name_(name)
+{
+	for (int i = 0; i < RPCSTAT_SHARDS; i++) {
+		VERIFY(pthread_mutex_init(&shards_[i].m, 0) == 0);
+		shards_[i].ticks = 0;
+	}
+	VERIFY(pthread_once(&dump_once, rpc_stats::start_dump) == 0);
+	ScopedLock al(&all_m);
+	if (all == NULL)
+		all = new std::set<rpc_stats *>;
+	all->insert(this);
+}
+
+rpc_stats::~rpc_stats()
+{
+	{
+		ScopedLock al(&all_m);
+		all->erase(this);
+	}
+	for (int i = 0; i < RPCSTAT_SHARDS; i++)
+		VERIFY(pthread_mutex_destroy(&shards_[i].m) == 0);
+}
+
+// threads number themselves as they first record, so that the threads
+// of a pool spread over the shards
+static std::atomic<unsigned int> next_idx(0);
+static __thread int my_idx = -1;
+
+void
+rpc_stats::record(const rpc_sample &s)
+{
+	if (my_idx < 0)
+		my_idx = next_idx++ & (RPCSTAT_SHARDS - 1);
+	shard &sh = shards_[my_idx];
+	ScopedLock sl(&sh.m);
+	add_sample(sh.procs[s.proc], s);
+	sh.ticks++;
+	if (!s.clt)
+		return;
+	std::map<unsigned int, client_stat>::iterator c = sh.clients.find(s.clt);
+	if (c == sh.clients.end()) {
+		// make room by forgetting the client idle the longest
+		if (sh.clients.size() >= RPCSTAT_CLIENTS) {
+			std::map<unsigned int, client_stat>::iterator old, i;
+			for (old = i = sh.clients.begin(); i != sh.clients.end(); i++)
+				if (i->second.last < old->second.last)
+					old = i;
+			sh.clients.erase(old);
+		}
+		c = sh.clients.insert(std::make_pair(s.clt, client_stat())).first;
+	}
+	c->second.last = sh.ticks;
+	add_sample(c->second.st, s);
+}
+
+void
+rpc_stats::get(std::map<int, rpc_stat> *procs,
+		std::map<unsigned int, rpc_stat> *clients)
+{
+	procs->clear();
+	clients->clear();
+	for (int i = 0; i < RPCSTAT_SHARDS; i++) {
+		ScopedLock sl(&shards_[i].m);
+		std::map<int, rpc_stat>::iterator p;
+		for (p = shards_[i].procs.begin(); p != shards_[i].procs.end(); p++)
+			(*procs)[p->first].merge(p->second);
+		std::map<unsigned int, client_stat>::iterator c;
+		for (c = shards_[i].clients.begin(); c != shards_[i].clients.end(); c++)
+			(*clients)[c->first].merge(c->second.st);
+	}
+}
+
+rpc_stat
+rpc_stats::get(int proc)
+{
+	rpc_stat st;
+	for (int i = 0; i < RPCSTAT_SHARDS; i++) {
+		ScopedLock sl(&shards_[i].m);
+		std::map<int, rpc_stat>::iterator p = shards_[i].procs.find(proc);
+		if (p != shards_[i].procs.end())
+			st.merge(p->second);
+	}
+	return st;
+}
+
+void
+rpc_stats::set_extra(std::function<std::string()> f)
+{
+	ScopedLock al(&all_m);
+	extra_ = f;
+}
+
+std::string
+rpc_stats::json()
+{
+	ScopedLock al(&all_m);
+	return json_locked();
+}
+
+// with all_m held, which keeps extra_ from changing or its owner from
+// going away under us
+std::string
+rpc_stats::json_locked()
+{
+	std::map<int, rpc_stat> procs;
+	std::map<unsigned int, rpc_stat> clients;
+	get(&procs, &clients);
+
+	std::string out;
+	out += "{\"name\": \"";
+	for (size_t i = 0; i < name_.size(); i++) {
+		if (name_[i] == '"' || name_[i] == '\\')
+			out += '\\';
+		out += name_[i];
+	}
+	appendf(out, "\", \"time_us\": %lld", (long long) rpc_now_us());
+	if (extra_) {
+		std::string x = extra_();
+		if (!x.empty())
+			out += ", " + x;
+	}
+
+	out += ", \"procs\": {";
+	std::map<int, rpc_stat>::iterator p;
+	for (p = procs.begin(); p != procs.end(); p++) {
+		appendf(out, "%s\"0x%x\": ", p == procs.begin() ? "" : ", ", p->first);
+		p->second.json(out);
+	}
+	out += "}, \"clients\": {";
+	std::map<unsigned int, rpc_stat>::iterator c;
+	for (c = clients.begin(); c != clients.end(); c++) {
+		appendf(out, "%s\"%u\": ", c == clients.begin() ? "" : ", ", c->first);
+		c->second.json(out);
+	}
+	out += "}}";
+	return out;
+}
@@ -0,0 +1,126 @@
+#ifndef rpcstat_h
+#define rpcstat_h
+
+#include <pthread.h>
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+
+// Per-procedure and per-client metrics for rpcc and rpcs.
+//
+// Each rpcc and rpcs records every call it finishes into an rpc_stats.
+// Threads record into one of RPCSTAT_SHARDS shards picked by a small
+// per-thread index, each with its own lock and maps, so recording is
+// an uncontended lock and a few additions; get() and json() merge the
+// shards when someone asks.
+//
+// A client gets a new nonce each time it starts, so a shard keeps only
+// the RPCSTAT_CLIENTS clients it saw most recently; the per-proc totals
+// still count every call.
+//
+// Latencies go into log2 histograms of microseconds. With RPC_STATS=secs
+// in the environment a thread writes every live rpc_stats as one JSON
+// object per line every secs seconds, to the file named by
+// RPC_STATS_FILE or else to stderr.
+
+#define RPCSTAT_SHARDS 16    // power of two
+#define RPCSTAT_BUCKETS 32   // bucket i holds [2^(i-1), 2^i) us, 0 holds < 1us
+#define RPCSTAT_CLIENTS 64   // per-client entries kept per shard
+
+// the stats keep microseconds; the benchmarks use the same histogram
+// for nanoseconds, whose top bucket starts at about a second
+struct rpc_hist {
+	rpc_hist();
+	uint64_t n;
+	uint64_t sum;   // us
+	uint64_t min;
+	uint64_t max;
+	uint64_t b[RPCSTAT_BUCKETS];
+
+	void add(uint64_t us);
+	void merge(const rpc_hist &h);
+	// the value below which the p-th fraction of values fall,
+	// interpolated within its bucket
+	uint64_t pct(double p) const;
+	double mean() const { return n ? (double) sum / n : 0; }
+	void json(std::string &out) const;
+};
+
+struct rpc_stat {
+	rpc_stat();
+	uint64_t calls;
+	uint64_t errors;     // nonzero return, rpc failures included
+	uint64_t dups;       // rpcs: requests seen before, answered from the window or dropped
+	uint64_t retrans;    // rpcc: requests sent again
+	uint64_t shed;       // rpcs: failed unrun, expired or over the proc's limit
+	uint64_t bytes_in, bytes_out;  // as sent
+	uint64_t raw_in, raw_out;      // before compression
+	rpc_hist queue;      // rpcs: from arrival until a worker takes it up
+	rpc_hist handler;    // rpcs: in the handler
+	rpc_hist e2e;        // rpcc: from call until the reply is in
+
+	void merge(const rpc_stat &s);
+	void json(std::string &out) const;
+};
+
+// what one call adds; latencies below 0 were not measured
+struct rpc_sample {
+	rpc_sample();
+	int proc;
+	unsigned int clt;    // rpcs: the client's nonce, 0 for none
+	int ret;
+	bool dup;
+	bool shed;
+	int retrans;
+	int bytes_in, bytes_out;
+	int raw_in, raw_out;
+	int64_t queue_us, handler_us, e2e_us;
+};
+
+class rpc_stats {
+	public:
+		// name identifies the owner in dumps
+		rpc_stats(const std::string &name);
+		~rpc_stats();
+
+		void record(const rpc_sample &s);
+
+		// the totals so far, by proc and by client
+		void get(std::map<int, rpc_stat> *procs,
+				std::map<unsigned int, rpc_stat> *clients);
+		rpc_stat get(int proc);
+		// all of it as one JSON object
+		std::string json();
+		// f returns more members for json() to add at the top level,
+		// as "\"name\": value, ...", for state the owner keeps itself.
+		// once set_extra(NULL) returns, f is no longer running.
+		void set_extra(std::function<std::string()> f);
+
+		const std::string &name() { return name_; }
+
+	private:
+		struct client_stat {
+			rpc_stat st;
+			uint64_t last;  // the shard's tick at its latest call
+		};
+		struct shard {
+			pthread_mutex_t m;
+			std::map<int, rpc_stat> procs;
+			std::map<unsigned int, client_stat> clients;
+			uint64_t ticks;  // calls recorded
+			char pad[64];
+		};
+		std::string json_locked();
+		static void start_dump();
+		static void *dump_loop(void *);
+
+		std::string name_;
+		std::function<std::string()> extra_;
+		shard shards_[RPCSTAT_SHARDS];
+};
+
+// microseconds on the monotonic clock
+int64_t rpc_now_us();
+
+#endif
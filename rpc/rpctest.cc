@@ -2,6 +2,7 @@
 // generates print statements on failures, but eventually says "rpctest OK"
 
 #include "rpc.h"
+#include "crc32c.h"
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,9 @@
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
+#include "slock.h"
+#include "rpcstat.h"
+#include <sstream>
 
 #define NUM_CL 2
 
@@ -19,6 +23,15 @@ struct sockaddr_in dst; //server's ip address
 int port;
 pthread_attr_t attr;
 
+// a struct marshalled by its field list
+struct rec {
+	int id;
+	std::string name;
+	std::vector<unsigned long long> vals;
+	std::map<std::string, int> tags;
+	RPC_FIELDS(id, name, vals, tags)
+};
+
 // server-side handlers. they must be methods of some class
 // to simplify rpcs::reg(). a server process can have handlers
 // from multiple classes.
@@ -28,6 +41,11 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_bytes(const rpc_bytes a, unsigned int &r);
+		int handle_sleep(const int ms, int &r);
+		int handle_rec(const rec &a, const int n, rec &r);
+		void handle_hop(const int hops, rpc_reply<int> reply);
+		void handle_drop(const int a, rpc_reply<int> reply);
 };
 
 // a handler. a and b are arguments, r is the result.
@@ -66,15 +84,83 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// a handler can take an rpc_bytes view of a string argument instead of
+// a copy; it points into the request and is valid until the handler returns.
+int
+srv::handle_bytes(const rpc_bytes a, unsigned int &r)
+{
+	r = 0;
+	for (size_t i = 0; i < a.size(); i++)
+		r = r * 31 + (unsigned char) a.data()[i];
+	return 0;
+}
+
+int
+srv::handle_sleep(const int ms, int &r)
+{
+	usleep(ms * 1000);
+	r = ms;
+	return 0;
+}
+
+// arguments can be taken by const reference, and are not copied
+int
+srv::handle_rec(const rec &a, const int n, rec &r)
+{
+	r = a;
+	r.id += n;
+	r.vals.push_back(n);
+	r.tags["n"] = n;
+	return 0;
+}
+
+// a deferred handler, registered with reg_async(). it passes the call
+// on to this same server hops times, through hopc[hops - 1] as if to a
+// different server each time, and answers with the number of handlers
+// the call went through once the last of them has. no thread waits for
+// the nested calls.
+#define MAX_HOPS 3
+rpcc *hopc[MAX_HOPS];
+
+void
+srv::handle_hop(const int hops, rpc_reply<int> reply)
+{
+	if (hops == 0) {
+		reply(0, 1);
+		return;
+	}
+	int ret = hopc[hops - 1]->call_async<int>(29, hops - 1, [reply](int intret, int &r) {
+		reply(0, intret == 0 ? r + 1 : intret);
+	});
+	if (ret < 0)
+		reply(0, ret);
+}
+
+// never answers; the call fails once reply is gone
+void
+srv::handle_drop(const int a, rpc_reply<int> reply)
+{
+}
+
 srv service;
 
+void regserver(rpcs *s)
+{
+	s->reg(22, &service, &srv::handle_22);
+	s->reg(23, &service, &srv::handle_fast);
+	s->reg(24, &service, &srv::handle_slow);
+	s->reg(25, &service, &srv::handle_bigrep);
+	s->reg(26, &service, &srv::handle_bytes);
+	s->reg(27, &service, &srv::handle_sleep);
+	s->reg(28, &service, &srv::handle_rec);
+	s->reg_async(29, &service, &srv::handle_hop);
+	s->reg_async(30, &service, &srv::handle_drop);
+}
+
 void startserver()
 {
 	server = new rpcs(port);
-	server->reg(22, &service, &srv::handle_22);
-	server->reg(23, &service, &srv::handle_fast);
-	server->reg(24, &service, &srv::handle_slow);
-	server->reg(25, &service, &srv::handle_bigrep);
+	regserver(server);
 }
 
 void
@@ -108,6 +194,234 @@ testmarshall()
 	un >> s1;
 	VERIFY(un.okdone());
 	VERIFY(i1==i && l1==l && s1==s);
+
+	// large payloads referenced in place marshall to the same bytes
+	std::string big(RPC_SG_MIN * 3, 'b');
+	big[17] = 'q';
+	marshall mc, mr(marshall::REF_LARGE);
+	mc << i << big << s << big;
+	mr << i << big << s << big;
+	VERIFY(mr.size() == mc.size());
+	std::vector<struct iovec> iov;
+	mr.iov(iov);
+	VERIFY(iov.size() == 4 && iov[1].iov_base == (void *) big.data());
+	std::string gathered;
+	for (size_t k = 0; k < iov.size(); k++)
+		gathered.append((char *) iov[k].iov_base, iov[k].iov_len);
+	VERIFY(gathered.substr(RPC_HEADER_SZ) == mc.get_content());
+	VERIFY(mr.get_content() == mc.get_content());
+
+	mc.take_buf(&b, &sz);
+	unmarshall un1(b, sz);
+	un1.unpack_req_header(&rh1);
+	rpc_bytes view;
+	un1 >> i1 >> view;
+	VERIFY(un1.ok() && view.size() == big.size() && view.str() == big);
+	VERIFY(view.data() > b && view.data() < b + sz);
+
+	// RPC_FIELDS structs and containers, and rpc_size() agreeing with
+	// what they marshall to
+	rec x, y;
+	x.id = 7;
+	x.name = big;
+	x.vals.push_back(1);
+	x.vals.push_back(1ULL << 40);
+	x.tags["a"] = 1;
+	x.tags["bb"] = -2;
+	std::vector<rec> xs(3, x);
+	marshall mx, mxr(marshall::REF_LARGE);
+	mx << xs;
+	mxr << xs;
+	VERIFY(rpc_size(xs, false) == mx.size() - RPC_HEADER_SZ);
+	VERIFY(rpc_size(xs, true) == mxr.size() - RPC_HEADER_SZ - 3 * (int) big.size());
+	unmarshall ux(mx.get_content());
+	std::vector<rec> ys;
+	ux >> ys;
+	VERIFY(ux.okdone() && ys.size() == 3);
+	y = ys[2];
+	VERIFY(y.id == 7 && y.name == big && y.vals == x.vals && y.tags == x.tags);
+
+	// a count the pdu cannot hold stops at the end of it
+	marshall mbad;
+	mbad << (unsigned int) 1000000000 << 1 << 2;
+	unmarshall ubad(mbad.get_content());
+	std::vector<int> vbad;
+	ubad >> vbad;
+	VERIFY(!ubad.ok() && vbad.size() <= 3);
+}
+
+#define BUFPOOL_XT 50
+
+void *
+bufpool_alloc_thread(void *xx)
+{
+	char **bufs = (char **) xx;
+	for (int i = 0; i < BUFPOOL_XT; i++) {
+		bufs[i] = rpcbuf_alloc(100 + i * 100);
+		memset(bufs[i], i, 100 + i * 100);
+	}
+	return 0;
+}
+
+void
+testbufpool()
+{
+	const char *env = getenv("RPC_BUFPOOL");
+	bool pooled = env == NULL || atoi(env) != 0;
+	rpcbuf_stats s0, s1;
+	rpcbuf_get_stats(&s0);
+
+	// sizes round up to a class; realloc keeps the contents
+	char *b = rpcbuf_alloc(100);
+	VERIFY(rpcbuf_capacity(b) == RPCBUF_MIN);
+	for (int i = 0; i < 100; i++)
+		b[i] = i;
+	VERIFY(rpcbuf_realloc(b, RPCBUF_MIN) == b);
+	b = rpcbuf_realloc(b, 5000);
+	VERIFY(rpcbuf_capacity(b) == 8192);
+	for (int i = 0; i < 100; i++)
+		VERIFY(b[i] == i);
+	rpcbuf_free(b);
+
+	// a freed buffer is handed out again without a malloc
+	rpcbuf_get_stats(&s1);
+	b = rpcbuf_alloc(6000);
+	char *b2 = rpcbuf_alloc(RPCBUF_MAX + 1);
+	VERIFY(rpcbuf_capacity(b2) == RPCBUF_MAX + 1);
+	rpcbuf_stats s2;
+	rpcbuf_get_stats(&s2);
+	if (pooled)
+		VERIFY(s2.thread_hits == s1.thread_hits + 1);
+	VERIFY(s2.large == s1.large + 1);
+	rpcbuf_free(b);
+	rpcbuf_free(b2);
+
+	// buffers may be freed on another thread, and an exited thread's
+	// counters are kept
+	char *bufs[BUFPOOL_XT];
+	pthread_t th;
+	VERIFY(pthread_create(&th, NULL, bufpool_alloc_thread, bufs) == 0);
+	VERIFY(pthread_join(th, NULL) == 0);
+	for (int i = 0; i < BUFPOOL_XT; i++) {
+		VERIFY(bufs[i][100 + i * 100 - 1] == (char) i);
+		rpcbuf_free(bufs[i]);
+	}
+	rpcbuf_get_stats(&s1);
+	// alloc(100) plus realloc(5000), alloc(6000), the large one, the thread's
+	VERIFY(s1.allocs - s0.allocs == 4 + BUFPOOL_XT);
+	VERIFY(s1.frees - s0.frees == 4 + BUFPOOL_XT);
+	printf("buffer pool OK\n");
+}
+
+void
+testcrc()
+{
+	// the standard check value
+	VERIFY(crc32c(0, "123456789", 9) == 0xe3069283);
+	VERIFY(crc32c_sw(0, "123456789", 9) == 0xe3069283);
+
+	// any split gives the same sum, at any alignment
+	char buf[4096 + 8];
+	for (int i = 0; i < (int) sizeof(buf); i++)
+		buf[i] = random();
+	for (int off = 0; off < 8; off++) {
+		for (int n = 0; n < 100; n++) {
+			int len = n < 50 ? n : random() % 4096;
+			uint32_t whole = crc32c_sw(0, buf + off, len);
+			VERIFY(crc32c(0, buf + off, len) == whole);
+			int cut = len ? random() % len : 0;
+			VERIFY(crc32c(crc32c(0, buf + off, cut), buf + off + cut,
+						len - cut) == whole);
+		}
+	}
+
+	int mb = 0;
+	std::string big(1 << 20, 'x');
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	uint32_t c = 0;
+	for (; mb < 64; mb++)
+		c = crc32c(c, big.data(), big.size());
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	printf("crc32c OK (%s, %.0f MB/s)\n", crc32c_hw() ? "sse4.2" : "tables",
+			mb / secs);
+}
+
+// jobs for testthrpool()
+class pooltester {
+	public:
+		ThrPool *tp;
+		pthread_mutex_t m;
+		pthread_cond_t c;
+		int done;
+		int running;
+		int want;
+
+		// a job that adds two more, down to depth 0, from inside the pool
+		void fan(int depth) {
+			if (depth > 0) {
+				VERIFY(tp->addObjJob(this, &pooltester::fan, depth - 1));
+				VERIFY(tp->addObjJob(this, &pooltester::fan, depth - 1));
+			}
+			ScopedLock ml(&m);
+			done++;
+			VERIFY(pthread_cond_broadcast(&c) == 0);
+		}
+		// a job that blocks until want of them run at once
+		void hold(int) {
+			ScopedLock ml(&m);
+			running++;
+			VERIFY(pthread_cond_broadcast(&c) == 0);
+			while (running < want)
+				VERIFY(pthread_cond_wait(&c, &m) == 0);
+			done++;
+			VERIFY(pthread_cond_broadcast(&c) == 0);
+		}
+		void wait_done(int n) {
+			ScopedLock ml(&m);
+			while (done < n)
+				VERIFY(pthread_cond_wait(&c, &m) == 0);
+		}
+};
+
+void
+testthrpool()
+{
+	pooltester t;
+	VERIFY(pthread_mutex_init(&t.m, 0) == 0);
+	VERIFY(pthread_cond_init(&t.c, 0) == 0);
+
+	// jobs added by workers go to their own deques and get stolen
+	t.tp = new ThrPool(4);
+	t.done = 0;
+	VERIFY(t.tp->addObjJob(&t, &pooltester::fan, 10));
+	t.wait_done(2047);
+	delete t.tp;
+	VERIFY(t.done == 2047);
+
+	// a non-blocking pool refuses jobs once its queue is full. an
+	// elastic one adds workers while all of them block, up to the max.
+	t.tp = new ThrPool(2, false, 8);
+	t.done = t.running = 0;
+	t.want = 8;
+	for (int i = 0; i < 8; i++)
+		VERIFY(t.tp->addObjJob(&t, &pooltester::hold, i));
+	t.wait_done(8);
+	VERIFY(t.tp->nthreads() == 8);
+	t.want = 1000000;
+	int added = 0;
+	while (added < 100000 && t.tp->addObjJob(&t, &pooltester::hold, 0))
+		added++;
+	VERIFY(added < 100000 && t.tp->full());
+	{
+		ScopedLock ml(&t.m);
+		t.want = 0;
+		VERIFY(pthread_cond_broadcast(&t.c) == 0);
+	}
+	delete t.tp;
+	VERIFY(t.done == 8 + added);
+	printf("thread pool OK\n");
 }
 
 void *
@@ -244,6 +558,27 @@ simple_tests(rpcc *c)
 	VERIFY(rep.size() == 1000001);
 	printf("   -- huge 1M rpc request .. ok\n");
 
+	// huge argument sent by reference, read by the handler in place
+	big[4242] = 'y';
+	unsigned int h = 0, want = 0;
+	for (size_t i = 0; i < big.size(); i++)
+		want = want * 31 + (unsigned char) big[i];
+	intret = c->call(26, big, h);
+	VERIFY(intret == 0 && h == want);
+	printf("   -- huge rpc_bytes argument .. ok\n");
+
+	// a struct, by its RPC_FIELDS, both ways
+	rec a, r;
+	a.id = 1;
+	a.name = "rec";
+	a.vals.push_back(5);
+	a.tags["x"] = 9;
+	intret = c->call(28, a, 41, r, rpcc::to(3000));
+	VERIFY(intret == 0 && r.id == 42 && r.name == "rec");
+	VERIFY(r.vals.size() == 2 && r.vals[1] == 41);
+	VERIFY(r.tags.size() == 2 && r.tags["x"] == 9 && r.tags["n"] == 41);
+	printf("   -- RPC_FIELDS struct .. ok\n");
+
 	// specify a timeout value to an RPC that should timeout (udp)
 	struct sockaddr_in non_existent;
 	memset(&non_existent, 0, sizeof(non_existent));
@@ -281,6 +616,684 @@ concurrent_test(int nt)
 	printf(" OK\n");
 }
 
+void
+manyconns_test(int n)
+{
+	// more connections (two fds each in this process) than the
+	// original fixed-size poll tables could hold, spread over all
+	// reactors
+	printf("start manyconns_test (%d clients, %d reactors) ...", n,
+			PollMgr::Instance()->nreactors());
+
+	std::vector<rpcc *> cl;
+	for(int i = 0; i < n; i++){
+		rpcc *c = new rpcc(dst);
+		VERIFY(c->bind() == 0);
+		cl.push_back(c);
+	}
+	for(int i = 0; i < n; i++){
+		int r;
+		VERIFY(cl[i]->call(23, i, r) == 0 && r == i + 1);
+	}
+	for(int i = 0; i < n; i++)
+		delete cl[i];
+	printf(" OK\n");
+}
+
+// completion state shared by async_test's callbacks, which run on the
+// PollMgr thread (or an rpcc thread on timeout/cancel).
+struct async_state {
+	pthread_mutex_t m;
+	pthread_cond_t c;
+	int outstanding;
+	int ok;
+	int failed;
+};
+
+static void
+async_done(async_state *st, bool ok)
+{
+	ScopedLock ml(&st->m);
+	if (ok)
+		st->ok++;
+	else
+		st->failed++;
+	if (--st->outstanding == 0)
+		VERIFY(pthread_cond_signal(&st->c) == 0);
+}
+
+static void
+async_wait(async_state *st)
+{
+	ScopedLock ml(&st->m);
+	while (st->outstanding > 0)
+		VERIFY(pthread_cond_wait(&st->c, &st->m) == 0);
+}
+
+// issue the next call of a chain from the previous call's callback
+static void
+async_chain(rpcc *c, async_state *st, int n)
+{
+	int ret = c->call_async<int>(23, n, [c, st, n](int intret, int &r) {
+		bool ok = intret == 0 && r == n + 1;
+		if (ok && n < 99)
+			async_chain(c, st, n + 1);
+		else
+			async_done(st, ok && n == 99);
+	});
+	VERIFY(ret == 0);
+}
+
+void
+async_test(rpcc *c)
+{
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+
+	printf("async_test\n");
+
+	// many calls outstanding from a single thread, more than fit in
+	// the server's dispatch queue: it stops reading the connection
+	// until there is room. with -l every connection dies after a few
+	// dozen sends and takes the replies in flight with it, so keep
+	// fewer calls in flight.
+	char *lossy = getenv("RPC_LOSSY");
+	int n = lossy && atoi(lossy) > 0 ? 10 : 3000;
+	st.outstanding = n;
+	st.ok = st.failed = 0;
+	for (int i = 0; i < n; i++) {
+		int arg = i;
+		int proc = (i % 2) ? 23 : 24;
+		int ret = c->call_async<int>(proc, arg,
+				[&st, arg, proc](int intret, int &r) {
+			async_done(&st, intret == 0 && r == (proc == 23 ? arg+1 : arg+2));
+		});
+		VERIFY(ret == 0);
+	}
+	async_wait(&st);
+	VERIFY(st.ok == n && st.failed == 0);
+	printf("   -- %d outstanding calls from one thread .. ok\n", n);
+
+	// multiple arguments and a string reply
+	st.outstanding = 1;
+	st.ok = st.failed = 0;
+	c->call_async<std::string>(22, (std::string)"hello", (std::string)" goodbye",
+			[&st](int intret, std::string &r) {
+		async_done(&st, intret == 0 && r == "hello goodbye");
+	});
+	async_wait(&st);
+	VERIFY(st.ok == 1);
+	printf("   -- string concat .. ok\n");
+
+	// callbacks may issue further calls
+	st.outstanding = 1;
+	st.ok = st.failed = 0;
+	async_chain(c, &st, 0);
+	async_wait(&st);
+	VERIFY(st.ok == 1);
+	printf("   -- call chained from callbacks .. ok\n");
+
+	// a call the server sits on keeps its slot in the client's call
+	// table; later xids that land on that slot are skipped instead of
+	// waiting for it
+	if (!lossy || atoi(lossy) == 0) {
+		st.outstanding = 1;
+		st.ok = st.failed = 0;
+		c->call_async<int>(27, 3000, [&st](int intret, int &r) {
+			async_done(&st, intret == 0 && r == 3000);
+		});
+		struct timespec start, end;
+		clock_gettime(CLOCK_REALTIME, &start);
+		for (int i = 0; i < 2*RPCC_SLOTS; i++) {
+			int r;
+			VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+		}
+		clock_gettime(CLOCK_REALTIME, &end);
+		VERIFY(diff_timespec(end, start) < 3000);
+		async_wait(&st);
+		VERIFY(st.ok == 1);
+		printf("   -- %d calls past one stuck call .. ok\n", 2*RPCC_SLOTS);
+	}
+
+	// cancel fails what is still outstanding; every callback runs once
+	rpcc *c1 = new rpcc(dst);
+	VERIFY(c1->bind() == 0);
+	n = 200;
+	st.outstanding = n;
+	st.ok = st.failed = 0;
+	for (int i = 0; i < n; i++) {
+		int ret = c1->call_async<int>(24, i, [&st, i](int intret, int &r) {
+			async_done(&st, intret == 0 && r == i + 2);
+			VERIFY(intret == 0 || intret == rpc_const::cancel_failure);
+		});
+		VERIFY(ret == 0);
+	}
+	c1->cancel();
+	async_wait(&st);
+	VERIFY(st.ok + st.failed == n);
+	delete c1;
+	printf("   -- cancel with %d outstanding (%d completed) .. ok\n", n, st.ok);
+
+	printf("async_test OK\n");
+}
+
+void *
+batch_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	for(int i = 0; i < 100; i++){
+		int r;
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	}
+	return 0;
+}
+
+void
+batch_test()
+{
+	printf("batch_test\n");
+	rpcc *c = new rpcc(dst);
+	c->set_batching(500, 4096);
+	VERIFY(c->bind() == 0);
+
+	// calls from several threads share batches
+	pthread_t th[10];
+	for (int i = 0; i < 10; i++)
+		VERIFY(pthread_create(&th[i], &attr, batch_client, (void *) c) == 0);
+	for (int i = 0; i < 10; i++)
+		VERIFY(pthread_join(th[i], NULL) == 0);
+	printf("   -- 10 threads .. ok\n");
+
+	// async calls from one thread fill batches up to the size cap
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+	char *lossy = getenv("RPC_LOSSY");
+	int n = lossy && atoi(lossy) > 0 ? 10 : 1000;
+	st.outstanding = n;
+	st.ok = st.failed = 0;
+	for (int i = 0; i < n; i++) {
+		int ret = c->call_async<int>(24, i, [&st, i](int intret, int &r) {
+			async_done(&st, intret == 0 && r == i + 2);
+		});
+		VERIFY(ret == 0);
+	}
+	async_wait(&st);
+	VERIFY(st.ok == n && st.failed == 0);
+	printf("   -- %d async calls .. ok\n", n);
+
+	// a request too big for a batch goes out on its own
+	std::string big(8192, 'x');
+	std::string r;
+	VERIFY(c->call(22, big, (std::string) "y", r) == 0 && r == big + "y");
+	printf("   -- request bigger than a batch .. ok\n");
+
+	// a slow request holds up none batched behind it
+	st.outstanding = 1;
+	st.ok = st.failed = 0;
+	VERIFY(c->call_async<int>(27, 2000, [&st](int intret, int &r) {
+		async_done(&st, intret == 0 && r == 2000);
+	}) == 0);
+	int64_t t0 = rpc_now_us();
+	int fr;
+	VERIFY(c->call(23, 1, fr) == 0 && fr == 2);
+	int64_t ms = (rpc_now_us() - t0) / 1000;
+	VERIFY(c->islossy() || ms < 1000);
+	async_wait(&st);
+	VERIFY(st.ok == 1);
+	printf("   -- call behind a slow one in its batch, %lldms .. ok\n",
+			(long long) ms);
+
+	delete c;
+	printf("batch_test OK\n");
+}
+
+static bool
+readn(int fd, char *b, int n)
+{
+	for (int got; n > 0; b += got, n -= got)
+		if ((got = read(fd, b, n)) <= 0)
+			return false;
+	return true;
+}
+
+// a server from before bind answered with features: it binds, and
+// answers procs 23 and 24 as srv does. a real one would abort on any
+// other proc, a batch included; this one counts them in xx[1].
+static void *
+old_server(void *xx)
+{
+	int lfd = ((int *) xx)[0];
+	int fd = accept(lfd, NULL, NULL);
+	VERIFY(fd >= 0);
+	rpc_sz_t nsz;
+	while (readn(fd, (char *) &nsz, sizeof(nsz))) {
+		int sz = ntohl(nsz);
+		VERIFY(sz > (int) sizeof(nsz) && sz < 4096);
+		char *b = rpcbuf_alloc(sz);
+		memcpy(b, &nsz, sizeof(nsz));
+		VERIFY(readn(fd, b + sizeof(nsz), sz - sizeof(nsz)));
+		unmarshall u(b, sz);
+		req_header h;
+		u.unpack_req_header(&h);
+		int x;
+		u >> x;
+		marshall m;
+		if (h.proc == rpc_const::bind)
+			m << 1;
+		else if (h.proc == 23 || h.proc == 24)
+			m << x + h.proc - 22;
+		else
+			((int *) xx)[1]++;
+		m.pack_reply_header(reply_header(h.xid, 0));
+		nsz = htonl(m.size());
+		memcpy(m.cstr(), &nsz, sizeof(nsz));
+		VERIFY(write(fd, m.cstr(), m.size()) == m.size());
+	}
+	close(fd);
+	return 0;
+}
+
+// a batching client sends an old server each request on its own
+void
+old_server_test()
+{
+	printf("old_server_test\n");
+	int args[2] = { socket(AF_INET, SOCK_STREAM, 0), 0 };
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = inet_addr("127.0.0.1");
+	socklen_t slen = sizeof(sin);
+	VERIFY(bind(args[0], (struct sockaddr *) &sin, sizeof(sin)) == 0);
+	VERIFY(listen(args[0], 1) == 0);
+	VERIFY(getsockname(args[0], (struct sockaddr *) &sin, &slen) == 0);
+	pthread_t th;
+	VERIFY(pthread_create(&th, &attr, old_server, (void *) args) == 0);
+
+	rpcc *c = new rpcc(sin);
+	c->set_batching(500, 4096);
+	VERIFY(c->bind(rpcc::to(5000)) == 0);
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+	st.outstanding = 100;
+	st.ok = st.failed = 0;
+	for (int i = 0; i < 100; i++) {
+		VERIFY(c->call_async<int>(24, i, [&st, i](int intret, int &r) {
+			async_done(&st, intret == 0 && r == i + 2);
+		}, rpcc::to(5000)) == 0);
+	}
+	async_wait(&st);
+	VERIFY(args[1] == 0 && st.ok == 100);
+	delete c;
+	VERIFY(pthread_join(th, NULL) == 0);
+	close(args[0]);
+	printf("   -- 100 async calls, no batch pdu .. ok\n");
+	printf("old_server_test OK\n");
+}
+
+// large bodies go compressed both ways once bind has found that the
+// server takes it
+void
+compress_test()
+{
+	printf("compress_test\n");
+	rpcc *c = new rpcc(dst);
+	c->set_compression(1024);
+	VERIFY(c->bind() == 0);
+
+	std::string text;
+	for (int i = 0; text.size() < 200000; i++) {
+		char line[64];
+		sprintf(line, "%d the quick brown fox jumps over the lazy dog\n", i);
+		text += line;
+	}
+	rpc_stat z0;
+	if (server)
+		z0 = server->get_stat(22);
+	std::string rep;
+	VERIFY(c->call(22, text, (std::string)"!", rep) == 0 && rep == text + "!");
+	if (server) {
+		rpc_stat z = server->get_stat(22);
+		uint64_t raw_in = z.raw_in - z0.raw_in, wire_in = z.bytes_in - z0.bytes_in;
+		uint64_t raw_out = z.raw_out - z0.raw_out, wire_out = z.bytes_out - z0.bytes_out;
+		VERIFY(wire_in * 3 < raw_in && wire_out * 3 < raw_out);
+		printf("   -- %d bytes of text, %.1fx in %.1fx out .. ok\n",
+				(int) text.size(), (double) raw_in / wire_in,
+				(double) raw_out / wire_out);
+	} else {
+		printf("   -- %d bytes of text .. ok\n", (int) text.size());
+	}
+
+	// bytes that do not shrink go as they are
+	std::string noise(100000, 0);
+	unsigned int sum = 0;
+	for (size_t i = 0; i < noise.size(); i++) {
+		noise[i] = random();
+		sum = sum * 31 + (unsigned char) noise[i];
+	}
+	unsigned int r;
+	VERIFY(c->call(26, noise, r) == 0 && r == sum);
+	printf("   -- incompressible request .. ok\n");
+
+	// a compressed reply to an asynchronous call
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+	st.outstanding = 10;
+	st.ok = st.failed = 0;
+	for (int i = 0; i < 10; i++) {
+		int len = 50000 + i;
+		int ret = c->call_async<std::string>(25, len, [&st, len](int intret, std::string &r) {
+			async_done(&st, intret == 0 && (int) r.size() == len &&
+					r == std::string(len, 'x'));
+		});
+		VERIFY(ret == 0);
+	}
+	async_wait(&st);
+	VERIFY(st.ok == 10 && st.failed == 0);
+	printf("   -- 10 async calls with big replies .. ok\n");
+
+	// clients that did not ask get plain replies
+	VERIFY(clients[0]->call(25, 50000, rep) == 0 && rep == std::string(50000, 'x'));
+	printf("   -- client without compression .. ok\n");
+
+	delete c;
+	printf("compress_test OK\n");
+}
+
+// both ends count what they see, and the server hands its counts out
+// over rpc
+void
+stats_test(rpcc *c)
+{
+	printf("stats_test\n");
+	rpc_stat c0 = c->get_stat(23);
+	rpc_stat s0;
+	if (server)
+		s0 = server->get_stat(23);
+	for (int i = 0; i < 100; i++) {
+		int r;
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	}
+	rpc_stat c1 = c->get_stat(23);
+	VERIFY(c1.calls - c0.calls == 100 && c1.errors == c0.errors);
+	VERIFY(c1.e2e.n - c0.e2e.n == 100 && c1.bytes_out > c0.bytes_out);
+	printf("   -- client counts 100 calls, p50 %lluus p99 %lluus .. ok\n",
+			(unsigned long long) c1.e2e.pct(0.5),
+			(unsigned long long) c1.e2e.pct(0.99));
+	// timeouts follow the round trips measured
+	VERIFY(c->rto() >= RPCC_RTO_MIN && c->rto() < rpcc::to_min.to);
+	printf("   -- first timeout %dms .. ok\n", c->rto());
+	if (server) {
+		rpc_stat s1 = server->get_stat(23);
+		VERIFY(s1.calls - s0.calls == 100);
+		VERIFY(s1.queue.n - s0.queue.n == 100 && s1.handler.n - s0.handler.n == 100);
+		printf("   -- server counts 100 calls .. ok\n");
+	}
+
+	std::string json;
+	VERIFY(c->call(rpc_const::stats, 0, json) == 0);
+	VERIFY(json[0] == '{' && json[json.size() - 1] == '}');
+	VERIFY(json.find("\"0x17\": {\"calls\": ") != std::string::npos);
+	VERIFY(json.find("\"handler\": {") != std::string::npos);
+	VERIFY(c->stats_json().find("\"srtt_us\": ") != std::string::npos);
+	printf("   -- stats rpc, %d bytes of json .. ok\n", (int) json.size());
+
+	// restarted clients come back with new nonces; only the latest are kept
+	rpc_stats st("clients");
+	rpc_sample smp;
+	smp.proc = 23;
+	for (int i = 1; i <= 1000; i++) {
+		smp.clt = i;
+		st.record(smp);
+	}
+	std::map<int, rpc_stat> procs;
+	std::map<unsigned int, rpc_stat> cls;
+	st.get(&procs, &cls);
+	VERIFY(procs[23].calls == 1000);
+	VERIFY(cls.size() == RPCSTAT_CLIENTS && cls.count(1000) && !cls.count(1));
+	printf("   -- 1000 client nonces, %d kept .. ok\n", (int) cls.size());
+	printf("stats_test OK\n");
+}
+
+// the server fails a call fast when its proc is at its limit, or when
+// the deadline the client sent along has passed by the time it runs
+void
+deadline_test(rpcc *c)
+{
+	printf("deadline_test\n");
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+	int r;
+
+	server->set_max_inflight(27, 1);
+	st.outstanding = 1;
+	st.ok = st.failed = 0;
+	VERIFY(c->call_async<int>(27, 300, [&st](int intret, int &r) {
+		async_done(&st, intret == 0 && r == 300);
+	}) == 0);
+	usleep(100 * 1000);
+	VERIFY(c->call(27, 0, r) == rpc_const::overload_failure);
+	async_wait(&st);
+	VERIFY(st.ok == 1);
+	server->set_max_inflight(27, 0);
+	printf("   -- second call over a limit of 1 .. refused ok\n");
+
+	// a client that gives up at once; however soon the server takes
+	// up its call, it is too late to run it
+	rpc_stat s0 = server->get_stat(23);
+	int ret = c->call(23, 1, r, rpcc::to(0));
+	VERIFY(ret == rpc_const::timeout_failure || ret == rpc_const::deadline_failure);
+	rpc_stat s1;
+	for (int i = 0; i < 100 && (s1 = server->get_stat(23)).calls == s0.calls; i++)
+		usleep(10 * 1000);
+	VERIFY(s1.shed - s0.shed == 1 && s1.handler.n == s0.handler.n);
+	printf("   -- call past its deadline .. not run ok\n");
+
+	VERIFY(c->call(23, 1, r, rpcc::to(3000)) == 0 && r == 2);
+	printf("deadline_test OK\n");
+}
+
+// thousands of calls in progress at once, each passing through several
+// deferred handlers, on the server's few dispatch threads
+void
+deferred_test(rpcc *c)
+{
+	printf("deferred_test\n");
+	for (int i = 0; i < MAX_HOPS; i++) {
+		hopc[i] = new rpcc(dst);
+		VERIFY(hopc[i]->bind() == 0);
+	}
+	async_state st;
+	VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+	VERIFY(pthread_cond_init(&st.c, 0) == 0);
+
+	// each rpcc has fewer than RPCC_SLOTS calls outstanding
+	int n = c->islossy() ? 200 : 1000;
+	int hops = MAX_HOPS;
+	st.outstanding = n;
+	st.ok = st.failed = 0;
+	int64_t t0 = rpc_now_us();
+	for (int i = 0; i < n; i++) {
+		VERIFY(c->call_async<int>(29, hops, [&st, hops](int intret, int &r) {
+			async_done(&st, intret == 0 && r == hops + 1);
+		}) == 0);
+	}
+	async_wait(&st);
+	VERIFY(st.ok == n);
+	std::string json = server->stats_json();
+	VERIFY(json.find("\"deferred\": 0,") != std::string::npos);
+	size_t at = json.find("\"threads\": ");
+	VERIFY(at != std::string::npos);
+	printf("   -- %d calls through %d handlers each, %d threads, %lldms .. ok\n",
+			n, hops + 1, atoi(json.c_str() + at + 11),
+			(long long) (rpc_now_us() - t0) / 1000);
+
+	// a handler that lets go of its reply unanswered fails the call
+	int r;
+	VERIFY(c->call(30, 0, r) == rpc_const::cancel_failure);
+	printf("   -- unanswered call .. failed ok\n");
+
+	for (int i = 0; i < MAX_HOPS; i++) {
+		delete hopc[i];
+		hopc[i] = NULL;
+	}
+	printf("deferred_test OK\n");
+}
+
+void *
+transport_client(void *xx)
+{
+	rpcc *c = (rpcc *) xx;
+	char *lossy = getenv("RPC_LOSSY");
+	int n = lossy && atoi(lossy) > 0 ? 10 : 100;
+	for(int i = 0; i < n; i++){
+		int arg = random() % 20000;
+		std::string rep;
+		VERIFY(c->call(25, arg, rep) == 0 && (int) rep.size() == arg);
+		int r;
+		VERIFY(c->call(23, i, r) == 0 && r == i + 1);
+	}
+	return 0;
+}
+
+// how raw_call() frames its pdu
+enum raw_t { RAW_PLAIN, RAW_SUMMED, RAW_CORRUPT };
+
+// send proc 23 a pdu by hand: as a peer without checksums would, or
+// with a CRC32C trailer, its last body byte flipped after summing if
+// corrupt. the server's answer in *r, false if it hung up instead
+static bool
+raw_call(int x, raw_t how, int *r)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	VERIFY(fd >= 0);
+	VERIFY(connect(fd, (struct sockaddr *) &dst, sizeof(dst)) == 0);
+
+	marshall m;
+	m << x;
+	m.pack_req_header(req_header(1, 23, 0, 0, 0));
+	std::string pdu(m.cstr(), m.size());
+	uint32_t ncrc;
+	if (how != RAW_PLAIN) {
+		ncrc = htonl(crc32c(0, pdu.data() + sizeof(rpc_sz_t), pdu.size() - sizeof(rpc_sz_t)));
+		pdu.append((char *) &ncrc, sizeof(ncrc));
+	}
+	rpc_sz_t nsz = htonl(how == RAW_PLAIN ? pdu.size() : (pdu.size() | RPC_SZ_SUMMED));
+	memcpy(&pdu[0], &nsz, sizeof(nsz));
+	if (how == RAW_CORRUPT)
+		pdu[pdu.size() - sizeof(ncrc) - 1] ^= 1;
+	VERIFY(write(fd, pdu.data(), pdu.size()) == (ssize_t) pdu.size());
+
+	char rb[256];
+	int n = 0, got, want = sizeof(rpc_sz_t);
+	bool summed = false;
+	while (n < want && (got = read(fd, rb + n, sizeof(rb) - n)) > 0) {
+		n += got;
+		if (n >= (int) sizeof(rpc_sz_t)) {
+			memcpy(&nsz, rb, sizeof(nsz));
+			want = ntohl(nsz) & ~RPC_SZ_SUMMED;
+			summed = (ntohl(nsz) & RPC_SZ_SUMMED) != 0;
+		}
+	}
+	close(fd);
+	if (n == 0)
+		return false;
+	VERIFY(n == want);
+	// the reply is summed just when the request was
+	VERIFY(summed == (how != RAW_PLAIN));
+	if (summed) {
+		n -= sizeof(ncrc);
+		memcpy(&ncrc, rb + n, sizeof(ncrc));
+		VERIFY(ntohl(ncrc) == crc32c(0, rb + sizeof(rpc_sz_t), n - sizeof(rpc_sz_t)));
+	}
+	char *rbuf = rpcbuf_alloc(n);
+	memcpy(rbuf, rb, n);
+	unmarshall u(rbuf, n);
+	reply_header h;
+	u.unpack_reply_header(&h);
+	VERIFY(h.xid == 1 && h.ret == 0);
+	u >> *r;
+	VERIFY(u.okdone());
+	return true;
+}
+
+// a pdu that does not match its checksum is dropped with its connection,
+// and a peer that sends none gets none back
+void
+checksum_test()
+{
+	printf("checksum_test\n");
+	int r = 0;
+	uint64_t bad = connection_bad_checksums();
+	// a lossy server may drop the connection instead of replying
+	bool ok = false;
+	for (int i = 0; i < 20 && !ok; i++)
+		ok = raw_call(41, RAW_PLAIN, &r);
+	VERIFY(ok && r == 42);
+	printf("   -- pdu without a checksum .. ok\n");
+	ok = false;
+	for (int i = 0; i < 20 && !ok; i++)
+		ok = raw_call(43, RAW_SUMMED, &r);
+	VERIFY(ok && r == 44);
+	VERIFY(connection_bad_checksums() == bad);
+	printf("   -- pdu summed by hand .. ok\n");
+	VERIFY(!raw_call(41, RAW_CORRUPT, &r));
+	VERIFY(connection_bad_checksums() == bad + 1);
+	printf("   -- flipped bit .. dropped ok\n");
+	printf("checksum_test OK\n");
+}
+
+// the same calls over a unix-domain socket, then a shared-memory ring
+void
+transport_test()
+{
+	const char *schemes[] = { "unix", "shm" };
+	for (int k = 0; k < 2; k++) {
+		char a[128];
+		sprintf(a, "%s:/tmp/rpctest-%d.sock", schemes[k], getpid());
+		printf("transport_test %s\n", a);
+		rpcaddr addr;
+		make_rpcaddr(a, &addr);
+		rpcs *s = new rpcs(addr);
+		regserver(s);
+
+		rpcc *c = new rpcc(addr);
+		VERIFY(c->bind() == 0);
+		std::string rep;
+		VERIFY(c->call(22, (std::string)"hello", (std::string)" goodbye", rep) == 0);
+		VERIFY(rep == "hello goodbye");
+		printf("   -- string concat .. ok\n");
+
+		// bigger than a shared-memory ring, so it goes through in pieces
+		std::string big(3 * 1000000, 'x');
+		big[4242] = 'y';
+		VERIFY(c->call(22, big, (std::string)"z", rep) == 0);
+		VERIFY(rep.size() == big.size() + 1 && rep[4242] == 'y');
+		printf("   -- huge 3M rpc request .. ok\n");
+
+		pthread_t th[10];
+		for (int i = 0; i < 10; i++)
+			VERIFY(pthread_create(&th[i], &attr, transport_client, (void *) c) == 0);
+		for (int i = 0; i < 10; i++)
+			VERIFY(pthread_join(th[i], NULL) == 0);
+		printf("   -- 10 threads .. ok\n");
+
+		// the client sees the server go away
+		delete s;
+		int r;
+		VERIFY(c->call(23, 1, r, rpcc::to(1000)) < 0);
+		printf("   -- deleted server .. failed ok\n");
+		delete c;
+		VERIFY(access(a + strlen(schemes[k]) + 1, F_OK) < 0);
+	}
+	printf("transport_test OK\n");
+}
+
 void 
 lossy_test()
 {
@@ -309,7 +1322,9 @@ lossy_test()
 	for(int i = 0; i < nt; i++){
 		VERIFY(pthread_join(th[i], NULL) == 0);
 	}
-	printf(".. OK\n");
+	rpc_stat st = clients[0]->get_stat(25);
+	printf(".. %d calls, p99 %dms max %dms OK\n", (int) st.calls,
+			(int) (st.e2e.pct(0.99) / 1000), (int) (st.e2e.max / 1000));
 	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
 }
 
@@ -323,6 +1338,21 @@ failure_test()
 
 	delete server;
 
+	{
+		async_state st;
+		VERIFY(pthread_mutex_init(&st.m, 0) == 0);
+		VERIFY(pthread_cond_init(&st.c, 0) == 0);
+		st.outstanding = 1;
+		st.ok = st.failed = 0;
+		time_t t0 = time(0);
+		VERIFY(client->call_async<int>(23, 1, [&st](int intret, int &r) {
+			async_done(&st, intret == rpc_const::timeout_failure);
+		}, rpcc::to(3000)) == 0);
+		async_wait(&st);
+		VERIFY(st.ok == 1 && time(0) - t0 <= 5);
+	}
+	printf("   -- async call to failed server times out .. failed ok\n");
+
 	client1 = new rpcc(dst);
 	VERIFY (client1->bind(rpcc::to(3000)) < 0);
 	printf("   -- create new client and try to bind to failed server .. failed ok\n");
@@ -386,6 +1416,233 @@ failure_test()
 	printf("failure_test OK\n");
 }
 
+// Benchmark mode (-b): instead of the tests, run every combination of
+// the lossy settings, client connections (rpccs), client threads and
+// workloads for -T ms each, and report calls/s, payload MB/s and
+// latency percentiles per point, as a table or as JSON (-j).
+//
+//   rpctest -b [-L lossy,...] [-k conns,...] [-t threads,...]
+//              [-w workload,...] [-z size,...] [-T ms] [-j] [-c] [-p port]
+//
+// workloads are fast (proc 23), slow (24, which sleeps up to 5ms),
+// echo (22, size random bytes each way) and bigrep (25, a size byte
+// reply); echo and bigrep run once per size. Threads take the rpccs
+// round robin, and points with more rpccs than threads are skipped.
+// A lossy setting reaches the server too unless it is elsewhere (-c).
+
+enum { W_FAST, W_SLOW, W_ECHO, W_BIGREP, NWORKLOADS };
+static const char *wnames[NWORKLOADS] = { "fast", "slow", "echo", "bigrep" };
+
+static std::vector<int> bench_lossy, bench_conns, bench_threads;
+static std::vector<int> bench_workloads, bench_sizes;
+static int bench_ms = 1000;
+static bool bench_json = false;
+static int bench_points = 0;
+
+struct bench_worker {
+	pthread_t th;
+	rpcc *c;
+	int workload;
+	int size;
+	rpc_hist h;
+	uint64_t bytes;   // payload, both ways, of calls that succeeded
+	int errors;
+};
+
+static std::atomic<bool> bench_stop;
+static pthread_barrier_t bench_b;
+
+// a call lost under a lossy setting counts as an error instead of
+// holding up its point for rpcc's default two minutes
+#define BENCH_CALL_TO 5000  // ms
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void *
+bench_client(void *xx)
+{
+	bench_worker *w = (bench_worker *) xx;
+	std::string payload(w->workload == W_ECHO ? w->size : 0, 0);
+	for (size_t i = 0; i < payload.size(); i++)
+		payload[i] = random();
+	std::string empty, rep;
+	rpcc::TO to = rpcc::to(BENCH_CALL_TO);
+
+	pthread_barrier_wait(&bench_b);
+	for (int i = 0; !bench_stop; i++) {
+		int r = 0, ret = 0;
+		uint64_t bytes = 0;
+		bool ok = false;
+		uint64_t t0 = now_ns();
+		switch (w->workload) {
+		case W_FAST:
+			ret = w->c->call(23, i, r, to);
+			ok = ret == 0 && r == i + 1;
+			bytes = 2 * sizeof(int);
+			break;
+		case W_SLOW:
+			ret = w->c->call(24, i, r, to);
+			ok = ret == 0 && r == i + 2;
+			bytes = 2 * sizeof(int);
+			break;
+		case W_ECHO:
+			ret = w->c->call(22, payload, empty, rep, to);
+			ok = ret == 0 && rep.size() == payload.size();
+			bytes = 2 * payload.size();
+			break;
+		case W_BIGREP:
+			ret = w->c->call(25, w->size, rep, to);
+			ok = ret == 0 && (int) rep.size() == w->size;
+			bytes = sizeof(int) + w->size;
+			break;
+		}
+		w->h.add(now_ns() - t0);
+		if (ok)
+			w->bytes += bytes;
+		else
+			w->errors++;
+	}
+	return 0;
+}
+
+// run one point and report it
+static void
+bench_point(std::vector<rpcc *> &cl, int lossy, int nt, int workload,
+		int size)
+{
+	std::vector<bench_worker> ws(nt);
+	bench_stop = false;
+	VERIFY(pthread_barrier_init(&bench_b, 0, nt + 1) == 0);
+	for (int i = 0; i < nt; i++) {
+		ws[i].c = cl[i % cl.size()];
+		ws[i].workload = workload;
+		ws[i].size = size;
+		ws[i].bytes = 0;
+		ws[i].errors = 0;
+		VERIFY(pthread_create(&ws[i].th, 0, bench_client, &ws[i]) == 0);
+	}
+	pthread_barrier_wait(&bench_b);
+	uint64_t t0 = now_ns();
+	usleep(bench_ms * 1000);
+	bench_stop = true;
+	for (int i = 0; i < nt; i++)
+		VERIFY(pthread_join(ws[i].th, NULL) == 0);
+	double secs = (now_ns() - t0) / 1e9;
+	VERIFY(pthread_barrier_destroy(&bench_b) == 0);
+
+	rpc_hist all;
+	uint64_t bytes = 0;
+	int errors = 0;
+	for (int i = 0; i < nt; i++) {
+		all.merge(ws[i].h);
+		bytes += ws[i].bytes;
+		errors += ws[i].errors;
+	}
+	double cps = all.n / secs;
+	double mbps = bytes / secs / (1024 * 1024);
+	if (bench_json) {
+		printf("%s\n  {\"lossy\": %d, \"conns\": %d, \"threads\": %d, "
+				"\"workload\": \"%s\", \"size\": %d, \"calls\": %llu, "
+				"\"errors\": %d, \"secs\": %.6f, \"calls_per_sec\": %.1f, "
+				"\"mbps\": %.3f, \"lat_us\": {\"mean\": %.2f, \"min\": %.2f, "
+				"\"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, "
+				"\"max\": %.2f}}",
+				bench_points ? "," : "", lossy, (int) cl.size(), nt,
+				wnames[workload], size, (unsigned long long) all.n,
+				errors, secs, cps, mbps, all.mean() / 1e3, all.min / 1e3,
+				all.pct(0.50) / 1e3, all.pct(0.90) / 1e3,
+				all.pct(0.99) / 1e3, all.pct(0.999) / 1e3,
+				all.max / 1e3);
+	} else {
+		printf("%5d %5d %7d %-8s %7d %10.1f %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %6d\n",
+				lossy, (int) cl.size(), nt, wnames[workload], size, cps, mbps,
+				all.mean() / 1e3, all.pct(0.50) / 1e3,
+				all.pct(0.99) / 1e3, all.pct(0.999) / 1e3,
+				all.max / 1e3, errors);
+	}
+	bench_points++;
+}
+
+static void
+bench()
+{
+	if (bench_json) {
+		printf("{\"bench\": \"rpc\", \"ms\": %d, \"results\": [", bench_ms);
+	} else {
+		printf("%5s %5s %7s %-8s %7s %10s %9s %9s %9s %9s %9s %9s %6s\n",
+				"lossy", "conns", "threads", "workload", "size", "calls/s",
+				"MB/s", "mean(us)", "p50(us)", "p99(us)", "p999(us)",
+				"max(us)", "errors");
+	}
+	for (size_t l = 0; l < bench_lossy.size(); l++) {
+		char v[16];
+		sprintf(v, "%d", bench_lossy[l]);
+		VERIFY(setenv("RPC_LOSSY", v, 1) == 0);
+		if (server) {
+			delete server;
+			startserver();
+		}
+		for (size_t k = 0; k < bench_conns.size(); k++) {
+			std::vector<rpcc *> cl;
+			for (int i = 0; i < bench_conns[k]; i++) {
+				cl.push_back(new rpcc(dst));
+				VERIFY(cl.back()->bind() == 0);
+			}
+			for (size_t t = 0; t < bench_threads.size(); t++) {
+				if (bench_threads[t] < bench_conns[k])
+					continue;
+				for (size_t w = 0; w < bench_workloads.size(); w++) {
+					int wl = bench_workloads[w];
+					if (wl != W_ECHO && wl != W_BIGREP) {
+						bench_point(cl, bench_lossy[l], bench_threads[t], wl, 0);
+						continue;
+					}
+					for (size_t z = 0; z < bench_sizes.size(); z++)
+						bench_point(cl, bench_lossy[l], bench_threads[t], wl,
+								bench_sizes[z]);
+				}
+			}
+			for (size_t i = 0; i < cl.size(); i++)
+				delete cl[i];
+		}
+	}
+	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
+	if (bench_json)
+		printf("\n]}\n");
+}
+
+static void
+usage()
+{
+	fprintf(stderr, "Usage: rpctest [-c|-s] [-p port] [-d level] [-l]\n"
+			"       rpctest -b [-L lossy,...] [-k conns,...] [-t threads,...] "
+			"[-w workload,...] [-z size,...] [-T ms] [-j] [-c] [-p port]\n");
+	exit(1);
+}
+
+// a comma separated list of numbers, each at least min
+static std::vector<int>
+intlist(const char *s, int min)
+{
+	std::vector<int> v;
+	std::istringstream ist(s);
+	std::string n;
+	while (std::getline(ist, n, ',')) {
+		v.push_back(atoi(n.c_str()));
+		if (v.back() < min)
+			usage();
+	}
+	if (v.empty())
+		usage();
+	return v;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -400,8 +1657,9 @@ main(int argc, char *argv[])
 	srandom(getpid());
 	port = 20000 + (getpid() % 10000);
 
-	char ch = 0;
-	while ((ch = getopt(argc, argv, "csd:p:l"))!=-1) {
+	bool isbench = false;
+	int ch = 0;
+	while ((ch = getopt(argc, argv, "csd:p:lbL:k:t:w:z:T:j"))!=-1) {
 		switch (ch) {
 			case 'c':
 				isclient = true;
@@ -417,10 +1675,50 @@ main(int argc, char *argv[])
 				break;
 			case 'l':
 				VERIFY(setenv("RPC_LOSSY", "5", 1) == 0);
-			default:
 				break;
+			case 'b':
+				isbench = true;
+				break;
+			case 'L':
+				bench_lossy = intlist(optarg, 0);
+				break;
+			case 'k':
+				bench_conns = intlist(optarg, 1);
+				break;
+			case 't':
+				bench_threads = intlist(optarg, 1);
+				break;
+			case 'w': {
+				std::istringstream ist(optarg);
+				std::string w;
+				while (std::getline(ist, w, ',')) {
+					int i;
+					for (i = 0; i < NWORKLOADS; i++)
+						if (w == wnames[i])
+							break;
+					if (i == NWORKLOADS)
+						usage();
+					bench_workloads.push_back(i);
+				}
+				break;
+			}
+			case 'z':
+				bench_sizes = intlist(optarg, 0);
+				break;
+			case 'T':
+				bench_ms = atoi(optarg);
+				if (bench_ms < 1)
+					usage();
+				break;
+			case 'j':
+				bench_json = true;
+				break;
+			default:
+				usage();
 		}
 	}
+	if (optind < argc)
+		usage();
 
 	if (!isserver && !isclient)  {
 		isserver = isclient = true;
@@ -429,17 +1727,34 @@ main(int argc, char *argv[])
 	if (debug_level > 0) {
 		//__loginit.initNow();
 		jsl_set_debug(debug_level);
-		jsl_log(JSL_DBG_1, "DEBUG LEVEL: %d\n", debug_level);
 	}
 
-	testmarshall();
+	if (isbench) {
+		if (bench_lossy.empty())
+			bench_lossy = { 0, 5 };
+		if (bench_conns.empty())
+			bench_conns = { 1, 4 };
+		if (bench_threads.empty())
+			bench_threads = { 1, 4, 16 };
+		if (bench_workloads.empty())
+			for (int i = 0; i < NWORKLOADS; i++)
+				bench_workloads.push_back(i);
+		if (bench_sizes.empty())
+			bench_sizes = { 64, 4096, 65536 };
+	} else {
+		testmarshall();
+		testbufpool();
+		testcrc();
+		testthrpool();
+	}
 
 	pthread_attr_init(&attr);
 	// set stack size to 32K, so we don't run out of memory
 	pthread_attr_setstacksize(&attr, 32*1024);
 
 	if (isserver) {
-		printf("starting server on port %d RPC_HEADER_SZ %d\n", port, RPC_HEADER_SZ);
+		if (!isbench)
+			printf("starting server on port %d RPC_HEADER_SZ %d\n", port, RPC_HEADER_SZ);
 		startserver();
 	}
 
@@ -461,8 +1776,26 @@ main(int argc, char *argv[])
 			VERIFY (clients[i]->bind() == 0);
 		}
 
+		if (isbench) {
+			bench();
+			exit(0);
+		}
+
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		manyconns_test(200);
+		async_test(clients[0]);
+		batch_test();
+		if (!clients[0]->islossy())
+			old_server_test();
+		compress_test();
+		stats_test(clients[0]);
+		if (isserver) {
+			deadline_test(clients[0]);
+			deferred_test(clients[0]);
+			checksum_test();
+			transport_test();
+		}
 		lossy_test();
 		if (isserver) {
 			failure_test();
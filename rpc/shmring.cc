@@ -0,0 +1,319 @@
+#include "shmring.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "jsl_log.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#define SHM_NFDS 3   // the area, the client's bell, the server's bell
+
+// the fds go along with one byte of data, as SCM_RIGHTS needs some
+static bool
+send_fds(int s, const int *fds)
+{
+	char c = 0;
+	struct iovec v;
+	v.iov_base = &c;
+	v.iov_len = 1;
+	char cbuf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+	memset(cbuf, 0, sizeof(cbuf));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &v;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(SHM_NFDS * sizeof(int));
+	memcpy(CMSG_DATA(cm), fds, SHM_NFDS * sizeof(int));
+	return sendmsg(s, &msg, MSG_NOSIGNAL) == 1;
+}
+
+static bool
+recv_fds(int s, int *fds)
+{
+	// a client that connects and sends nothing must not hold up the
+	// accept thread for long
+	struct timeval tv;
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	char c;
+	struct iovec v;
+	v.iov_base = &c;
+	v.iov_len = 1;
+	char cbuf[CMSG_SPACE(SHM_NFDS * sizeof(int))];
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &v;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(s, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return false;
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if (!cm || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+			cm->cmsg_len != CMSG_LEN(SHM_NFDS * sizeof(int))) {
+		if (cm && cm->cmsg_type == SCM_RIGHTS) {
+			// close whatever did come along
+			int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			int *p = (int *) CMSG_DATA(cm);
+			for (int i = 0; i < n; i++)
+				close(p[i]);
+		}
+		return false;
+	}
+	memcpy(fds, CMSG_DATA(cm), SHM_NFDS * sizeof(int));
+	return true;
+}
+
+shmring::shmring(int s, area *a, int side, int mine, int peer)
+	: sock_(s), area_(a), rx_(&a->r[1 - side]), tx_(&a->r[side]),
+	mine_(mine), peer_(peer)
+{
+}
+
+shmring *
+shmring::connect(int s)
+{
+	int fds[SHM_NFDS] = { -1, -1, -1 };
+	void *p = MAP_FAILED;
+
+	fds[0] = syscall(SYS_memfd_create, "rpc-shmring", MFD_CLOEXEC);
+	if (fds[0] < 0 || ftruncate(fds[0], sizeof(area)) < 0)
+		goto fail;
+	p = mmap(NULL, sizeof(area), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (p == MAP_FAILED)
+		goto fail;
+	fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fds[1] < 0 || fds[2] < 0)
+		goto fail;
+
+	{
+		// the area starts out zeroed. each reader counts as asleep
+		// until it first finds its ring empty, so that the first
+		// write rings its bell.
+		area *a = (area *) p;
+		a->r[0].rsleep.store(1);
+		a->r[1].rsleep.store(1);
+		if (!send_fds(s, fds))
+			goto fail;
+		close(fds[0]);
+		return new shmring(s, a, 0, fds[1], fds[2]);
+	}
+
+fail:
+	jsl_log(JSL_DBG_1, "shmring::connect failed errno=%d\n", errno);
+	if (p != MAP_FAILED)
+		munmap(p, sizeof(area));
+	for (int i = 0; i < SHM_NFDS; i++) {
+		if (fds[i] >= 0)
+			close(fds[i]);
+	}
+	close(s);
+	return NULL;
+}
+
+shmring *
+shmring::accept(int s)
+{
+	int fds[SHM_NFDS];
+	if (!recv_fds(s, fds)) {
+		jsl_log(JSL_DBG_1, "shmring::accept got no fds errno=%d\n", errno);
+		close(s);
+		return NULL;
+	}
+
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fds[0], &st) == 0 && st.st_size == (off_t) sizeof(area))
+		p = mmap(NULL, sizeof(area), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (p == MAP_FAILED) {
+		jsl_log(JSL_DBG_1, "shmring::accept bad area errno=%d\n", errno);
+		close(fds[1]);
+		close(fds[2]);
+		close(s);
+		return NULL;
+	}
+	return new shmring(s, (area *) p, 1, fds[2], fds[1]);
+}
+
+shmring::~shmring()
+{
+	munmap(area_, sizeof(area));
+	close(sock_);
+	close(mine_);
+	close(peer_);
+}
+
+void
+shmring::ring_bell(int fd)
+{
+	uint64_t one = 1;
+	// fails only if the count would overflow, when it is rung anyway
+	if (write(fd, &one, sizeof(one)) < 0)
+		jsl_log(JSL_DBG_4, "shmring::ring_bell errno=%d\n", errno);
+}
+
+// head and tail live where the peer can write them. if they say the ring
+// holds more than it can, the peer is broken or hostile, and so is the
+// stream: -1 with EPIPE.
+static bool
+broken(uint64_t h, uint64_t t)
+{
+	if (t - h <= SHM_RING_SZ)
+		return false;
+	jsl_log(JSL_DBG_1, "shmring: bad ring head %llu tail %llu\n",
+			(unsigned long long) h, (unsigned long long) t);
+	errno = EPIPE;
+	return true;
+}
+
+ssize_t
+shmring::read(void *buf, size_t n)
+{
+	ring *r = rx_;
+	uint64_t h = r->head.load(std::memory_order_relaxed);
+	uint64_t t = r->tail.load(std::memory_order_acquire);
+	if (h == t) {
+		// ask to be rung, then look again in case the writer came
+		// by before it could see that
+		r->rsleep.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		bool closed = r->closed.load(std::memory_order_acquire);
+		t = r->tail.load(std::memory_order_acquire);
+		if (h == t) {
+			if (closed)
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+		r->rsleep.store(0, std::memory_order_relaxed);
+	}
+
+	if (broken(h, t))
+		return -1;
+	size_t m = t - h;
+	if (m > n)
+		m = n;
+	size_t off = h & (SHM_RING_SZ - 1);
+	size_t first = SHM_RING_SZ - off < m ? SHM_RING_SZ - off : m;
+	memcpy(buf, r->data + off, first);
+	memcpy((char *) buf + first, r->data, m - first);
+	r->head.store(h + m, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (r->wsleep.load(std::memory_order_relaxed) && r->wsleep.exchange(0))
+		ring_bell(peer_);
+	return m;
+}
+
+ssize_t
+shmring::writev(const struct iovec *iov, int iovcnt)
+{
+	ring *r = tx_;
+	if (r->closed.load(std::memory_order_acquire)) {
+		errno = EPIPE;
+		return -1;
+	}
+	uint64_t t = r->tail.load(std::memory_order_relaxed);
+	uint64_t h = r->head.load(std::memory_order_acquire);
+	if (broken(h, t))
+		return -1;
+	size_t room = SHM_RING_SZ - (t - h);
+	if (room == 0) {
+		r->wsleep.store(1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		h = r->head.load(std::memory_order_acquire);
+		if (broken(h, t))
+			return -1;
+		room = SHM_RING_SZ - (t - h);
+		if (room == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		r->wsleep.store(0, std::memory_order_relaxed);
+	}
+
+	size_t m = 0;
+	for (int i = 0; i < iovcnt && m < room; i++) {
+		size_t k = iov[i].iov_len < room - m ? iov[i].iov_len : room - m;
+		size_t off = (t + m) & (SHM_RING_SZ - 1);
+		size_t first = SHM_RING_SZ - off < k ? SHM_RING_SZ - off : k;
+		memcpy(r->data + off, iov[i].iov_base, first);
+		memcpy(r->data, (const char *) iov[i].iov_base + first, k - first);
+		m += k;
+	}
+	r->tail.store(t + m, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (r->rsleep.load(std::memory_order_relaxed) && r->rsleep.exchange(0))
+		ring_bell(peer_);
+	return m;
+}
+
+void
+shmring::shutdown()
+{
+	area_->r[0].closed.store(1, std::memory_order_release);
+	area_->r[1].closed.store(1, std::memory_order_release);
+	ring_bell(peer_);
+	ring_bell(mine_);
+}
+
+bool
+shmring::peer_gone()
+{
+	char c;
+	ssize_t n = recv(sock_, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+			errno != EINTR);
+}
+
+#else /* !__linux__ */
+
+// no eventfd or memfd: shm: addresses fail to connect
+
+shmring *
+shmring::connect(int s)
+{
+	jsl_log(JSL_DBG_OFF, "shmring: not supported on this platform\n");
+	close(s);
+	return NULL;
+}
+
+shmring *
+shmring::accept(int s)
+{
+	close(s);
+	return NULL;
+}
+
+shmring::~shmring() {}
+void shmring::ring_bell(int fd) {}
+ssize_t shmring::read(void *buf, size_t n) { errno = EPIPE; return -1; }
+ssize_t shmring::writev(const struct iovec *iov, int iovcnt) { errno = EPIPE; return -1; }
+void shmring::shutdown() {}
+bool shmring::peer_gone() { return true; }
+
+#endif /* __linux__ */
@@ -0,0 +1,80 @@
+#ifndef shmring_h
+#define shmring_h
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdint.h>
+#include <atomic>
+
+// A connection's byte stream through shared memory, for peers on the
+// same host.
+//
+// The two sides map one memfd holding a single-producer single-consumer
+// byte ring per direction, and each has an eventfd as its doorbell,
+// which is what the reactor watches in place of a socket. A writer
+// rings the reader's bell only if the reader found its ring empty, and
+// a reader rings the writer's only if the writer found its ring full,
+// so a busy stream makes few syscalls. The fds are passed over a
+// unix-domain socket, which then stays open so that either side can
+// tell when the other process has gone.
+//
+// read() and writev() behave like their nonblocking socket namesakes:
+// short counts, -1 with EAGAIN when there is nothing to do, and read()
+// returns 0 once the peer has shut the stream down and it is drained.
+// A peer that leaves head or tail out of range gets -1 with EPIPE.
+// Each ring has one reading and one writing thread at a time; the
+// connection's locking sees to that.
+
+#define SHM_RING_SZ (1 << 20)   // bytes per direction, power of two
+
+class shmring {
+	public:
+		// client side: set up the shared area and bells and hand them to
+		// the server over the connected unix socket s, which the ring
+		// then owns. NULL on failure, with s closed.
+		static shmring *connect(int s);
+		// server side: take them from the accepted socket s
+		static shmring *accept(int s);
+		~shmring();
+
+		// this side's doorbell, an eventfd to watch for reading. the
+		// caller reads it to reset it.
+		int fd() { return mine_; }
+
+		ssize_t read(void *buf, size_t n);
+		ssize_t writev(const struct iovec *iov, int iovcnt);
+
+		// end the stream both ways and wake both sides, as shutdown()
+		// does for a socket
+		void shutdown();
+		// the peer process has closed its end of the socket
+		bool peer_gone();
+
+	private:
+		struct ring {
+			std::atomic<uint64_t> head;   // next byte to read
+			char pad0[56];
+			std::atomic<uint64_t> tail;   // next byte to write
+			char pad1[56];
+			std::atomic<uint32_t> rsleep; // reader found it empty
+			std::atomic<uint32_t> wsleep; // writer found it full
+			std::atomic<uint32_t> closed;
+			char pad2[52];
+			char data[SHM_RING_SZ];
+		};
+		struct area {
+			ring r[2];   // client to server, server to client
+		};
+
+		shmring(int s, area *a, int side, int mine, int peer);
+		void ring_bell(int fd);
+
+		int sock_;
+		area *area_;
+		ring *rx_;
+		ring *tx_;
+		int mine_;
+		int peer_;
+};
+
+#endif
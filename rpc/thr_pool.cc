@@ -2,68 +2,432 @@
 #include "thr_pool.h"
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/time.h>
 #include "lang/verify.h"
 
-static void *
-do_worker(void *arg)
+// the pool and slot of the worker running on this thread, if any
+static __thread ThrPool *cur_pool_;
+static __thread int cur_id_;
+
+bool
+ThrPool::wsdeque::push(const job_t &j)
 {
-	ThrPool *tp = (ThrPool *)arg;
-	while (1) {
-		ThrPool::job_t j;
-		if (!tp->takeJob(&j))
-			break; //die
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+	if (b - t >= THRPOOL_DEQUE)
+		return false;
+	f[b & (THRPOOL_DEQUE - 1)].store(j.f, std::memory_order_relaxed);
+	a[b & (THRPOOL_DEQUE - 1)].store(j.a, std::memory_order_relaxed);
+	bottom.store(b + 1, std::memory_order_release);
+	return true;
+}
 
-		(void)(j.f)(j.a);
+bool
+ThrPool::wsdeque::pop(job_t *j)
+{
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = top.load(std::memory_order_relaxed);
+	if (t > b) {
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return false;
+	}
+	j->f = f[b & (THRPOOL_DEQUE - 1)].load(std::memory_order_relaxed);
+	j->a = a[b & (THRPOOL_DEQUE - 1)].load(std::memory_order_relaxed);
+	if (t == b) {
+		// the last one: race the thieves for it
+		bool won = top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return won;
 	}
-	pthread_exit(NULL);
+	return true;
+}
+
+bool
+ThrPool::wsdeque::steal(job_t *j)
+{
+	int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	if (t >= b)
+		return false;
+	j->f = f[t & (THRPOOL_DEQUE - 1)].load(std::memory_order_relaxed);
+	j->a = a[t & (THRPOOL_DEQUE - 1)].load(std::memory_order_relaxed);
+	return top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+bool
+ThrPool::wsdeque::empty()
+{
+	return top.load(std::memory_order_acquire) >=
+		bottom.load(std::memory_order_acquire);
+}
+
+void *
+ThrPool::do_worker(void *arg)
+{
+	worker *w = (worker *)arg;
+	ThrPool *tp = w->tp;
+	int id = w->id;
+	delete w;
+	tp->run(id);
+	return NULL;
+}
+
+void *
+ThrPool::do_watch(void *arg)
+{
+	((ThrPool *)arg)->watch();
+	return NULL;
 }
 
 //if blocking, then addJob() blocks when queue is full
 //otherwise, addJob() simply returns false when queue is full
-ThrPool::ThrPool(int sz, bool blocking)
-: nthreads_(sz),blockadd_(blocking),jobq_(100*sz) 
+ThrPool::ThrPool(int sz, bool blocking, int maxsz)
+: minthreads_(sz), maxthreads_(maxsz > sz ? maxsz : sz), blockadd_(blocking),
+	enq_(0), deq_(0), sleepers_(0), space_waiters_(0), nthreads_(0),
+	shutdown_(false), watch_idle_(false), jobs_run_(0)
 {
 	pthread_attr_init(&attr_);
 	pthread_attr_setstacksize(&attr_, 128<<10);
+	VERIFY(pthread_mutex_init(&m_, 0) == 0);
+	VERIFY(pthread_cond_init(&work_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&space_c_, 0) == 0);
+
+	uint64_t n = 1;
+	while (n < (uint64_t) (100*sz))
+		n <<= 1;
+	q_ = new cell[n];
+	qmask_ = n - 1;
+	for (uint64_t i = 0; i < n; i++)
+		q_[i].seq.store(i, std::memory_order_relaxed);
+
+	deques_ = new wsdeque[maxthreads_];
+	for (int i = 0; i < maxthreads_; i++) {
+		deques_[i].top.store(0, std::memory_order_relaxed);
+		deques_[i].bottom.store(0, std::memory_order_relaxed);
+	}
+	th_.resize(maxthreads_);
+	started_.resize(maxthreads_, false);
+	slot_used_.resize(maxthreads_, false);
 
-	for (int i = 0; i < sz; i++) {
-		pthread_t t;
-		VERIFY(pthread_create(&t, &attr_, do_worker, (void *)this) ==0);
-		th_.push_back(t);
+	ScopedLock ml(&m_);
+	for (int i = 0; i < sz; i++)
+		spawn();
+	if (maxthreads_ > minthreads_) {
+		VERIFY(pthread_cond_init(&watch_c_, 0) == 0);
+		VERIFY(pthread_create(&watch_th_, &attr_, do_watch, (void *)this) == 0);
 	}
 }
 
-//IMPORTANT: this function can be called only when no external thread 
-//will ever use this thread pool again or is currently blocking on it
+//IMPORTANT: this function can be called only when no external thread
+//will ever use this thread pool again or is currently blocking on it.
+//jobs already added still run.
 ThrPool::~ThrPool()
 {
-	for (int i = 0; i < nthreads_; i++) {
-		job_t j;
-		j.f = (void *(*)(void *))NULL; //poison pill to tell worker threads to exit
-		jobq_.enq(j);
+	{
+		ScopedLock ml(&m_);
+		shutdown_ = true;
+		VERIFY(pthread_cond_broadcast(&work_c_) == 0);
+		if (maxthreads_ > minthreads_)
+			VERIFY(pthread_cond_signal(&watch_c_) == 0);
+	}
+	if (maxthreads_ > minthreads_) {
+		VERIFY(pthread_join(watch_th_, NULL) == 0);
+		VERIFY(pthread_cond_destroy(&watch_c_) == 0);
 	}
 
-	for (int i = 0; i < nthreads_; i++) {
-		VERIFY(pthread_join(th_[i], NULL)==0);
+	for (int i = 0; i < maxthreads_; i++) {
+		if (started_[i])
+			VERIFY(pthread_join(th_[i], NULL)==0);
 	}
 
+	delete[] q_;
+	delete[] deques_;
+	VERIFY(pthread_cond_destroy(&work_c_) == 0);
+	VERIFY(pthread_cond_destroy(&space_c_) == 0);
+	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_attr_destroy(&attr_)==0);
 }
 
-bool 
+void
+ThrPool::spawn()
+{
+	int i = 0;
+	while (slot_used_[i])
+		i++;
+	if (started_[i]) {
+		// its last worker has given up the slot and is exiting
+		VERIFY(pthread_join(th_[i], NULL) == 0);
+	}
+	worker *w = new worker;
+	w->tp = this;
+	w->id = i;
+	VERIFY(pthread_create(&th_[i], &attr_, do_worker, (void *)w) == 0);
+	started_[i] = true;
+	slot_used_[i] = true;
+	nthreads_++;
+}
+
+bool
+ThrPool::full()
+{
+	return enq_.load(std::memory_order_relaxed) -
+		deq_.load(std::memory_order_relaxed) > qmask_;
+}
+
+// every worker has a job waiting behind the one it runs. this counts
+// the jobs in the deques too: a worker blocked in a job may still hold
+// the ones it took along, and only a free worker can steal them.
+bool
+ThrPool::backlog()
+{
+	int64_t queued = enq_.load(std::memory_order_relaxed) -
+		deq_.load(std::memory_order_relaxed);
+	for (int i = 0; i < maxthreads_; i++) {
+		int64_t n = deques_[i].bottom.load(std::memory_order_relaxed) -
+			deques_[i].top.load(std::memory_order_relaxed);
+		if (n > 0)
+			queued += n;
+	}
+	return queued >= nthreads_.load(std::memory_order_relaxed);
+}
+
+bool
+ThrPool::enq(const job_t &j)
+{
+	uint64_t pos = enq_.load(std::memory_order_relaxed);
+	cell *c;
+	while (1) {
+		c = &q_[pos & qmask_];
+		uint64_t seq = c->seq.load(std::memory_order_acquire);
+		int64_t diff = (int64_t) seq - (int64_t) pos;
+		if (diff == 0) {
+			if (enq_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = enq_.load(std::memory_order_relaxed);
+		}
+	}
+	c->j = j;
+	c->seq.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+bool
+ThrPool::deq(job_t *j)
+{
+	uint64_t pos = deq_.load(std::memory_order_relaxed);
+	cell *c;
+	while (1) {
+		c = &q_[pos & qmask_];
+		uint64_t seq = c->seq.load(std::memory_order_acquire);
+		int64_t diff = (int64_t) seq - (int64_t) (pos + 1);
+		if (diff == 0) {
+			if (deq_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			return false;
+		} else {
+			pos = deq_.load(std::memory_order_relaxed);
+		}
+	}
+	*j = c->j;
+	c->seq.store(pos + qmask_ + 1, std::memory_order_release);
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (space_waiters_.load(std::memory_order_relaxed) > 0) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_broadcast(&space_c_) == 0);
+	}
+	return true;
+}
+
+void
+ThrPool::notify()
+{
+	ScopedLock ml(&m_);
+	VERIFY(pthread_cond_signal(&work_c_) == 0);
+}
+
+// a job was just added: wake a sleeping worker, or else the watcher if
+// it is waiting for jobs to show up. the caller has fenced, so either
+// they see the job or it is seen here asleep.
+void
+ThrPool::kick()
+{
+	if (sleepers_.load(std::memory_order_relaxed) > 0) {
+		notify();
+	} else if (watch_idle_.load(std::memory_order_relaxed)) {
+		ScopedLock ml(&m_);
+		VERIFY(pthread_cond_signal(&watch_c_) == 0);
+	}
+}
+
+bool
 ThrPool::addJob(void *(*f)(void *), void *a)
 {
 	job_t j;
 	j.f = f;
 	j.a = a;
 
-	return jobq_.enq(j,blockadd_);
+	if (cur_pool_ == this && deques_[cur_id_].push(j)) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		kick();
+		return true;
+	}
+
+	while (!enq(j)) {
+		if (!blockadd_)
+			return false;
+		ScopedLock ml(&m_);
+		space_waiters_++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (full())
+			VERIFY(pthread_cond_wait(&space_c_, &m_) == 0);
+		space_waiters_--;
+	}
+
+	// a worker that is about to sleep either sees the job or is seen
+	// here as a sleeper
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	kick();
+	if (sleepers_.load(std::memory_order_relaxed) == 0 &&
+			nthreads_.load(std::memory_order_relaxed) < maxthreads_ && backlog()) {
+		ScopedLock ml(&m_);
+		if (!shutdown_ && nthreads_ < maxthreads_ && sleepers_ == 0)
+			spawn();
+	}
+	return true;
 }
 
-bool 
-ThrPool::takeJob(job_t *j)
+bool
+ThrPool::find_job(int self, job_t *j)
 {
-	jobq_.deq(j);
-	return (j->f!=NULL);
+	if (deques_[self].pop(j))
+		return true;
+
+	if (deq(j)) {
+		// take a few more along; if this job runs long, idle workers
+		// steal them
+		job_t x;
+		int n = 0;
+		while (n < THRPOOL_GRAB - 1 && deq(&x)) {
+			VERIFY(deques_[self].push(x));
+			n++;
+		}
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (n && sleepers_.load(std::memory_order_relaxed) > 0)
+			notify();
+		return true;
+	}
+
+	for (int i = 1; i < maxthreads_; i++) {
+		if (deques_[(self + i) % maxthreads_].steal(j))
+			return true;
+	}
+	return false;
+}
+
+bool
+ThrPool::has_work()
+{
+	if (enq_.load(std::memory_order_acquire) != deq_.load(std::memory_order_acquire))
+		return true;
+	for (int i = 0; i < maxthreads_; i++) {
+		if (!deques_[i].empty())
+			return true;
+	}
+	return false;
 }
 
+void
+ThrPool::run(int self)
+{
+	cur_pool_ = this;
+	cur_id_ = self;
+
+	while (1) {
+		job_t j;
+		if (find_job(self, &j)) {
+			if (maxthreads_ > minthreads_)
+				jobs_run_.fetch_add(1, std::memory_order_relaxed);
+			(void)(j.f)(j.a);
+			continue;
+		}
+
+		ScopedLock ml(&m_);
+		sleepers_++;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (has_work()) {
+			sleepers_--;
+			continue;
+		}
+		if (shutdown_) {
+			sleepers_--;
+			break;
+		}
+		if (nthreads_ <= minthreads_) {
+			VERIFY(pthread_cond_wait(&work_c_, &m_) == 0);
+			sleepers_--;
+			continue;
+		}
+
+		// an extra worker: exit if nothing comes for a while
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + THRPOOL_IDLE_SECS;
+		deadline.tv_nsec = now.tv_usec * 1000;
+		int r = pthread_cond_timedwait(&work_c_, &m_, &deadline);
+		VERIFY(r == 0 || r == ETIMEDOUT);
+		sleepers_--;
+		if (r == ETIMEDOUT && !shutdown_ && nthreads_ > minthreads_ && !has_work()) {
+			slot_used_[self] = false;
+			nthreads_--;
+			break;
+		}
+	}
+}
+
+// Start a worker when jobs wait and no worker has taken up a new job for
+// THRPOOL_STALL_MS. addJob() only grows the pool while jobs come in, so
+// without this, workers all blocked on a job still queued behind them
+// would wait forever.
+void
+ThrPool::watch()
+{
+	ScopedLock ml(&m_);
+	uint64_t last = jobs_run_.load(std::memory_order_relaxed);
+	while (!shutdown_) {
+		watch_idle_.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!has_work()) {
+			VERIFY(pthread_cond_wait(&watch_c_, &m_) == 0);
+			watch_idle_.store(false, std::memory_order_relaxed);
+			last = jobs_run_.load(std::memory_order_relaxed);
+			continue;
+		}
+		watch_idle_.store(false, std::memory_order_relaxed);
+
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		int64_t ns = (int64_t) now.tv_usec * 1000 + THRPOOL_STALL_MS * 1000000LL;
+		deadline.tv_sec = now.tv_sec + ns / 1000000000;
+		deadline.tv_nsec = ns % 1000000000;
+		int r = pthread_cond_timedwait(&watch_c_, &m_, &deadline);
+		VERIFY(r == 0 || r == ETIMEDOUT);
+
+		uint64_t n = jobs_run_.load(std::memory_order_relaxed);
+		if (n == last && !shutdown_ && sleepers_ == 0 &&
+				nthreads_ < maxthreads_ && has_work())
+			spawn();
+		last = n;
+	}
+}
@@ -2,9 +2,30 @@
 #define __THR_POOL__
 
 #include <pthread.h>
+#include <stdint.h>
+#include <atomic>
 #include <vector>
 
-#include "fifo.h"
+// A work-stealing thread pool.
+//
+// Jobs added from outside the pool go into a bounded lock-free queue
+// (100*sz entries, as the old fifo had); a worker pulls a few of them
+// at a time into its own deque, where idle workers can steal them.
+// Jobs added by a worker of the pool go straight to that worker's
+// deque. Workers sleep only when there is nothing anywhere, and adding
+// a job takes no lock unless a worker is asleep.
+//
+// With maxsz > sz the pool is elastic: when a job is added while every
+// worker is busy, another worker is started, up to maxsz; workers
+// beyond sz exit again after a few idle seconds. A watcher thread also
+// starts one whenever jobs have waited THRPOOL_STALL_MS without any
+// worker taking up a new one, as when every worker is blocked in a job
+// and nothing more is added to notice.
+
+#define THRPOOL_DEQUE 256        // per-worker deque, power of two
+#define THRPOOL_GRAB 8           // jobs moved from the shared queue at once
+#define THRPOOL_IDLE_SECS 2      // before an elastic worker exits
+#define THRPOOL_STALL_MS 10      // jobs wait this long before the watcher adds a worker
 
 class ThrPool {
 
@@ -15,26 +36,84 @@ class ThrPool {
 			void *a; //function arguments
 		};
 
-		ThrPool(int sz, bool blocking=true);
+		ThrPool(int sz, bool blocking=true, int maxsz=0);
 		~ThrPool();
 		template<class C, class A> bool addObjJob(C *o, void (C::*m)(A), A a);
 		void waitDone();
 
-		bool takeJob(job_t *j);
+		// false if the shared queue is full, so a non-blocking
+		// addObjJob() would fail
+		bool full();
+		int nthreads() { return nthreads_; }
 
 	private:
+		// bounded MPMC queue (Vyukov)
+		struct cell {
+			std::atomic<uint64_t> seq;
+			job_t j;
+		};
+		// bounded Chase-Lev deque: the owner pushes and pops at the
+		// bottom, thieves take from the top
+		struct wsdeque {
+			std::atomic<int64_t> top, bottom;
+			std::atomic<void *(*)(void *)> f[THRPOOL_DEQUE];
+			std::atomic<void *> a[THRPOOL_DEQUE];
+			bool push(const job_t &j);
+			bool pop(job_t *j);
+			bool steal(job_t *j);
+			bool empty();
+		};
+		struct worker {
+			ThrPool *tp;
+			int id;
+		};
+
 		pthread_attr_t attr_;
-		int nthreads_;
+		const int minthreads_;
+		const int maxthreads_;
 		bool blockadd_;
 
+		cell *q_;
+		uint64_t qmask_;
+		std::atomic<uint64_t> enq_, deq_;
+		wsdeque *deques_;    // maxthreads_ of them, one per worker slot
 
-		fifo<job_t> jobq_;
+		// worker slots, under m_. a slot whose worker exited keeps its
+		// thread unjoined until the slot is reused or the pool deleted.
 		std::vector<pthread_t> th_;
+		std::vector<bool> started_;
+		std::vector<bool> slot_used_;
+
+		pthread_mutex_t m_;
+		pthread_cond_t work_c_;    // something to do
+		pthread_cond_t space_c_;   // room in the shared queue
+		std::atomic<int> sleepers_;
+		std::atomic<int> space_waiters_;
+		std::atomic<int> nthreads_;
+		bool shutdown_;
+
+		// elastic pools only
+		pthread_t watch_th_;
+		pthread_cond_t watch_c_;
+		std::atomic<bool> watch_idle_;  // waiting for a job to be added
+		std::atomic<uint64_t> jobs_run_;
 
 		bool addJob(void *(*f)(void *), void *a);
+		bool enq(const job_t &j);
+		bool deq(job_t *j);
+		bool find_job(int self, job_t *j);
+		bool has_work();
+		bool backlog();
+		void notify();
+		void kick();
+		void spawn();  // with m_ held
+		void run(int self);
+		void watch();
+		static void *do_worker(void *arg);
+		static void *do_watch(void *arg);
 };
 
-	template <class C, class A> bool 
+	template <class C, class A> bool
 ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 {
 
@@ -58,9 +137,12 @@ ThrPool::addObjJob(C *o, void (C::*m)(A), A a)
 	x->o = o;
 	x->m = m;
 	x->a = a;
-	return addJob(&objfunc_wrapper::func, (void *)x);
+	if (!addJob(&objfunc_wrapper::func, (void *)x)) {
+		delete x;
+		return false;
+	}
+	return true;
 }
 
 
 #endif
-